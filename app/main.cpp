@@ -1,23 +1,30 @@
 #include <liftedvulkan.h>
 
-const uint32_t WINDOW_WIDTH = 1024;
-const uint32_t WINDOW_HEIGHT = 512;
-
 int main(int argc, char** argv) {
     logger::set_level(spdlog::level::debug);
 
     lv::AppContextInfo info;
+    info.registerExtension<lv::Window>();
     info.registerExtension<lv::ResourceStore>();
     info.registerExtension<lv::RayTracer>();
     info.registerExtension<lv::Rasterizer>();
     info.registerExtension<lv::Overlay>();
-    info.registerExtension<lv::ComputeShader>();
+    info.registerExtension<lv::Reduction>();
+    info.registerExtension<lv::GpuProfiler>();
+    info.registerExtension<lv::RenderGraph>();
     lv::AppContext ctx(info);
 
 
+    lv::RayTracerInfo rayInfo{};
+    rayInfo.accumulationMode = lv::AccumulationMode::Mean16;
+
+    // Falls back to Sum32 where the mode can not be stored
+    rayInfo.adaptFormats(ctx);
+
     lv::ResourceStoreInfo resourceStoreInfo;
-    resourceStoreInfo.defineStaticImage(1, VK_FORMAT_R32G32B32A32_SFLOAT, VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_IMAGE_LAYOUT_GENERAL);
-    resourceStoreInfo.defineBuffer(0, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, sizeof(float));
+    resourceStoreInfo.defineStaticImage(1, rayInfo.getAccumulationFormat(), VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_IMAGE_LAYOUT_GENERAL,
+        [](lv::FrameContext& frame) { return frame.getExtFrame<lv::WindowFrame>().width; },
+        [](lv::FrameContext& frame) { return frame.getExtFrame<lv::WindowFrame>().height; });
     auto& imageStore = ctx.addExtension<lv::ResourceStore>(ctx, resourceStoreInfo);
 
     lv::RasterizerInfo rastInfo("app/shaders_bin/quad.vert.spv", "app/shaders_bin/quad.frag.spv");
@@ -25,18 +32,24 @@ int main(int argc, char** argv) {
     rastInfo.defineTexture(0, [](lv::FrameContext& frame) { return frame.getExtFrame<lv::ResourceFrame>().getStatic(1)->view; });
     auto& rasterizer = ctx.addExtension<lv::Rasterizer>(ctx, rastInfo);
 
-    lv::RayTracerInfo rayInfo{};
     lv::Mesh sibenik, bunny;
     bunny.load("./app/cube.obj");
     sibenik.load("./app/sibenik/sibenik.obj");
-    rayInfo.meshes.push_back(&sibenik);
-    rayInfo.meshes.push_back(&bunny);
+    rayInfo.addMesh(&sibenik);
+    rayInfo.addMesh(&bunny);
+    rayInfo.compactAccelerationStructures = true;
+    rayInfo.allowWavefront = true;
     auto& raytracer = ctx.addExtension<lv::RayTracer>(ctx, rayInfo);
 
-    lv::ComputeShaderInfo sumImageInfo{};
-    sumImageInfo.addBufferBinding(0, [](lv::FrameContext& frame) { return frame.getExtFrame<lv::ResourceFrame>().getBuffer(0).buffer; });
-    sumImageInfo.addImageBinding(1, [](lv::FrameContext& frame) { return frame.getExtFrame<lv::ResourceFrame>().getStatic(1)->view; });
-    auto& sumImage = ctx.addExtension<lv::ComputeShader>(ctx, "./app/shaders_bin/sumImage.comp.spv", sumImageInfo);
+    // Total energy in the converged image, every pixel of it
+    lv::ReductionInfo reductionInfo{};
+    reductionInfo.defineImageReduction(0, lv::ReductionOp::Sum, lv::ReductionValue::ChannelSum,
+        [](lv::FrameContext& frame) { return frame.getExtFrame<lv::ResourceFrame>().getStatic(1)->view; },
+        [](lv::FrameContext& frame) { auto& wFrame = frame.getExtFrame<lv::WindowFrame>(); return VkExtent2D { wFrame.width, wFrame.height }; },
+        true);
+    auto& reduction = ctx.addExtension<lv::Reduction>(ctx, reductionInfo);
+
+    auto& profiler = ctx.addExtension<lv::GpuProfiler>(ctx);
 
     lv::WindowInfo windowInfo;
     windowInfo.width = 1280;
@@ -51,66 +64,92 @@ int main(int argc, char** argv) {
     overlayInfo.frameManager = &window;
     overlayInfo.glfwWindow = window.getGLFWwindow();
     overlayInfo.renderPass = rasterizer.getRenderPass();
+    overlayInfo.profiler = &profiler;
     auto& overlay = ctx.addExtension<lv::Overlay>(ctx, overlayInfo);
 
+    lv::RenderBudget renderBudget;
+
     uint32_t tick = 0;
     double ping = glfwGetTime();
     float fps = 0.0f;
+    float energy = 0.0f;
+
+    // The graph derives every barrier between these from what they declare to touch
+    lv::RenderGraphInfo graphInfo{};
+    graphInfo.resourceStore = &imageStore;
+    // The budget pass reads the accumulator in compute within the tracer
+    graphInfo.definePass("RayTracer", VK_PIPELINE_STAGE_2_RAY_TRACING_SHADER_BIT_KHR | VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, [&](lv::FrameContext& frame) {
+            lv::GpuProfiler::Scope scope(profiler, frame, "RayTracer");
+            raytracer.render(frame, camera, overlay.NEE);
+        })
+        .useStaticImage(1, lv::GraphUsage::StorageWrite);
+    // Collect info about the amount of energy, read back on the host
+    graphInfo.definePass("Reduction", VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, [&](lv::FrameContext& frame) {
+            lv::GpuProfiler::Scope scope(profiler, frame, "Reduction");
+            reduction.record(frame, 0);
+        })
+        .useStaticImage(1, lv::GraphUsage::StorageRead)
+        .withSideEffects();
+    // Draws to the swapchain, which the graph does not track
+    graphInfo.definePass("Rasterizer", VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT, [&](lv::FrameContext& frame) {
+            lv::GpuProfiler::Scope scope(profiler, frame, "Rasterizer");
+            rasterizer.startPass(frame);
+            vkCmdDraw(frame.cmdBuffer, 3, 1, 0, 0);
+            {
+                lv::GpuProfiler::Scope overlayScope(profiler, frame, "Overlay");
+                overlay.render(frame, energy, fps);
+            }
+            rasterizer.endPass(frame);
+        })
+        .useStaticImage(1, lv::GraphUsage::Sampled)
+        .withSideEffects();
+    auto& graph = ctx.addExtension<lv::RenderGraph>(ctx, graphInfo);
+
+    if (!profiler.isSupported()) {
+        logger::info("No GPU timestamps on this device, frames are not budgeted and trace {} samples over every tile", raytracer.getSamplesPerFrame());
+    }
+
     while(!window.shouldClose()) {
 
         window.nextFrame([&](lv::FrameContext& frame) {
-            auto& imgStore = frame.getExtFrame<lv::ResourceFrame>();
-            auto& rastFrame = frame.getExtFrame<lv::RasterizerFrame>();
-            auto& sumImageFrame = frame.getExtFrame<lv::ComputeFrame>();
-
             float dt = glfwGetTime() - ping;
             ping = glfwGetTime();
+            fps = 0.9f * fps + 0.1f * (1.0f / dt);
 
-            imgStore.getBuffer(0).getData<float>()[0] = 0;
+            // The frame's last use was waited on, so this is what it summed last time around
+            energy = reduction.getValue(frame, 0);
 
             // Run the raytracer
             camera.update(dt);
             if (camera.getHasMoved()) raytracer.resetAccumulator();
-            raytracer.render(frame, camera, overlay.NEE);
-            
-            // Collect info about the amount of energy
-            vkCmdBindPipeline(frame.cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, sumImage.pipeline);
-            vkCmdBindDescriptorSets(frame.cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, sumImage.pipelineLayout, 0, 1, &sumImageFrame.descriptorSet, 0, nullptr);
-            vkCmdDispatch(frame.cmdBuffer, WINDOW_WIDTH / 64, WINDOW_HEIGHT / 64, 1);
-
-            // Prepare the image to be sampled when rendering to the screen
-            auto barrier = vks::initializers::imageMemoryBarrier(
-                    imgStore.getStatic(1)->image,
-                    VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
-            vkCmdPipelineBarrier(
-                    frame.cmdBuffer,
-                    VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-                    VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
-                    VK_DEPENDENCY_BY_REGION_BIT,
-                    0, nullptr,
-                    0, nullptr,
-                    1, &barrier);
-
-            rasterizer.startPass(frame);
-            vkCmdDraw(frame.cmdBuffer, 3, 1, 0, 0);
-
-            fps = 0.9f * fps + 0.1f * (1.0f / dt);
-            overlay.render(frame, *frame.fPrev->getExtFrame<lv::ResourceFrame>().getBuffer(0).getData<float>(), fps);
-            rasterizer.endPass(frame);
-
-
-            // Set the image back for ray tracing
-            barrier = vks::initializers::imageMemoryBarrier(
-                    imgStore.getStatic(1)->image,
-                    VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_IMAGE_LAYOUT_GENERAL);
-            vkCmdPipelineBarrier(
-                    frame.cmdBuffer,
-                    VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
-                    VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-                    VK_DEPENDENCY_BY_REGION_BIT,
-                    0, nullptr,
-                    0, nullptr,
-                    1, &barrier);
+            raytracer.setAdaptiveSampling(overlay.adaptiveSampling);
+            raytracer.setLightSampling(overlay.lightBvh ? lv::LightSampling::LightBvh : lv::LightSampling::AliasTable);
+            const bool wavefront = overlay.wavefront && raytracer.supportsWavefront();
+            raytracer.setBackend(wavefront ? lv::RayTracerBackend::Wavefront : lv::RayTracerBackend::Megakernel);
+            // The wavefront sorts its queues, the megakernel can only hint the hardware
+            lv::RayReordering reordering = lv::RayReordering::None;
+            if (overlay.reorderRays && wavefront) reordering = lv::RayReordering::Sort;
+            else if (overlay.reorderRays && raytracer.supportsExecutionReorder()) reordering = lv::RayReordering::ExecutionReorder;
+            raytracer.setRayReordering(reordering);
+
+            // Budget by what the GPU took the last time this frame was used
+            if (profiler.isSupported()) {
+                const auto& rtFrame = frame.getExtFrame<lv::RayTracerFrame>();
+                double rayTracerMs = 0.0, restMs = 0.0;
+                for(const auto& timing : profiler.getTimings()) {
+                    if (timing.depth != 0) continue;
+                    (timing.name == "RayTracer" ? rayTracerMs : restMs) += timing.getMilliseconds();
+                }
+                if (rtFrame.tracedPreview) renderBudget.addPreviewMeasurement(rayTracerMs, restMs, rtFrame.tracedTiles);
+                else renderBudget.addMeasurement(rayTracerMs, restMs, rtFrame.tracedSamples, rtFrame.tracedTiles);
+                renderBudget.setTarget(overlay.frameBudget);
+                renderBudget.plan(raytracer.getNrTiles());
+                raytracer.setSamplesPerFrame(renderBudget.getSamples());
+                raytracer.setTilesPerFrame(renderBudget.getTiles());
+                raytracer.setPreviewTilesPerFrame(renderBudget.getPreviewTiles());
+            }
+
+            graph.execute(frame);
         });
 
 
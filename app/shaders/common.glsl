@@ -5,10 +5,44 @@ struct Vertex {
     vec4 pos;
 };
 
+// An emitter for next event estimation, emission in the w components
 struct TriangleData {
     vec4 vs[3];
 };
 
+// Matches lv::TriangleAttributes
+struct TriangleAttributes {
+    uint normal;
+    uint material;
+};
+
+// Matches lv::RayTracerMaterial
+struct Material {
+    vec4 albedo;
+    vec4 emission;
+};
+
+// Matches lv::AliasEntry
+struct AliasEntry {
+    float probability;
+    uint alias;
+    float pdf;
+};
+
+// Matches lv::LightBvhNode, interior nodes keep their left child right behind them
+struct LightBvhNode {
+    vec3 boundsMin;
+    float power;
+    vec3 boundsMax;
+    float thetaE;
+    vec3 axis;
+    float thetaO;
+    uint index;
+    uint isLeaf;
+    uint pad0;
+    uint pad1;
+};
+
 uint rand_xorshift(in uint seed)
 {
     seed ^= (seed << 13);
@@ -67,3 +101,14 @@ vec3 SampleHemisphereCosine(in vec3 normal, inout uint seed)
 
 
 float max3(in vec3 v) { return max(v.x, max(v.y, v.z)); }
+float luminance(in vec3 c) { return dot(c, vec3(0.2126f, 0.7152f, 0.0722f)); }
+
+// Inverse of encode_octahedral in RayTracer.cpp
+vec3 decodeOctahedral(in uint packed) {
+    const vec2 e = unpackSnorm2x16(packed);
+    vec3 n = vec3(e, 1.0f - abs(e.x) - abs(e.y));
+    const float t = max(-n.z, 0.0f);
+    n.x += n.x >= 0.0f ? -t : t;
+    n.y += n.y >= 0.0f ? -t : t;
+    return normalize(n);
+}
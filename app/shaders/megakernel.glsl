@@ -0,0 +1,126 @@
+// Whole paths in one raygen invocation, included by raygen.rgen and raygenReorder.rgen.
+// EXECUTION_REORDER regroups invocations by hit shader and coherence key before shading bounces.
+#ifdef EXECUTION_REORDER
+// Only for coherenceKey
+#include "wavefront.glsl"
+#else
+#include "pathtracer.glsl"
+#endif
+
+
+layout(location = 0) rayPayloadEXT Payload {
+    vec3 normal;
+    bool hit;
+    vec3 materialColor;
+    float d;
+    vec3 emission;
+    uint customIndex;
+    vec3 direction;
+} payload;
+
+
+
+void initPayload() {
+    //payload.normal = vec3(0);
+    payload.hit = false;
+    //payload.materialColor = vec3(0.0f);
+    //payload.d = 0.0f;
+}
+
+vec3 getDirectLightSample(in vec3 origin, in vec3 surfaceNormal) {
+    vec3 shadowOrigin;
+    vec3 shadowDir;
+    float shadowLength;
+    const vec3 contribution = sampleDirectLight(origin, surfaceNormal, shadowOrigin, shadowDir, shadowLength);
+    if (max3(contribution) <= 0.0f) return vec3(0);
+
+    payload.hit = true;
+    traceRayEXT(topLevelAS,
+            gl_RayFlagsOpaqueEXT | gl_RayFlagsTerminateOnFirstHitEXT | gl_RayFlagsSkipClosestHitShaderEXT,
+            0xff, 0, 0, 0, shadowOrigin, 0.001f, shadowDir, shadowLength, 0);
+
+    if (payload.hit) return vec3(0);
+    return contribution;
+}
+
+vec3 getSample(in ivec2 pixel) {
+    vec3 origin;
+    initPayload();
+    generateCameraRay(pixel, origin, payload.direction);
+
+    vec3 accucolor = vec3(0);
+    vec3 mask = vec3(1);
+    const float tmin = 0.001f;
+    const float tmax = 1000.0f;
+    bool NEE = getNEE();
+
+    const uint depth = getPathDepth();
+    for(int rec=0; rec<depth; rec++) {
+#ifdef EXECUTION_REORDER
+        hitObjectNV hitObject;
+        hitObjectTraceRayNV(hitObject, topLevelAS, gl_RayFlagsOpaqueEXT, 0xff, 0, 0, 0, origin, tmin, payload.direction, tmax, 0);
+        // Camera rays are coherent already
+        if (rec > 0) reorderThreadNV(hitObject, coherenceKey(origin, payload.direction), 12);
+        hitObjectExecuteShaderNV(hitObject, 0);
+#else
+        traceRayEXT(topLevelAS, gl_RayFlagsOpaqueEXT, 0xff, 0, 0, 0, origin, tmin, payload.direction, tmax, 0);
+#endif
+
+        if (max3(payload.emission) > 0) {
+            if (!NEE || rec == 0 || !payload.hit) {
+                if (!payload.hit || dot(payload.normal, payload.direction) < 0) {
+                    accucolor += mask * payload.emission;
+                }
+            }
+            break;
+        }
+
+        if (!payload.hit) break;
+
+        const vec3 normal = payload.normal * sign_(-dot(payload.normal, payload.direction));
+        const vec3 BRDF = payload.materialColor * INVPI;
+
+        origin = origin + payload.d * payload.direction + 0.001f * normal;
+
+        if (NEE) {
+            accucolor += mask * BRDF * getDirectLightSample(origin, normal);
+        }
+
+
+        payload.direction = SampleHemisphereCosine(normal, state.seed);
+        mask *= BRDF * PI;
+
+        // Russian roulette
+        if (!getShouldReset()) {
+            const float russianP = clamp(max3(BRDF * PI), 0.1f, 0.9f);
+            if (rand(state.seed) < russianP) {
+                mask /= russianP;
+            } else {
+                break;
+            }
+        }
+    }
+
+    return accucolor;
+}
+
+
+void main() {
+    ivec2 pixel;
+    if (!getTilePixel(pixel)) return;
+    state.seed = getSeed(pixel);
+
+    const uint sampleCount = getPixelSampleCount(pixel);
+    // Converged pixels keep what they have
+    if (sampleCount == 0) return;
+
+    vec3 s = vec3(0);
+    float moment = 0.0f;
+    for(int i=0; i<sampleCount; i++) {
+        const vec3 c = getSample(pixel);
+        s += c;
+        moment += luminance(c) * luminance(c);
+    }
+
+    accumulate(pixel, s, moment, sampleCount);
+}
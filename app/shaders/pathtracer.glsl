@@ -0,0 +1,243 @@
+// Shared by the megakernel and the wavefront stages, both have to consume random numbers in the
+// same order for a fixed seed to give the same image.
+#extension GL_EXT_shader_image_load_formatted : enable
+
+#include "common.glsl"
+
+struct State {
+    uint seed;
+} state;
+
+
+layout(binding = 0, set = 0) uniform accelerationStructureEXT topLevelAS;
+#ifdef FORMATTED_STORAGE
+// For devices that can not store without a format, these only run Sum32 with R32 counts
+layout(binding = 1, set = 0, rgba32f) uniform image2D image;
+#else
+// Format-less, the accumulation mode picks rgba32f, rgba16f or r11g11b10f
+layout(binding = 1, set = 0) uniform image2D image;
+#endif
+layout(binding = 2, set = 0) uniform CameraProperties
+{
+    mat4 viewInverse;
+    mat4 projInverse;
+    vec4 viewDir;
+    vec4 properties0;
+    vec4 properties1;
+    vec4 properties2;
+} cam;
+#ifdef FORMATTED_STORAGE
+layout(binding = 7, set = 0, r32f) uniform image2D momentImage;
+#else
+// r32f for Sum32, the mean modes keep a mean in r16f
+layout(binding = 7, set = 0) uniform image2D momentImage;
+#endif
+layout(binding = 8, set = 0, r32ui) uniform readonly uimage2D budgetImage;
+#ifdef FORMATTED_STORAGE
+layout(binding = 9, set = 0, r32ui) uniform uimage2D sampleCountImage;
+#else
+// r16ui or r32ui, see lv::RayTracerInfo::sampleCountFormat
+layout(binding = 9, set = 0) uniform uimage2D sampleCountImage;
+#endif
+layout(binding = 10, set = 0) readonly buffer LightAliasTable { AliasEntry lightAliasTable[]; };
+layout(binding = 11, set = 0) readonly buffer LightBvh { LightBvhNode lightBvh[]; };
+// World space emitters, each live instance of an emitting mesh brings its own copy
+layout(binding = 12, set = 0) readonly buffer LightTriangles { TriangleData lightTriangles[]; };
+
+// Matches lv::RayTracerConstants
+layout(push_constant) uniform RayTracerConstants {
+    // Wavefront only
+    uint sampleIdx;
+    // Ray queue the current bounce reads, the next bounce reads the other one
+    uint rayQueue;
+    uint capacity;
+    // Extend and shade read the sorted queue instead of rayQueue
+    uint sorted;
+    vec4 sceneMin;
+    // Maps scene bounds onto the Morton grid of the sort keys
+    vec4 sceneScale;
+    // Launches over pixels cover tileSize squared tiles, one per launch layer, starting at firstTile
+    uint firstTile;
+    uint tileSize;
+} constants;
+
+float getTime() { return cam.properties0.x; }
+uint getTick() { return floatBitsToUint(cam.properties0.y); }
+bool getShouldReset() { return cam.properties0.z > 0.001f; }
+bool getNEE() { return cam.properties0.w > 0.0f; }
+uint getMaxSamples() { return floatBitsToUint(cam.properties1.x); }
+bool getAdaptive() { return cam.properties1.y > 0.0f; }
+bool getAccumulateSum() { return cam.properties1.z < 0.5f; }
+uint getMaxSampleCount() { return floatBitsToUint(cam.properties1.w); }
+bool getUseLightBvh() { return cam.properties2.x > 0.5f; }
+uint getNrEmissiveTriangles() { return floatBitsToUint(cam.properties2.y); }
+uint getPathDepth() { return getShouldReset() ? 2 : 16; }
+
+uint getPixelIndex(in ivec2 pixel) { return pixel.x + imageSize(image).x * pixel.y; }
+
+uint getSeed(in ivec2 pixel) {
+    return wang_hash(wang_hash(getPixelIndex(pixel)) + getTick());
+}
+
+// Pixel of this invocation, false for the parts of edge tiles that hang over the image
+bool getTilePixel(out ivec2 pixel) {
+    const ivec2 size = imageSize(image);
+    const uint tilesX = (size.x + constants.tileSize - 1) / constants.tileSize;
+    const uint tilesY = (size.y + constants.tileSize - 1) / constants.tileSize;
+    const uint tile = (constants.firstTile + gl_LaunchIDEXT.z) % (tilesX * tilesY);
+    pixel = ivec2(tile % tilesX, tile / tilesX) * int(constants.tileSize) + ivec2(gl_LaunchIDEXT.xy);
+    return all(lessThan(pixel, size));
+}
+
+// Samples this pixel gets this frame, 0 once adaptive sampling considers it converged
+uint getPixelSampleCount(in ivec2 pixel) {
+    uint sampleCount = getMaxSamples();
+    if (getShouldReset()) sampleCount = 1;
+    else if (getAdaptive()) sampleCount = min(sampleCount, imageLoad(budgetImage, pixel).x);
+    return sampleCount;
+}
+
+void generateCameraRay(in ivec2 pixel, out vec3 origin, out vec3 direction) {
+    const vec2 pixelCenter = vec2(pixel) + vec2(rand(state.seed), rand(state.seed));
+    const vec2 inUV = pixelCenter / vec2(imageSize(image));
+    vec2 d = inUV * 2.0f - 1.0f;
+    d.y = -d.y;
+
+    origin = (cam.viewInverse * vec4(0,0,0,1)).xyz;
+    vec3 target = (cam.projInverse * vec4(d.x, d.y,1,1)).xyz;
+    direction = normalize((cam.viewInverse * vec4(target, 0)).xyz);
+}
+
+// O(1) through the alias table, pdf is the probability of picking the returned emitter
+uint sampleEmissiveTriangle(out float pdf) {
+    const uint n = getNrEmissiveTriangles();
+    const uint bucket = min(uint(rand(state.seed) * float(n)), n - 1);
+    const AliasEntry entry = lightAliasTable[bucket];
+    const uint picked = rand(state.seed) < entry.probability ? bucket : entry.alias;
+    pdf = lightAliasTable[picked].pdf;
+    return picked;
+}
+
+// Conservative estimate of what a node can contribute at p, zero only if none of its lights can reach p
+float lightBvhImportance(in LightBvhNode node, in vec3 p, in vec3 n) {
+    const vec3 center = 0.5f * (node.boundsMin + node.boundsMax);
+    const vec3 halfExtent = 0.5f * (node.boundsMax - node.boundsMin);
+    const float radius2 = dot(halfExtent, halfExtent);
+    vec3 toLight = center - p;
+    const float d2 = dot(toLight, toLight);
+    toLight *= inversesqrt(max(d2, 1e-12f));
+
+    // Half angle the bounding sphere covers as seen from p, inside it anything goes
+    const float thetaB = d2 > radius2 ? asin(sqrt(radius2 / d2)) : PI;
+
+    const float theta = acos(clamp(dot(node.axis, -toLight), -1.0f, 1.0f));
+    const float thetaPrime = max(theta - node.thetaO - thetaB, 0.0f);
+    if (thetaPrime >= node.thetaE) return 0.0f;
+
+    const float thetaI = acos(clamp(dot(n, toLight), -1.0f, 1.0f));
+    const float thetaIPrime = max(thetaI - thetaB, 0.0f);
+    if (thetaIPrime >= 0.5f * PI) return 0.0f;
+
+    return node.power * cos(thetaPrime) * cos(thetaIPrime) / max(d2, radius2);
+}
+
+// Walks down picking children by importance, pdf is the product of the choices made
+uint sampleLightBvh(in vec3 p, in vec3 n, out float pdf) {
+    pdf = 1.0f;
+    uint nodeIdx = 0;
+    // Deeper than the builder ever makes it
+    for(uint guard=0; guard<96; guard++) {
+        const LightBvhNode node = lightBvh[nodeIdx];
+        if (node.isLeaf != 0) return node.index;
+
+        const uint left = nodeIdx + 1;
+        const uint right = node.index;
+        const float wl = lightBvhImportance(lightBvh[left], p, n);
+        const float wr = lightBvhImportance(lightBvh[right], p, n);
+        if (wl + wr <= 0.0f) break;
+
+        const float pl = wl / (wl + wr);
+        if (rand(state.seed) < pl) {
+            nodeIdx = left;
+            pdf *= pl;
+        } else {
+            nodeIdx = right;
+            pdf *= 1.0f - pl;
+        }
+    }
+    pdf = 0.0f;
+    return 0;
+}
+
+// Picks a point on an emitter, returns what it contributes if the shadow ray turns out unoccluded.
+// Zero means there is no shadow ray to trace.
+vec3 sampleDirectLight(in vec3 origin, in vec3 surfaceNormal, out vec3 shadowOrigin, out vec3 shadowDir, out float shadowLength) {
+    shadowOrigin = vec3(0);
+    shadowDir = vec3(0);
+    shadowLength = 0.0f;
+    if (getNrEmissiveTriangles() == 0) return vec3(0);
+
+    float lightPdf;
+    const uint idx = getUseLightBvh() ? sampleLightBvh(origin, surfaceNormal, lightPdf) : sampleEmissiveTriangle(lightPdf);
+    if (lightPdf <= 0.0f) return vec3(0);
+
+    const TriangleData td = lightTriangles[idx];
+    const vec3 v0 = td.vs[0].xyz;
+    const vec3 v1 = td.vs[1].xyz;
+    const vec3 v2 = td.vs[2].xyz;
+    const vec3 v0v1 = v1 - v0;
+    const vec3 v0v2 = v2 - v0;
+    const vec3 cr = cross(v0v1, v0v2);
+    const float crLength = length(cr);
+    // Degenerate emitters have no area to sample
+    if (crLength <= 0.0f) return vec3(0);
+    const vec3 lightNormal = cr / crLength;
+
+    float u = rand(state.seed);
+    float v = rand(state.seed);
+    if (u+v > 1.0f) { u = 1.0f - u; v = 1.0f - v; }
+
+    const vec3 lightPoint = v0 + u * v0v1 + v * v0v2;
+    shadowDir = origin - lightPoint;
+    const float lightDistance = length(shadowDir);
+    shadowDir /= lightDistance;
+
+    const float NL = dot(surfaceNormal, -shadowDir);
+    if (NL < 0) return vec3(0);
+
+    const float LNL = dot(lightNormal, shadowDir);
+    if (LNL < 0) return vec3(0);
+
+    shadowOrigin = lightPoint + 0.001f * lightNormal;
+    shadowLength = lightDistance - 0.001f;
+
+    const float lightArea = 0.5f * crLength;
+    const vec3 emission = vec3(td.vs[0].w, td.vs[1].w, td.vs[2].w);
+    const float SA = LNL * lightArea / (lightDistance * lightDistance);
+
+    return emission * SA * NL / lightPdf;
+}
+
+// Folds this frame's samples of a pixel into the accumulator, s is their sum
+void accumulate(in ivec2 pixel, in vec3 s, in float moment, in uint sampleCount) {
+    if (getAccumulateSum()) {
+        // Alpha counts samples, the summed luminance moment feeds the variance estimate of the budget pass
+        const float oldMoment = getShouldReset() ? 0.0f : imageLoad(momentImage, pixel).x;
+        imageStore(momentImage, pixel, vec4(oldMoment + moment));
+        vec4 oldColor = getShouldReset() ? vec4(0) : imageLoad(image, pixel);
+        imageStore(image, pixel, oldColor + vec4(s, float(sampleCount)));
+        return;
+    }
+
+    // Running means, alpha stays 1 so readers can keep dividing by it. The moment is a mean as
+    // well, a sum would overflow the 16 bit float image the mean modes keep it in.
+    const uint oldCount = getShouldReset() ? 0 : imageLoad(sampleCountImage, pixel).x;
+    const vec3 oldMean = oldCount == 0 ? vec3(0) : imageLoad(image, pixel).xyz;
+    const float oldMoment = oldCount == 0 ? 0.0f : imageLoad(momentImage, pixel).x;
+    const uint newCount = oldCount + sampleCount;
+    const vec3 mean = oldMean + (s - float(sampleCount) * oldMean) / float(newCount);
+    imageStore(image, pixel, vec4(mean, 1));
+    imageStore(momentImage, pixel, vec4(oldMoment + (moment - float(sampleCount) * oldMoment) / float(newCount)));
+    // A saturated count keeps weighting new samples at the smallest step it can represent
+    imageStore(sampleCountImage, pixel, uvec4(min(newCount, getMaxSampleCount())));
+}
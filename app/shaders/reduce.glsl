@@ -0,0 +1,76 @@
+#extension GL_KHR_shader_subgroup_basic : enable
+#extension GL_KHR_shader_subgroup_arithmetic : enable
+
+// Keep in sync with Reduction.cpp
+layout(local_size_x = 256, local_size_y = 1, local_size_z = 1) in;
+
+layout(push_constant) uniform Constants {
+    uint op;
+    uint value;
+    uint divideByAlpha;
+    uint count;
+    uint width;
+    uint nrGroups;
+    uint bins;
+    uint logarithmic;
+    float minValue;
+    float maxValue;
+} constants;
+
+const uint OP_SUM = 0;
+const uint OP_MIN = 1;
+const uint OP_MAX = 2;
+const uint OP_MEAN = 3;
+const uint OP_HISTOGRAM = 4;
+
+// One slot per subgroup, enough for subgroups of a single invocation
+shared float subgroupPartials[256];
+shared uint sharedBins[256];
+
+float identity() {
+    if (constants.op == OP_MIN) return uintBitsToFloat(0x7f800000);
+    if (constants.op == OP_MAX) return uintBitsToFloat(0xff800000);
+    return 0.0f;
+}
+
+float combine(in float a, in float b) {
+    if (constants.op == OP_MIN) return min(a, b);
+    if (constants.op == OP_MAX) return max(a, b);
+    return a + b;
+}
+
+float subgroupCombine(in float v) {
+    if (constants.op == OP_MIN) return subgroupMin(v);
+    if (constants.op == OP_MAX) return subgroupMax(v);
+    return subgroupAdd(v);
+}
+
+// The invocation that holds the result of workgroupReduce
+bool isWorkgroupLeader() { return gl_SubgroupID == 0 && subgroupElect(); }
+
+// Subgroup first, then the per subgroup results through shared memory
+float workgroupReduce(in float v) {
+    v = subgroupCombine(v);
+    if (subgroupElect()) subgroupPartials[gl_SubgroupID] = v;
+    barrier();
+
+    float ret = identity();
+    if (gl_SubgroupID == 0) {
+        for(uint i = gl_SubgroupInvocationID; i < gl_NumSubgroups; i += gl_SubgroupSize)
+            ret = combine(ret, subgroupPartials[i]);
+        ret = subgroupCombine(ret);
+    }
+    return ret;
+}
+
+uint binIndex(in float v) {
+    float lo = constants.minValue;
+    float hi = constants.maxValue;
+    if (constants.logarithmic != 0) {
+        v = log2(max(v, 1e-8f));
+        lo = log2(max(lo, 1e-8f));
+        hi = log2(max(hi, 1e-8f));
+    }
+    const float t = clamp((v - lo) / max(hi - lo, 1e-8f), 0.0f, 1.0f);
+    return min(uint(t * float(constants.bins)), constants.bins - 1);
+}
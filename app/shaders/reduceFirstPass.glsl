@@ -0,0 +1,33 @@
+#include "reduce.glsl"
+
+// Every source defines how element i is read
+float loadValue(in uint i);
+
+// Floats are stored as their bits so histograms can share the buffer
+layout(binding = 1) writeonly buffer Partials { uint partials[]; };
+
+void main() {
+    const uint stride = gl_NumWorkGroups.x * gl_WorkGroupSize.x;
+
+    if (constants.op == OP_HISTOGRAM) {
+        for(uint i = gl_LocalInvocationIndex; i < constants.bins; i += gl_WorkGroupSize.x)
+            sharedBins[i] = 0;
+        barrier();
+
+        // Shared atomics only, the global buffer sees one plain write per bin per group
+        for(uint i = gl_GlobalInvocationID.x; i < constants.count; i += stride)
+            atomicAdd(sharedBins[binIndex(loadValue(i))], 1);
+        barrier();
+
+        for(uint i = gl_LocalInvocationIndex; i < constants.bins; i += gl_WorkGroupSize.x)
+            partials[gl_WorkGroupID.x * constants.bins + i] = sharedBins[i];
+        return;
+    }
+
+    float v = identity();
+    for(uint i = gl_GlobalInvocationID.x; i < constants.count; i += stride)
+        v = combine(v, loadValue(i));
+
+    v = workgroupReduce(v);
+    if (isWorkgroupLeader()) partials[gl_WorkGroupID.x] = floatBitsToUint(v);
+}
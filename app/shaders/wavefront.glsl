@@ -0,0 +1,116 @@
+// Queues between the wavefront stages. Every stage is its own trace call, stages that only read
+// a queue are launched indirectly with the queue's count as width.
+#include "pathtracer.glsl"
+
+// Doubles as VkTraceRaysIndirectCommandKHR, height and depth stay 1
+struct QueueHeader {
+    uint count;
+    uint height;
+    uint depth;
+    // Rays traced from this queue, read back for benchmarks
+    uint traced;
+};
+
+struct WavefrontRay {
+    vec3 origin;
+    uint pixel;
+    vec3 direction;
+    uint seed;
+    vec3 mask;
+    uint bounce;
+};
+
+// What closesthit.rchit or miss.rmiss left in the payload for the ray with the same index
+struct WavefrontHit {
+    vec3 normal;
+    float d;
+    vec3 materialColor;
+    uint hit;
+    vec3 emission;
+    uint pad;
+};
+
+struct WavefrontShadowRay {
+    vec3 origin;
+    uint pixel;
+    vec3 direction;
+    float tmax;
+    vec3 contribution;
+    uint pad;
+};
+
+// A pixel's state across the samples of a frame
+struct WavefrontPixel {
+    vec3 radiance;
+    uint seed;
+    vec3 sum;
+    float moment;
+    uint sampleCount;
+    uint pad0;
+    uint pad1;
+    uint pad2;
+};
+
+const uint SHADOW_QUEUE = 2;
+// Launch sizes of the sort passes past the count, zero unless the count saw rays
+const uint SORT_BLOCKS_LAUNCH = 3;
+const uint SORT_SCAN_LAUNCH = 4;
+// Third region of the ray buffer, where the sort scatters the current queue to
+const uint SORTED_QUEUE = 2;
+// 3 Morton bits per axis and the direction octant, the scan goes over blocks of bins
+const uint SORT_BINS = 4096;
+const uint SORT_BLOCK = 64;
+
+layout(binding = 14, set = 0) buffer QueueHeaders { QueueHeader queueHeaders[5]; };
+layout(binding = 15, set = 0) buffer Rays { WavefrontRay rays[]; };
+layout(binding = 16, set = 0) buffer Hits { WavefrontHit hits[]; };
+layout(binding = 17, set = 0) buffer ShadowRays { WavefrontShadowRay shadowRays[]; };
+layout(binding = 18, set = 0) buffer Pixels { WavefrontPixel pixels[]; };
+layout(binding = 19, set = 0) buffer SortBins {
+    uint binCounts[SORT_BINS];
+    // Exclusive prefix sums of binCounts, the scatter bumps them as it fills the bins
+    uint binOffsets[SORT_BINS];
+    uint blockCounts[SORT_BINS / SORT_BLOCK];
+};
+
+// Where the ray an extend or shade invocation works on lives
+uint currentRay(in uint i) {
+    return (constants.sorted != 0 ? SORTED_QUEUE : constants.rayQueue) * constants.capacity + i;
+}
+
+// Rays starting close to each other and heading the same way share a key, 12 bits
+uint coherenceKey(in vec3 origin, in vec3 direction) {
+    const uvec3 cell = uvec3(clamp((origin - constants.sceneMin.xyz) * constants.sceneScale.xyz, vec3(0), vec3(7)));
+    uint morton = 0;
+    for(uint b=0; b<3; b++) {
+        morton |= ((cell.x >> b) & 1) << (3 * b) | ((cell.y >> b) & 1) << (3 * b + 1) | ((cell.z >> b) & 1) << (3 * b + 2);
+    }
+    const uint octant = (direction.x < 0 ? 1 : 0) | (direction.y < 0 ? 2 : 0) | (direction.z < 0 ? 4 : 0);
+    return morton << 3 | octant;
+}
+
+uint sortKey(in WavefrontRay ray) { return coherenceKey(ray.origin, ray.direction); }
+
+// Atomic compaction, surviving paths end up packed at the front of the queue
+void pushRay(in uint queue, in WavefrontRay ray) {
+    const uint slot = atomicAdd(queueHeaders[queue].count, 1);
+    rays[queue * constants.capacity + slot] = ray;
+}
+
+void pushShadowRay(in WavefrontShadowRay ray) {
+    const uint slot = atomicAdd(queueHeaders[SHADOW_QUEUE].count, 1);
+    shadowRays[slot] = ray;
+}
+
+// Ends a sample, the pixel's seed carries on into its next one
+void finishPath(in uint pixelIdx, in uint seed) {
+    pixels[pixelIdx].seed = seed;
+}
+
+// What the megakernel does after every getSample
+void foldSample(in uint pixelIdx) {
+    const vec3 c = pixels[pixelIdx].radiance;
+    pixels[pixelIdx].sum += c;
+    pixels[pixelIdx].moment += luminance(c) * luminance(c);
+    pixels[pixelIdx].radiance = vec3(0);
+}
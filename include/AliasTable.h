@@ -0,0 +1,20 @@
+#pragma once
+#include "precomp.h"
+#include "ThreadPool.h"
+
+namespace lv {
+
+// One bucket per item: keep the bucket's own item with the given probability, otherwise take
+// the alias. The pdf is that of the item itself, so the sampler never has to know the total.
+struct AliasEntry {
+    float probability;
+    uint32_t alias;
+    float pdf;
+};
+
+namespace aliastable {
+    // Vose style table over the weights, built in parallel. All zero weights give a uniform table.
+    std::vector<AliasEntry> build(std::span<const float> weights, ThreadPool& pool = ThreadPool::shared());
+}
+
+}
@@ -7,6 +7,7 @@ class AppExt;
 class AppContext;
 class AppContextInfo;
 class FrameManager;
+class UploadManager;
 
 template<typename T>
 struct app_extensions {
@@ -19,9 +20,18 @@ struct AppContextInfo {
     std::set<const char*> validationLayers;
     std::set<const char*> instanceExtensions;
     std::set<const char*> deviceExtensions;
+    // Enabled when the device has them, check with AppContext::deviceExtensionEnabled
+    std::set<const char*> optionalDeviceExtensions;
 
     std::set<std::type_index> knownExtensions;
 
+    // Set by extensions that need a surface (e.g. Window). When false no GLFW window,
+    // surface or present queue is ever created.
+    bool requiresPresentation = false;
+
+    // Pipeline cache persisted across runs, an empty path keeps it in memory only
+    std::string pipelineCachePath = "pipeline_cache.bin";
+
     template<class T, typename... Args>
     void registerExtension(Args&&... args) {
         static_assert(std::is_base_of<AppExt, T>::value, "Extensions must be derived from AppExt");
@@ -44,14 +54,31 @@ public:
 
     struct {
         std::optional<uint32_t> compute, graphics, present;
+        // Only set when the device has a family that can transfer but not do graphics or compute
+        std::optional<uint32_t> transfer;
     } queueFamilies;
 
     struct {
-        VkQueue compute, graphics, present;
+        VkQueue compute, graphics, present, transfer;
     } queues;
 
     VkCommandPool vkCommandPool;
     VkDescriptorPool vkDescriptorPool;
+    // Pass to every pipeline creation so warm starts skip shader compilation
+    VkPipelineCache vkPipelineCache;
+    UploadManager* uploadManager = nullptr;
+
+    // Loader threads submit uploads while the frame loop submits frames
+    mutable std::mutex graphicsQueueMutex;
+    mutable std::mutex transferQueueMutex;
+
+    inline bool hasDedicatedTransfer() const { return queueFamilies.transfer.has_value(); }
+
+    // Required and supported optional device extensions
+    std::set<std::string> enabledDeviceExtensions;
+    inline bool deviceExtensionEnabled(const char* name) const { return enabledDeviceExtensions.contains(name); }
+    // Core features the device was created with, the optional ones only where supported
+    VkPhysicalDeviceFeatures enabledFeatures {};
 
     struct {
         VkSurfaceCapabilitiesKHR capabilities;
@@ -75,6 +102,7 @@ public:
     template<typename T, typename... Args>
     T& addFrameManager(Args&&... args) {
         static_assert(std::is_base_of<FrameManager, T>::value, "Frame managers must be derived from FrameManager");
+        assert(info.knownExtensions.find(typeid(T)) != info.knownExtensions.end() && "Frame manager used without registering");
         frameManagers.push_back(new T(std::forward<Args>(args)...));
         auto& ret = *reinterpret_cast<T*>(frameManagers.back());
         std::vector<AppExt*> extensionPtrs;
@@ -89,8 +117,8 @@ private:
 
     // Will be invalid after construction
     struct {
-        GLFWwindow* window;
-        VkSurfaceKHR surface;
+        GLFWwindow* window = nullptr;
+        VkSurfaceKHR surface = VK_NULL_HANDLE;
     } windowHelper;
 
 public:
@@ -113,6 +141,9 @@ private:
     void createVmaAllocator();
     void createCommandPool();
     void createDescriptorPool();
+    void createUploadManager();
+    void createPipelineCache();
+    void savePipelineCache() const;
 };
 
 template<typename T>
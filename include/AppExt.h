@@ -24,6 +24,8 @@ public:
 
     virtual void embellishFrameContext(FrameContext& frame) {}
     virtual void cleanupFrameContext(FrameContext& frame) {}
+    // Called after the frame's command buffer started recording, before the frame callback
+    virtual void beginFrame(FrameContext& frame) {}
 };
 
 }
@@ -4,6 +4,9 @@
 
 namespace lv {
 
+// Identifies a submitted upload batch, see UploadManager
+using UploadToken = uint64_t;
+
 struct Buffer {
     VkBuffer buffer;
     VmaAllocation memory;
@@ -22,10 +25,19 @@ namespace buffertools {
 
     void create_buffer_D(AppContext& ctx, VkBufferUsageFlags usage, size_t size, Buffer* dst);
     void create_buffer_D_data(AppContext& ctx, VkBufferUsageFlags usage, size_t size, void* data, Buffer* dst);
+    // Lets the caller write straight into the mapped staging memory instead of assembling a host copy first
+    void create_buffer_D_fill(AppContext& ctx, VkBufferUsageFlags usage, size_t size, const std::function<void(void*)>& fill, Buffer* dst);
+    // Queue the upload on the context's UploadManager and return its token instead of waiting
+    UploadToken create_buffer_D_data_async(AppContext& ctx, VkBufferUsageFlags usage, size_t size, const void* data, Buffer* dst);
+    UploadToken create_buffer_D_fill_async(AppContext& ctx, VkBufferUsageFlags usage, size_t size, const std::function<void(void*)>& fill, Buffer* dst);
 
     void create_buffer_H(AppContext& ctx, VkBufferUsageFlags usage, size_t size, Buffer* dst);
     void create_buffer_H_data(AppContext& ctx, VkBufferUsageFlags usage, size_t size, void* data, Buffer* dst);
 
     void destroyBuffer(AppContext& ctx, Buffer& buffer);
+
+    // Queue family ownership transfers. The release is recorded on the source queue and the acquire
+    // on the destination queue, which has to wait for the release submission.
+    VkBufferMemoryBarrier ownership_barrier(VkBuffer buffer, uint32_t srcFamily, uint32_t dstFamily, VkAccessFlags srcAccess, VkAccessFlags dstAccess);
 }
 }
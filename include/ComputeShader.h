@@ -59,10 +59,6 @@ struct ComputeShaderInfo {
     }
 };
 
-struct ComputeFrame : public FrameExt {
-    VkDescriptorSet descriptorSet;
-};
-
 class ComputeShader : public AppExt {
 public:
     ComputeShader(AppContext& ctx, const char* filePath, ComputeShaderInfo info);
@@ -76,9 +72,22 @@ public:
     void embellishFrameContext(FrameContext& frame) override;
     void cleanupFrameContext(FrameContext& frame) override;
 
+    // Descriptor sets live here instead of in a FrameExt so several shaders can share a frame
+    inline VkDescriptorSet getDescriptorSet(const FrameContext& frame) const { return descriptorSets.at(frame.idx); }
+
+    void bind(FrameContext& frame) const;
+    void dispatch(FrameContext& frame, uint32_t x, uint32_t y = 1, uint32_t z = 1) const;
+
+    template<typename T>
+    inline void pushConstants(FrameContext& frame, const T& constants) const {
+        assert(info.pushConstantType == typeid(T) && "Push constant type does not match the shader info");
+        vkCmdPushConstants(frame.cmdBuffer, pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(T), &constants);
+    }
+
 private:
     const char* filePath;
     ComputeShaderInfo info;
+    std::vector<VkDescriptorSet> descriptorSets;
     void createDescriptorSetLayout();
     void createPipelineLayout();
     void createPipeline();
@@ -10,7 +10,8 @@ public:
     AppContext& ctx;
     uint32_t idx;
     VkCommandBuffer cmdBuffer;
-    VkFence frameFinished;
+    // Frame number of the last recording, the graphics timeline reaches it once that finished. 0 before the first
+    uint64_t frameValue;
     FrameContext* fPrev;
 
     FrameContext(AppContext& ctx) : ctx(ctx) {}
@@ -42,12 +43,23 @@ private:
 
 class FrameManager : public AppExt {
 public:
-    FrameManager(AppContext& ctx);
+    // Frames in flight trade latency for throughput: with one the CPU waits for the GPU to finish
+    // each frame before recording the next, with more it records ahead while the GPU catches up
+    FrameManager(AppContext& ctx, uint32_t nrFramesInFlight = 2);
     ~FrameManager() override;
 
     void init(const std::vector<AppExt*>& extensions);
     void nextFrame(const std::function<void(FrameContext&)>& callback);
     uint32_t getNrFrames() const { return frameContexts.size(); }
+    uint32_t getNrFramesInFlight() const { return nrFramesInFlight; }
+
+    // Frames are numbered from 1 and frame N signals N on the graphics queue's timeline when it finished
+    uint64_t getLastSubmittedFrame() const { return submittedValue; }
+    uint64_t getCompletedFrame() const;
+    bool isFrameFinished(uint64_t frameValue) const { return getCompletedFrame() >= frameValue; }
+    void waitForFrame(uint64_t frameValue) const;
+    // Other queues wait on frames through VkTimelineSemaphoreSubmitInfo with this semaphore
+    VkSemaphore getTimeline() const { return timeline; }
 protected:
     FrameContext& getCurrentFrame() { return frameContexts[frameIdx]; }
 
@@ -57,11 +69,12 @@ protected:
     virtual void submitFrame(FrameContext& frame);
 
     std::vector<FrameContext> frameContexts;
-    uint32_t nrFramesInFlight = 1;
+    uint32_t nrFramesInFlight;
     uint32_t nrFrames = 1;
     uint32_t frameIdx = 0;
     uint32_t currentInFlight = 0;
-    std::vector<VkFence> inFlightFences;
+    VkSemaphore timeline = VK_NULL_HANDLE;
+    uint64_t submittedValue = 0;
 
 private:
     std::vector<AppExt*> extensions;
@@ -0,0 +1,75 @@
+#pragma once
+#include "precomp.h"
+#include "AppContext.h"
+#include "AppExt.h"
+#include "FrameManager.h"
+
+namespace lv {
+
+struct GpuProfilerInfo {
+    // Scopes beyond this in a single frame are not timed
+    uint32_t maxScopes = 64;
+    // Number of resolved frames kept for the Chrome trace export
+    uint32_t historySize = 240;
+};
+
+struct GpuTiming {
+    std::string name;
+    uint32_t depth;
+    // Nanoseconds on the GPU timeline
+    uint64_t start;
+    uint64_t end;
+
+    inline double getMilliseconds() const { return static_cast<double>(end - start) * 1e-6; }
+};
+
+struct GpuProfilerFrame : public FrameExt {
+    struct Scope {
+        std::string name;
+        uint32_t depth;
+        uint32_t query;
+    };
+
+    VkQueryPool queryPool = VK_NULL_HANDLE;
+    std::vector<Scope> scopes;
+    uint32_t nrQueries = 0;
+    uint32_t depth = 0;
+};
+
+class GpuProfiler : public AppExt {
+public:
+    GpuProfiler(AppContext& ctx, GpuProfilerInfo info = {});
+
+    void embellishFrameContext(FrameContext& frame) override;
+    void cleanupFrameContext(FrameContext& frame) override;
+    void beginFrame(FrameContext& frame) override;
+
+    // Times the commands recorded during its lifetime, scopes nest
+    class Scope : NoCopy {
+    public:
+        Scope(GpuProfiler& profiler, FrameContext& frame, const char* name);
+        ~Scope();
+    private:
+        GpuProfiler& profiler;
+        FrameContext& frame;
+        int32_t scopeIdx;
+    };
+
+    inline bool isSupported() const { return supported; }
+    // Timings of the most recently resolved frame, in recording order
+    inline const std::vector<GpuTiming>& getTimings() const { return timings; }
+    bool exportChromeTrace(const std::string& filename) const;
+
+private:
+    void resolve(GpuProfilerFrame& pFrame);
+
+    GpuProfilerInfo info;
+    bool supported = false;
+    float timestampPeriod = 1.0f;
+    uint64_t timestampMask = ~0ull;
+
+    std::vector<GpuTiming> timings;
+    std::deque<std::vector<GpuTiming>> history;
+};
+
+}
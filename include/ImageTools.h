@@ -1,6 +1,7 @@
 #pragma once
 #include "precomp.h"
 #include "AppContext.h"
+#include "BufferTools.h"
 
 namespace lv {
 
@@ -16,8 +17,12 @@ namespace imagetools {
     void create_image_D(AppContext& ctx, uint32_t width, uint32_t height, VkImageUsageFlags usage, VkFormat format, VkImageLayout imageLayout, Image* dst);
 
     void load_image_D(AppContext& ctx, VkImageLayout initialLayout, const char* filename, Image* dst);
+    UploadToken load_image_D_async(AppContext& ctx, VkImageLayout initialLayout, const char* filename, Image* dst);
 
     void destroyImage(AppContext& ctx, Image& image);
+
+    // Both halves of an ownership transfer must use the same layouts, the transition happens once
+    VkImageMemoryBarrier ownership_barrier(VkImage image, uint32_t srcFamily, uint32_t dstFamily, VkImageLayout oldLayout, VkImageLayout newLayout, VkAccessFlags srcAccess, VkAccessFlags dstAccess);
 }
 
 }
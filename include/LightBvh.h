@@ -0,0 +1,53 @@
+#pragma once
+#include "precomp.h"
+#include "ThreadPool.h"
+
+namespace lv {
+
+// A one sided emitting triangle in world space
+struct LightPrimitive {
+    glm::vec3 v0, v1, v2;
+    float power;
+};
+
+// Matches LightBvhNode in common.glsl. Interior nodes have their left child right behind them.
+struct LightBvhNode {
+    glm::vec3 boundsMin;
+    float power;
+    glm::vec3 boundsMax;
+    // Half angle around the normal cone in which light can leave a surface
+    float thetaE;
+    glm::vec3 axis;
+    // Half angle of the cone bounding all normals
+    float thetaO;
+    // Leaves: index into the emissive list, interior nodes: index of the right child
+    uint32_t index;
+    uint32_t isLeaf;
+    uint32_t pad[2];
+};
+
+// Binary BVH with a single light per leaf, split by the surface area orientation heuristic so a
+// stochastic traversal can weigh both children by their estimated contribution at a shading point.
+class LightBvh {
+public:
+    void build(std::span<const LightPrimitive> lights, ThreadPool& pool = ThreadPool::shared());
+    // Same lights in the same order, only positions and powers changed. Keeps the topology.
+    void refit(std::span<const LightPrimitive> lights, ThreadPool& pool = ThreadPool::shared());
+
+    inline const std::vector<LightBvhNode>& getNodes() const { return nodes; }
+    inline size_t getNrLights() const { return nrLights; }
+    inline bool isBuilt() const { return !nodes.empty(); }
+
+private:
+    void buildNode(uint32_t nodeIdx, uint32_t depth, std::span<uint32_t> lightIndices, ThreadPool& pool);
+
+    std::vector<LightBvhNode> nodes;
+    std::vector<uint32_t> depths;
+    // Node indices per depth, refits walk them bottom up
+    std::vector<std::vector<uint32_t>> levels;
+    // Leaf bounds of the lights being built, only alive during build
+    std::vector<LightBvhNode> leaves;
+    size_t nrLights = 0;
+};
+
+}
@@ -1,20 +1,105 @@
+#pragma once
 #include "precomp.h"
 
 namespace lv {
 
 struct Vertex { glm::vec4 v; };
 
+// Position formats the GPU copy of a mesh can use, Snorm16 goes through MeshPacking's dequantization
+enum class VertexFormat { Float32x4, Float32x3, Snorm16x4 };
+
+// What Mesh::bake did, Failed when the OBJ could not be read or parsed or the cache not be written
+enum class MeshBakeResult { Baked, UpToDate, Failed };
+
+// How positions and indices of a mesh are laid out on the GPU
+struct MeshPacking {
+    VertexFormat vertexFormat = VertexFormat::Float32x4;
+    VkIndexType indexType = VK_INDEX_TYPE_UINT32;
+    // Snorm16 positions map to center + halfExtent * p
+    glm::vec3 center = glm::vec3(0.0f);
+    glm::vec3 halfExtent = glm::vec3(1.0f);
+
+    VkFormat getVkFormat() const;
+    uint32_t getVertexStride() const;
+    inline uint32_t getIndexSize() const { return indexType == VK_INDEX_TYPE_UINT16 ? 2 : 4; }
+    // Row major 3x4, what VkTransformMatrixKHR wants
+    std::array<float, 12> getDequantization() const;
+};
+
+struct MeshShape {
+    std::string name;
+    uint32_t firstIndex;
+    uint32_t indexCount;
+};
+
+// On-disk layout of a baked mesh, the arrays follow at their offsets
+struct MeshCacheHeader {
+    static constexpr uint32_t MAGIC = 0x484d564c; // "LVMH"
+    static constexpr uint32_t VERSION = 2;
+
+    uint32_t magic;
+    uint32_t version;
+    uint64_t sourceHash;
+    uint64_t vertexCount;
+    uint64_t indexCount;
+    uint64_t normalCount;
+    uint64_t materialIdCount;
+    uint64_t vertexOffset;
+    uint64_t indexOffset;
+    uint64_t normalOffset;
+    uint64_t materialIdOffset;
+    // Material names followed by shapes, each name is a uint32 length and its characters
+    uint64_t namesOffset;
+    uint64_t namesSize;
+    uint32_t materialCount;
+    uint32_t shapeCount;
+};
+
 class Mesh : NoCopy {
 public:
     Mesh() = default;
+    ~Mesh();
 
+    // Loads <filename>.lvmesh when it is up to date with the OBJ, otherwise parses and rebakes it
     void load(const char* filename);
 
-    std::vector<Vertex> vertices;
-    std::vector<uint32_t> indices;
+    // Writes the cache next to the OBJ unless it is already up to date
+    static MeshBakeResult bake(const char* filename, bool force = false);
+    static std::string getCachePath(const char* filename);
+
+    // Smallest formats that keep every position within maxError of the original.
+    // Snorm16 is only considered when the device can build from it.
+    MeshPacking choosePacking(float maxError, bool allowSnorm16) const;
+    // Axis aligned bounds of the vertices in object space
+    void computeBounds(glm::vec3& boundsMin, glm::vec3& boundsMax) const;
+    // dst holds vertices.size() * getVertexStride() and indices.size() * getIndexSize() bytes
+    void packVertices(const MeshPacking& packing, void* dst) const;
+    void packIndices(const MeshPacking& packing, void* dst) const;
+
+    // Either point into the mapped cache or into the parsed arrays below
+    std::span<const Vertex> vertices;
+    std::span<const uint32_t> indices;
     // Correspond to an index
-    std::vector<glm::vec3> normals;
+    std::span<const glm::vec3> normals;
+    // One per triangle, indexes materials
+    std::span<const uint32_t> materialIds;
+
+    std::vector<std::string> materials;
+    std::vector<MeshShape> shapes;
+
+private:
+    bool parseObj(const char* filename);
+    bool mapCache(const std::string& cachePath, uint64_t sourceHash);
+    bool writeCache(const std::string& cachePath, uint64_t sourceHash) const;
+    void reset();
+
+    std::vector<Vertex> ownedVertices;
+    std::vector<uint32_t> ownedIndices;
+    std::vector<glm::vec3> ownedNormals;
+    std::vector<uint32_t> ownedMaterialIds;
+
+    void* mapped = nullptr;
+    size_t mappedSize = 0;
 };
 
 }
-
@@ -0,0 +1,32 @@
+#pragma once
+#include "precomp.h"
+#include "ThreadPool.h"
+
+namespace lv {
+
+struct ObjShape {
+    std::string name;
+    uint32_t firstTriangle;
+    uint32_t triangleCount;
+};
+
+struct ObjData {
+    std::vector<glm::vec3> positions;
+    std::vector<glm::vec3> normals;
+    // Three per triangle, faces with more corners are fanned
+    std::vector<uint32_t> positionIndices;
+    // -1 where the face has no normal
+    std::vector<int32_t> normalIndices;
+    // One per triangle, indexes materials. Triangles before any usemtl get material 0
+    std::vector<uint32_t> materialIds;
+    std::vector<std::string> materials;
+    // Every o or g statement starts a shape, empty shapes are dropped
+    std::vector<ObjShape> shapes;
+};
+
+namespace objparser {
+    // Splits the file on line boundaries and parses the chunks on the pool
+    bool parse(const char* filename, ThreadPool& pool, ObjData& out);
+}
+
+}
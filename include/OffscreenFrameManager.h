@@ -0,0 +1,39 @@
+#pragma once
+#include "precomp.h"
+#include "AppExt.h"
+#include "FrameManager.h"
+#include "ImageTools.h"
+#include "Window.h"
+
+namespace lv {
+
+struct OffscreenInfo {
+    uint32_t width;
+    uint32_t height;
+    uint32_t nrFrames = 3;
+    // At most nrFrames, higher keeps the GPU fed, 1 makes every frame wait for the previous one
+    uint32_t framesInFlight = 2;
+    VkFormat format = VK_FORMAT_B8G8R8A8_SRGB;
+    VkImageUsageFlags usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+    VkImageLayout initialLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+};
+
+// Frame manager without a window. It owns its render targets and hands them out
+// through the same WindowFrame a swapchain backed Window does, so extensions that
+// render to the "screen" work unchanged.
+class OffscreenFrameManager : public FrameManager, NoCopy {
+public:
+    OffscreenFrameManager(AppContext& ctx, OffscreenInfo info);
+    ~OffscreenFrameManager() override;
+
+    const Image& getImage(uint32_t frameIdx) const { return images[frameIdx]; }
+
+protected:
+    void embellishFrameContext(FrameContext& frame) override;
+
+private:
+    OffscreenInfo info;
+    std::vector<Image> images;
+};
+
+}
@@ -2,6 +2,7 @@
 #include "AppContext.h"
 #include "AppExt.h"
 #include "FrameManager.h"
+#include "GpuProfiler.h"
 
 namespace lv {
 
@@ -9,6 +10,8 @@ struct OverlayInfo {
     VkRenderPass renderPass;
     GLFWwindow* glfwWindow;
     FrameManager* frameManager;
+    // Shows a per pass breakdown when set
+    GpuProfiler* profiler = nullptr;
 };
 
 class Overlay : public AppExt {
@@ -19,9 +22,16 @@ public:
     void render(FrameContext& frameContext, float energy, float fps);
 
     bool NEE = false;
+    bool adaptiveSampling = true;
+    bool lightBvh = true;
+    bool wavefront = false;
+    bool reorderRays = false;
+    // GPU milliseconds a frame may take, the ray tracer gets what the rest leaves
+    float frameBudget = 16.0f;
 private:
     void createDescriptorPool();
     void initImgui();
+    void renderProfiler();
 
     OverlayInfo info;
     VkDescriptorPool imguiPool;
@@ -31,6 +31,8 @@ struct RasterizerInfo {
 
     std::string vertShaderPath;
     std::string fragShaderPath;
+    // Layout the attachments are left in, offscreen targets have no use for PRESENT_SRC
+    VkImageLayout finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
     std::vector<RasterizerAttachment> attachments;
     std::vector<RasterizerTexture> textures;
 };
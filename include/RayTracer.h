@@ -8,6 +8,8 @@
 #include "Camera.h"
 #include "Mesh.h"
 #include "Window.h"
+#include "AliasTable.h"
+#include "LightBvh.h"
 
 namespace lv {
 
@@ -16,8 +18,30 @@ class RayTracer;
 struct AccelerationStructure : public Buffer {
     VkAccelerationStructureKHR AShandle;
     uint64_t deviceAddress = 0;
+    VkDeviceSize size = 0;
 };
 
+enum class BuildPolicy { FastTrace, FastBuild, LowMemory, AllowUpdate };
+
+// Sum32 keeps the running sum with the sample count in alpha, the reference.
+// The mean modes store the running mean with alpha 1 and the count in a separate image,
+// at half (Mean16) or a quarter (Mean10) of the bytes per texel.
+enum class AccumulationMode { Sum32, Mean16, Mean10 };
+
+// How next event estimation picks an emitter. The alias table ignores the shading point,
+// the light BVH weighs emitters by their estimated contribution to it.
+enum class LightSampling { AliasTable, LightBvh };
+
+// Megakernel runs whole paths in one raygen invocation. Wavefront splits every bounce into
+// extend, shade and shadow launches that pass rays through GPU queues, so lanes of finished
+// paths are compacted away instead of idling. Both give the same image for the same seed.
+enum class RayTracerBackend { Megakernel, Wavefront };
+
+// Bounce rays leave in effectively random directions, which scatters a warp over the BVH.
+// Sort bins the wavefront ray queue by origin Morton code and direction octant before every
+// extend. ExecutionReorder has the megakernel hand the same key to shader execution reorder.
+enum class RayReordering { None, Sort, ExecutionReorder };
+
 template<>
 struct app_extensions<RayTracer> {
     void operator()(AppContextInfo& info) const { 
@@ -29,6 +53,9 @@ struct app_extensions<RayTracer> {
         info.deviceExtensions.insert(VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME);
         info.deviceExtensions.insert(VK_KHR_SHADER_FLOAT_CONTROLS_EXTENSION_NAME);
         info.deviceExtensions.insert(VK_KHR_SPIRV_1_4_EXTENSION_NAME);
+        info.optionalDeviceExtensions.insert(VK_NV_RAY_TRACING_INVOCATION_REORDER_EXTENSION_NAME);
+        // Tells which formats can be stored without a format, see RayTracerInfo::adaptFormats
+        info.optionalDeviceExtensions.insert(VK_KHR_FORMAT_FEATURE_FLAGS_2_EXTENSION_NAME);
     }
 };
 
@@ -37,28 +64,144 @@ struct RayTracerCamera {
     glm::mat4 projInverse;
     glm::vec4 viewDir;
     glm::vec4 properties0;
-
+    glm::vec4 properties1;
+    glm::vec4 properties2;
 
     inline void setTime(float time) { properties0[0] = time; }
     inline void setTick(uint32_t tick) { properties0[1] = reinterpret_cast<float&>(tick); }
     inline void setShouldReset(bool shouldReset) { properties0.z = shouldReset ? 1.0f : 0.0f; }
     inline void setNEE(bool NEE) { properties0.w = NEE ? 1.0f : 0.0f; }
+    inline void setMaxSamples(uint32_t maxSamples) { properties1[0] = reinterpret_cast<float&>(maxSamples); }
+    inline void setAdaptive(bool adaptive) { properties1.y = adaptive ? 1.0f : 0.0f; }
+    inline void setAccumulationMode(AccumulationMode mode) { properties1.z = static_cast<float>(mode); }
+    inline void setMaxSampleCount(uint32_t maxCount) { properties1[3] = reinterpret_cast<float&>(maxCount); }
+    inline void setLightSampling(LightSampling sampling) { properties2.x = static_cast<float>(sampling); }
+    inline void setNrLights(uint32_t nrLights) { properties2[1] = reinterpret_cast<float&>(nrLights); }
 };
 
+// An emitter for the light samplers, emission in the w components
 struct TriangleData {
     glm::vec4 vertices[3];
 };
 
+// Matches TriangleAttributes in common.glsl, positions stay in the index and vertex buffers
+struct TriangleAttributes {
+    // Object space face normal, octahedral encoded in two snorm16
+    uint32_t normal;
+    uint32_t material;
+};
+
+// Matches Material in common.glsl
+struct RayTracerMaterial {
+    glm::vec4 albedo;
+    glm::vec4 emission;
+};
+
+struct BottomLevelBuild {
+    VkAccelerationStructureGeometryKHR geometry;
+    VkAccelerationStructureBuildRangeInfoKHR range;
+    VkBuildAccelerationStructureFlagsKHR flags;
+};
+
+
+struct RayTracerInstance {
+    uint32_t meshIdx;
+    glm::mat4 transform;
+    uint8_t mask;
+};
 
 struct RayTracerFrame : public FrameExt {
     VkDescriptorSet descriptorSet;
-    Buffer cameraBuffer;
+    // Mapped for its whole life, written in place once the frame's last use finished
+    MappedBuffer cameraBuffer;
     VkSampler blueNoiseSampler;
+
+    // Every frame has its own TLAS so updating the next frame never waits on tracing this one
+    AccelerationStructure topAC;
+    MappedBuffer instanceBuffer;
+    Buffer scratchBuffer;
+    uint32_t instanceCapacity = 0;
+    uint32_t builtInstanceCount = 0;
+    uint64_t structureVersion = 0;
+    uint64_t contentVersion = 0;
+
+    // World space emitters and both samplers over them, rewritten when lightVersion falls behind
+    MappedBuffer lightBvhBuffer;
+    MappedBuffer lightTriangleBuffer;
+    MappedBuffer lightAliasBuffer;
+    // Lights the buffers hold, they grow with the instances of emitting meshes
+    uint32_t lightCapacity = 0;
+    uint64_t lightVersion = 0;
+
+    // What render traced into this frame, for budgeting against its measured GPU time
+    uint32_t tracedSamples = 0;
+    uint32_t tracedTiles = 0;
+    // Previews trace one short sample per pixel, they say little about regular frames
+    bool tracedPreview = false;
 };
 
 
 struct RayTracerInfo {
     std::vector<const Mesh*> meshes;
+    // Meshes without an entry are built with FastTrace
+    std::vector<BuildPolicy> buildPolicies;
+    BuildPolicy topLevelPolicy = BuildPolicy::FastTrace;
+    // Compact every bottom level structure after building, LowMemory meshes are always compacted
+    bool compactAccelerationStructures = false;
+    // Meshes whose positions survive Snorm16 within this distance are stored quantized, 0 keeps floats
+    float maxQuantizationError = 1e-4f;
+
+    // Samples traced per pixel per frame, adaptive sampling lowers this for quiet pixels
+    uint32_t maxSamplesPerFrame = 10;
+    // Edge of the square tiles the image is traced in, see RayTracer::setTilesPerFrame
+    uint32_t tileSize = 128;
+    bool adaptiveSampling = true;
+    // Relative standard error of the pixel mean below which a pixel stops being traced
+    float varianceThreshold = 0.01f;
+    // Samples a pixel needs before its variance estimate is trusted
+    uint32_t minSamples = 32;
+
+    // The accumulator image has to be created with getAccumulationFormat() after adaptFormats
+    AccumulationMode accumulationMode = AccumulationMode::Sum32;
+    // R16_UINT or R32_UINT, only used by the mean modes
+    VkFormat sampleCountFormat = VK_FORMAT_R16_UINT;
+
+    LightSampling lightSampling = LightSampling::LightBvh;
+
+    RayTracerBackend backend = RayTracerBackend::Megakernel;
+    // The wavefront queues take a few hundred bytes per pixel, they only exist when asked for
+    bool allowWavefront = false;
+    // Sort needs the wavefront backend, ExecutionReorder a device with shader execution reorder
+    RayReordering rayReordering = RayReordering::None;
+
+    inline VkFormat getAccumulationFormat() const {
+        switch(accumulationMode) {
+            case AccumulationMode::Sum32: return VK_FORMAT_R32G32B32A32_SFLOAT;
+            case AccumulationMode::Mean16: return VK_FORMAT_R16G16B16A16_SFLOAT;
+            case AccumulationMode::Mean10: return VK_FORMAT_B10G11R11_UFLOAT_PACK32;
+        }
+        return VK_FORMAT_R32G32B32A32_SFLOAT;
+    }
+
+    // Sum32 sums the squared luminance, the mean modes keep its mean in half the bits
+    inline VkFormat getMomentFormat() const {
+        return accumulationMode == AccumulationMode::Sum32 ? VK_FORMAT_R32_SFLOAT : VK_FORMAT_R16_SFLOAT;
+    }
+
+    // The mean modes and R16 counts need format-less storage images, without them this falls
+    // back to Sum32 and R32 counts. Has to run before the accumulator image is created.
+    void adaptFormats(const AppContext& ctx);
+    bool storesWithoutFormat(const AppContext& ctx) const;
+
+    inline void addMesh(const Mesh* mesh, BuildPolicy policy = BuildPolicy::FastTrace) {
+        buildPolicies.resize(meshes.size(), BuildPolicy::FastTrace);
+        meshes.push_back(mesh);
+        buildPolicies.push_back(policy);
+    }
+
+    inline BuildPolicy getBuildPolicy(size_t meshIdx) const {
+        return meshIdx < buildPolicies.size() ? buildPolicies[meshIdx] : BuildPolicy::FastTrace;
+    }
 };
 
 class RayTracer : public AppExt {
@@ -72,6 +215,43 @@ public:
     void render(FrameContext& frame, const Camera& camera, bool NEE);
 
     inline void resetAccumulator() { shouldReset = true; }
+    inline void setAdaptiveSampling(bool adaptive) { info.adaptiveSampling = adaptive; }
+    inline bool getAdaptiveSampling() const { return info.adaptiveSampling; }
+    inline void setLightSampling(LightSampling sampling) { info.lightSampling = sampling; }
+    inline LightSampling getLightSampling() const { return info.lightSampling; }
+    inline void setBackend(RayTracerBackend backend) {
+        assert((backend == RayTracerBackend::Megakernel || info.allowWavefront) && "Wavefront needs RayTracerInfo::allowWavefront");
+        info.backend = backend;
+    }
+    inline RayTracerBackend getBackend() const { return info.backend; }
+    inline void setRayReordering(RayReordering reordering) {
+        assert((reordering != RayReordering::Sort || info.allowWavefront) && "Sorting needs RayTracerInfo::allowWavefront");
+        assert((reordering != RayReordering::ExecutionReorder || executionReorderSupported) && "Device has no shader execution reorder");
+        info.rayReordering = reordering;
+    }
+    inline RayReordering getRayReordering() const { return info.rayReordering; }
+    inline bool supportsExecutionReorder() const { return executionReorderSupported; }
+    // Asked for with RayTracerInfo::allowWavefront, left out on devices without indirect traces
+    inline bool supportsWavefront() const { return info.allowWavefront; }
+    inline void setSamplesPerFrame(uint32_t samples) { info.maxSamplesPerFrame = std::clamp(samples, 1u, 255u); }
+    inline uint32_t getSamplesPerFrame() const { return info.maxSamplesPerFrame; }
+    // Tiles traced per frame in round robin order, 0 traces all of them
+    inline void setTilesPerFrame(uint32_t tiles) { tilesPerFrame = tiles; }
+    inline uint32_t getTilesPerFrame() const { return tilesPerFrame; }
+    // Tiles the preview after a reset covers per frame, 0 previews all of them at once. Regular
+    // frames only start once every tile was previewed.
+    inline void setPreviewTilesPerFrame(uint32_t tiles) { previewTilesPerFrame = tiles; }
+    inline uint32_t getPreviewTilesPerFrame() const { return previewTilesPerFrame; }
+    // Known once the first frame was set up
+    inline uint32_t getNrTiles() const { return nrTiles; }
+    // Rays the wavefront backend traced since the last call, extend and shadow rays alike. Waits for the device.
+    // Counted in 32 bits per queue on the GPU, so take them at least every few frames.
+    uint64_t takeWavefrontRayCount();
+
+    uint32_t addInstance(uint32_t meshIdx, const glm::mat4& transform = glm::mat4(1.0f), uint8_t mask = 0xFF);
+    void removeInstance(uint32_t instanceId);
+    void setInstanceTransform(uint32_t instanceId, const glm::mat4& transform);
+    void setInstanceMask(uint32_t instanceId, uint8_t mask);
 
 	PFN_vkGetBufferDeviceAddressKHR vkGetBufferDeviceAddressKHR;
 	PFN_vkCreateAccelerationStructureKHR vkCreateAccelerationStructureKHR;
@@ -81,19 +261,42 @@ public:
 	PFN_vkCmdBuildAccelerationStructuresKHR vkCmdBuildAccelerationStructuresKHR;
 	PFN_vkBuildAccelerationStructuresKHR vkBuildAccelerationStructuresKHR;
 	PFN_vkCmdTraceRaysKHR vkCmdTraceRaysKHR;
+	PFN_vkCmdTraceRaysIndirectKHR vkCmdTraceRaysIndirectKHR;
 	PFN_vkGetRayTracingShaderGroupHandlesKHR vkGetRayTracingShaderGroupHandlesKHR;
 	PFN_vkCreateRayTracingPipelinesKHR vkCreateRayTracingPipelinesKHR;
+	PFN_vkCmdWriteAccelerationStructuresPropertiesKHR vkCmdWriteAccelerationStructuresPropertiesKHR;
+	PFN_vkCmdCopyAccelerationStructureKHR vkCmdCopyAccelerationStructureKHR;
 
 private:
     void loadFunctions();
     Buffer createScratchBuffer(VkDeviceSize size);
     AccelerationStructure createAccelerationStructureBuffer(VkAccelerationStructureBuildSizesInfoKHR buildSizeInfo);
+    AccelerationStructure createAccelerationStructure(VkAccelerationStructureTypeKHR type, VkDeviceSize size);
 
     void getFeatures();
     void createRayTracingPipeline();
+    void choosePackings();
     void createBottomLevelAccelerationStructures();
-    void createTopLevelAccelerationStructure();
+    void buildBottomLevelBatch(const std::vector<BottomLevelBuild>& builds);
+    void compactBottomLevel(const std::vector<size_t>& acIndices, VkQueryPool compactedSizes);
+    void createTopLevelAccelerationStructure(RayTracerFrame& rFrame, uint32_t capacity);
+    void destroyTopLevelAccelerationStructure(RayTracerFrame& rFrame);
+    void updateTopLevelAccelerationStructure(FrameContext& frame);
+    void writeTopLevelDescriptor(RayTracerFrame& rFrame) const;
+    VkAccelerationStructureGeometryKHR getTopLevelGeometry(const RayTracerFrame& rFrame) const;
+    VkBuildAccelerationStructureFlagsKHR getTopLevelFlags() const;
     void createShaderBindingTable();
+    void checkAccumulationFormats();
+    void createSamplingImages(uint32_t width, uint32_t height);
+    void createSampleBudgetPipeline();
+    void createWavefrontQueues(uint32_t width, uint32_t height);
+    void traceWavefront(FrameContext& frame, uint32_t firstTile, uint32_t frameTiles, bool preview);
+    void getSceneBounds(glm::vec3& boundsMin, glm::vec3& boundsMax) const;
+    void computeSampleBudget(FrameContext& frame);
+    void updateLights();
+    void uploadLights(FrameContext& frame);
+    void createLightBuffers(RayTracerFrame& frame, uint32_t capacity);
+    void destroyLightBuffers(RayTracerFrame& frame);
 
     void destroyAccelerationStructure(AccelerationStructure& structure) const;
     uint64_t getBufferDeviceAddress(VkBuffer buffer) const;
@@ -102,8 +305,8 @@ private:
 
     Buffer vertexBuffer; 
     Buffer indexBuffer;
-    Buffer triangleDataBuffer;
-    Buffer emissiveTriangleBuffer;
+    Buffer triangleAttributeBuffer;
+    Buffer materialBuffer;
     Buffer transformBuffer;
 
     std::vector<VkRayTracingShaderGroupCreateInfoKHR> shaderGroups{};
@@ -111,22 +314,89 @@ private:
     VkDescriptorSetLayout descriptorSetLayout;
     VkPipelineLayout pipelineLayout;
     VkPipeline pipeline;
-    Buffer raygenShaderBindingTable;
+    // One per raygen group, the megakernel first and then the wavefront stages
+    std::vector<Buffer> raygenShaderBindingTables;
+    bool executionReorderSupported = false;
+    // Otherwise the shaders touching the sampling images are the FORMATTED_STORAGE variants
+    bool formatlessStorage = false;
     Buffer missShaderBindingTable;
     Buffer hitShaderBindingTable;
 
     VkPhysicalDeviceRayTracingPipelinePropertiesKHR rayTracingPipelineProperties{};
     VkPhysicalDeviceAccelerationStructureFeaturesKHR accelerationStructureFeatures{};
+    VkPhysicalDeviceAccelerationStructurePropertiesKHR accelerationStructureProperties{};
 
 
     std::vector<AccelerationStructure> bottomACs;
     std::vector<uint32_t> triangleDataOffsets;
-    AccelerationStructure topAC;
+    // Per mesh formats and byte offsets into the vertex and index buffers
+    std::vector<MeshPacking> meshPackings;
+    std::vector<VkDeviceSize> vertexOffsets;
+    std::vector<VkDeviceSize> indexOffsets;
+    VkDeviceSize vertexBufferSize = 0;
+    VkDeviceSize indexBufferSize = 0;
+
+    // Object space emitters of all meshes, each mesh's first one and count
+    std::vector<TriangleData> emissiveObjectTriangles;
+    std::vector<std::pair<uint32_t, uint32_t>> meshEmitterRanges;
+    std::vector<bool> meshHasEmitters;
+    // Every live instance of a mesh with emitters brings its own world space copy of them
+    std::vector<TriangleData> lightTriangles;
+    std::vector<LightPrimitive> lightPrimitives;
+    LightBvh lightBvh;
+    // Over the world space powers, scaled instances get picked more often
+    std::vector<AliasEntry> lightAliasTable;
+    // Bumped when an instance of a mesh with emitters is added, removed or moved
+    uint64_t lightVersion = 1;
+    uint64_t builtLightVersion = 0;
+
+    // Slots of removed instances stay empty until reused
+    std::vector<std::optional<RayTracerInstance>> instances;
+    std::vector<uint32_t> freeInstanceIds;
+    uint32_t nrLiveInstances = 0;
+    // Bumped when instances are added or removed, forcing a rebuild
+    uint64_t structureVersion = 1;
+    // Bumped when transforms or masks change, a refit is enough
+    uint64_t contentVersion = 1;
 
     Image blueNoise;
 
+    // Shared by all frames, like the accumulator they live next to
+    Image momentImage;
+    Image budgetImage;
+    Image sampleCountImage;
+    uint32_t samplingWidth = 0;
+    uint32_t samplingHeight = 0;
+    uint32_t nrTiles = 0;
+    uint32_t tilesPerFrame = 0;
+    // First tile of the next regular frame
+    uint32_t nextTile = 0;
+    uint32_t previewTilesPerFrame = 0;
+    // Tiles the running preview has yet to cover, and where the next preview frame starts
+    uint32_t previewTilesLeft = 0;
+    uint32_t nextPreviewTile = 0;
+
+    // Sized for one path per pixel, a single element each without allowWavefront
+    Buffer wavefrontQueueHeaders;
+    Buffer wavefrontRays;
+    Buffer wavefrontHits;
+    Buffer wavefrontShadowRays;
+    Buffer wavefrontPixels;
+    // Bin counts and offsets of the ray sort
+    Buffer wavefrontSortBins;
+    uint32_t wavefrontCapacity = 0;
+    // Object space bounds per mesh, the sort keys quantize origins within the scene's bounds
+    std::vector<std::array<glm::vec3, 2>> meshBounds;
+
+    VkDescriptorSetLayout budgetDescriptorSetLayout;
+    VkPipelineLayout budgetPipelineLayout;
+    VkPipeline budgetPipeline;
+    VkDescriptorSet budgetDescriptorSet = VK_NULL_HANDLE;
+
     bool shouldReset = false;
     uint32_t tick = 0;
+    // Not glfwGetTime, headless contexts never initialize GLFW
+    std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
 };
 
 
@@ -0,0 +1,128 @@
+#pragma once
+#include "precomp.h"
+#include "AppContext.h"
+#include "AppExt.h"
+#include "BufferTools.h"
+#include "ComputeShader.h"
+#include "FrameManager.h"
+
+namespace lv {
+
+class Reduction;
+
+template<>
+struct app_extensions<Reduction> {
+    void operator()(AppContextInfo& info) const {
+        // Runs on ComputeShader, so it needs whatever that needs
+        app_extensions<ComputeShader>()(info);
+    }
+};
+
+enum class ReductionOp : uint32_t { Sum, Min, Max, Mean, Histogram };
+enum class ReductionSource : uint32_t { Image, Buffer };
+// What a single float image texel contributes, buffers are always read as plain floats
+enum class ReductionValue : uint32_t { Luminance, ChannelSum, Alpha };
+
+struct ReductionSlotInfo {
+    ReductionOp op;
+    ReductionSource source;
+    ReductionValue value = ReductionValue::Luminance;
+    // Sum accumulators keep the sample count in alpha, mean ones store 1 there
+    bool divideByAlpha = false;
+
+    FrameSelector<VkImageView> view;
+    FrameSelector<VkExtent2D> extent;
+    FrameSelector<VkBuffer> buffer;
+    FrameSelector<uint32_t> count;
+
+    // Histogram bins cover [minValue, maxValue], values outside are clamped into the edge bins
+    uint32_t bins = 0;
+    float minValue = 0.0f;
+    float maxValue = 1.0f;
+    // Bins are spaced in log2 of the value, what auto exposure wants
+    bool logarithmic = false;
+};
+
+struct ReductionInfo {
+    std::unordered_map<uint32_t, ReductionSlotInfo> slots;
+
+    inline void defineImageReduction(uint32_t slot, ReductionOp op, ReductionValue value, FrameSelector<VkImageView> view, FrameSelector<VkExtent2D> extent, bool divideByAlpha = false) {
+        assert(slots.find(slot) == slots.end() && "Reduction slot already populated");
+        ReductionSlotInfo info { .op = op, .source = ReductionSource::Image, .value = value, .divideByAlpha = divideByAlpha };
+        info.view = std::move(view);
+        info.extent = std::move(extent);
+        slots.insert({slot, info});
+    }
+
+    inline void defineBufferReduction(uint32_t slot, ReductionOp op, FrameSelector<VkBuffer> buffer, FrameSelector<uint32_t> count) {
+        assert(slots.find(slot) == slots.end() && "Reduction slot already populated");
+        ReductionSlotInfo info { .op = op, .source = ReductionSource::Buffer };
+        info.buffer = std::move(buffer);
+        info.count = std::move(count);
+        slots.insert({slot, info});
+    }
+
+    inline void setHistogram(uint32_t slot, uint32_t bins, float minValue, float maxValue, bool logarithmic = false) {
+        assert(slots.find(slot) != slots.end() && "Reduction slot not defined");
+        assert(bins > 0 && bins <= 256 && "Histograms hold at most 256 bins");
+        auto& info = slots.at(slot);
+        info.op = ReductionOp::Histogram;
+        info.bins = bins;
+        info.minValue = minValue;
+        info.maxValue = maxValue;
+        info.logarithmic = logarithmic;
+    }
+};
+
+// Matches the push constants of the reduce shaders
+struct ReductionConstants {
+    uint32_t op;
+    uint32_t value;
+    uint32_t divideByAlpha;
+    uint32_t count;
+    uint32_t width;
+    uint32_t nrGroups;
+    uint32_t bins;
+    uint32_t logarithmic;
+    float minValue;
+    float maxValue;
+};
+
+// Two pass reduction: every workgroup folds its share through subgroup operations and shared
+// memory into one partial, a single workgroup then folds the partials into a host visible result.
+// Nothing touches global atomics, so the cost does not depend on how many pixels agree.
+class Reduction : public AppExt {
+public:
+    Reduction(AppContext& ctx, ReductionInfo info);
+
+    void embellishFrameContext(FrameContext& frame) override;
+    void cleanupFrameContext(FrameContext& frame) override;
+
+    // The source has to be visible to compute shaders already, the result is made visible to the host
+    void record(FrameContext& frame, uint32_t slot);
+
+    // Results of the last time this frame context was recorded, valid once that frame finished
+    float getValue(FrameContext& frame, uint32_t slot);
+    std::span<const uint32_t> getHistogram(FrameContext& frame, uint32_t slot);
+
+private:
+    struct SlotFrame {
+        Buffer partials;
+        MappedBuffer result;
+    };
+
+    struct Slot {
+        ReductionSlotInfo info;
+        std::unique_ptr<ComputeShader> firstPass;
+        std::unique_ptr<ComputeShader> finalPass;
+        std::vector<SlotFrame> frames;
+    };
+
+    void checkSubgroupSupport() const;
+    SlotFrame& getSlotFrame(const FrameContext& frame, uint32_t slot);
+
+    ReductionInfo info;
+    std::unordered_map<uint32_t, Slot> slots;
+};
+
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include "precomp.h"
+
+namespace lv {
+
+struct RenderBudgetInfo {
+    // GPU time of a whole frame, the ray tracer plus everything recorded after it
+    float targetMilliseconds = 16.0f;
+    // Kept free on top of the measured rest of the frame, covers present and timing jitter
+    float headroomMilliseconds = 1.0f;
+    uint32_t minSamples = 1;
+    uint32_t maxSamples = 32;
+    // Weight of the newest measurement in the running estimates
+    float smoothing = 0.25f;
+};
+
+// Picks samples per pixel and the number of tiles the ray tracer traces each frame so a frame
+// stays within its GPU time budget. The rest of the frame (overlay, rasterizer, reductions) is
+// measured too and always gets its share first. Whatever is left goes to the full image at as
+// many samples as fit, and once a single sample over the full image does not fit anymore the
+// ray tracer only progresses through part of the tiles per frame. Previews after a reset cost
+// differently per tile than regular frames, so they are measured and planned on their own.
+class RenderBudget {
+public:
+    RenderBudget(RenderBudgetInfo info = {});
+
+    // What a frame that traced samples over tiles took, its ray tracing and everything else
+    void addMeasurement(double rayTracerMilliseconds, double restMilliseconds, uint32_t samples, uint32_t tiles);
+    // What a preview frame over tiles took, see RayTracer::setPreviewTilesPerFrame
+    void addPreviewMeasurement(double rayTracerMilliseconds, double restMilliseconds, uint32_t tiles);
+    // Decides the next frame out of nrTiles
+    void plan(uint32_t nrTiles);
+
+    inline void setTarget(float milliseconds) { info.targetMilliseconds = milliseconds; }
+    inline uint32_t getSamples() const { return samples; }
+    inline uint32_t getTiles() const { return tiles; }
+    inline uint32_t getPreviewTiles() const { return previewTiles; }
+    // Estimated cost of one sample over one tile, negative before the first measurement
+    inline double getSampleTileMilliseconds() const { return sampleTileMilliseconds; }
+
+private:
+    void addRestMeasurement(double restMilliseconds);
+
+    RenderBudgetInfo info;
+    double sampleTileMilliseconds = -1.0;
+    double previewTileMilliseconds = -1.0;
+    double restMilliseconds = -1.0;
+    uint32_t samples = 1;
+    uint32_t tiles = 0;
+    uint32_t previewTiles = 0;
+};
+
+}
@@ -0,0 +1,122 @@
+#pragma once
+#include "precomp.h"
+#include "AppContext.h"
+#include "AppExt.h"
+#include "FrameManager.h"
+#include "ResourceStore.h"
+
+namespace lv {
+
+class RenderGraph;
+
+template<>
+struct app_extensions<RenderGraph> {
+    void operator()(AppContextInfo& info) const {
+        // Stage and access masks fine grained enough for ray tracing and clear transfer stages
+        info.deviceExtensions.insert(VK_KHR_SYNCHRONIZATION_2_EXTENSION_NAME);
+    }
+};
+
+// Which of the ResourceStore's slots a pass touches
+enum class GraphResource : uint32_t { Image, StaticImage, Buffer, TransientImage, TransientBuffer };
+
+// How a pass touches a resource, storage writes count as read-modify-write
+enum class GraphUsage : uint32_t { StorageRead, StorageWrite, Sampled, ColorAttachment, TransferSrc, TransferDst };
+
+struct RenderGraphUse {
+    GraphResource resource;
+    uint32_t slot;
+    GraphUsage usage;
+};
+
+struct RenderGraphPassInfo {
+    std::string name;
+    // Shader stages the storage and sampled uses happen in
+    VkPipelineStageFlags2 stages;
+    std::function<void(FrameContext&)> record;
+    // Writes something the graph does not see, like the swapchain or a host readback, so it is never culled
+    bool sideEffects = false;
+    std::vector<RenderGraphUse> uses;
+
+    inline RenderGraphPassInfo& useImage(uint32_t slot, GraphUsage usage) {
+        uses.push_back({ GraphResource::Image, slot, usage });
+        return *this;
+    }
+
+    inline RenderGraphPassInfo& useStaticImage(uint32_t slot, GraphUsage usage) {
+        uses.push_back({ GraphResource::StaticImage, slot, usage });
+        return *this;
+    }
+
+    inline RenderGraphPassInfo& useBuffer(uint32_t slot, GraphUsage usage) {
+        uses.push_back({ GraphResource::Buffer, slot, usage });
+        return *this;
+    }
+
+    // The pass has to lie within the lifetime the transient was defined with
+    inline RenderGraphPassInfo& useTransientImage(uint32_t slot, GraphUsage usage) {
+        uses.push_back({ GraphResource::TransientImage, slot, usage });
+        return *this;
+    }
+
+    inline RenderGraphPassInfo& useTransientBuffer(uint32_t slot, GraphUsage usage) {
+        uses.push_back({ GraphResource::TransientBuffer, slot, usage });
+        return *this;
+    }
+
+    inline RenderGraphPassInfo& withSideEffects() {
+        sideEffects = true;
+        return *this;
+    }
+};
+
+struct RenderGraphInfo {
+    // Owner of every slot the passes use
+    ResourceStore* resourceStore = nullptr;
+    std::vector<RenderGraphPassInfo> passes;
+
+    // The reference is only good until the next pass is defined
+    inline RenderGraphPassInfo& definePass(std::string name, VkPipelineStageFlags2 stages, std::function<void(FrameContext&)> record) {
+        passes.push_back(RenderGraphPassInfo { .name = std::move(name), .stages = stages, .record = std::move(record) });
+        return passes.back();
+    }
+};
+
+// Records passes in the order they were defined with the barriers their declared uses need in
+// between. Layouts and the last accesses of every resource are tracked across frames, so a
+// frame starts from wherever the previously recorded one left its resources. Hazards without
+// a layout change fold into one global memory barrier per pass, transitions get an image
+// barrier each. Passes whose writes nothing live reads are culled once at construction.
+// The first pass of a transient's lifetime discards its contents and waits on whatever used
+// the memory it shares earlier in the frame.
+class RenderGraph : public AppExt {
+public:
+    RenderGraph(AppContext& ctx, RenderGraphInfo info);
+
+    void execute(FrameContext& frame);
+    inline bool isCulled(uint32_t passIdx) const { return !live[passIdx]; }
+
+private:
+    struct ResourceState {
+        VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED;
+        // The last write and the reads that were made to wait on it since
+        VkPipelineStageFlags2 writeStages = VK_PIPELINE_STAGE_2_NONE;
+        VkAccessFlags2 writeAccess = VK_ACCESS_2_NONE;
+        VkPipelineStageFlags2 readStages = VK_PIPELINE_STAGE_2_NONE;
+        VkAccessFlags2 readAccess = VK_ACCESS_2_NONE;
+    };
+
+    void cullPasses();
+    ResourceState& getState(FrameContext& frame, const RenderGraphUse& use, VkImage& image);
+    const TransientLifetime* getLifetime(const RenderGraphUse& use) const;
+    void beginTransient(FrameContext& frame, const RenderGraphUse& use, ResourceState& state);
+
+    PFN_vkCmdPipelineBarrier2KHR vkCmdPipelineBarrier2KHR;
+
+    RenderGraphInfo info;
+    std::vector<bool> live;
+    std::unordered_map<VkImage, ResourceState> imageStates;
+    std::unordered_map<VkBuffer, ResourceState> bufferStates;
+};
+
+}
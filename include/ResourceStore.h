@@ -21,6 +21,29 @@ struct BufferInfo {
     VkDeviceSize size;
 };
 
+// Indices of the first and last render graph pass of a frame that use a transient resource.
+// Transients whose lifetimes do not overlap may be handed the same memory.
+struct TransientLifetime {
+    uint32_t firstPass;
+    uint32_t lastPass;
+};
+
+struct TransientImageInfo {
+    ImageInfo image;
+    TransientLifetime lifetime;
+};
+
+struct TransientBufferInfo {
+    BufferInfo buffer;
+    TransientLifetime lifetime;
+};
+
+// Where a transient sits in its frame's shared allocation
+struct TransientPlacement {
+    VkDeviceSize offset;
+    VkDeviceSize size;
+};
+
 
 struct ResourceStoreInfo {
     std::unordered_map<uint32_t, ImageInfo> m_imageInfos;
@@ -28,13 +51,19 @@ struct ResourceStoreInfo {
 
     std::unordered_map<uint32_t, BufferInfo> m_bufferInfos;
 
-    inline void defineImage(uint32_t slot, VkFormat format, VkImageUsageFlags usage, VkImageLayout initialLayout) {
-        ImageInfo info { format, usage, initialLayout };
+    std::unordered_map<uint32_t, TransientImageInfo> m_transientImageInfos;
+    std::unordered_map<uint32_t, TransientBufferInfo> m_transientBufferInfos;
+
+    inline void defineImage(uint32_t slot, VkFormat format, VkImageUsageFlags usage, VkImageLayout initialLayout,
+                            FrameSelector<uint32_t> width, FrameSelector<uint32_t> height) {
+        ImageInfo info { format, usage, initialLayout, std::move(width), std::move(height) };
         m_imageInfos.insert({slot, info});
     }
 
-    inline void defineStaticImage(uint32_t slot, VkFormat format, VkImageUsageFlags usage, VkImageLayout initialLayout) {
-        ImageInfo info { format, usage, initialLayout };
+    // Shared by all frames and sized by the first frame context
+    inline void defineStaticImage(uint32_t slot, VkFormat format, VkImageUsageFlags usage, VkImageLayout initialLayout,
+                                  FrameSelector<uint32_t> width, FrameSelector<uint32_t> height) {
+        ImageInfo info { format, usage, initialLayout, std::move(width), std::move(height) };
         m_staticImageInfos.insert({slot, info});
     }
 
@@ -42,6 +71,20 @@ struct ResourceStoreInfo {
         BufferInfo info { usage, size };
         m_bufferInfos.insert({slot, info});
     }
+
+    // Contents do not survive outside the lifetime, every frame starts them from an undefined layout
+    inline void defineTransientImage(uint32_t slot, VkFormat format, VkImageUsageFlags usage,
+                                     FrameSelector<uint32_t> width, FrameSelector<uint32_t> height, TransientLifetime lifetime) {
+        assert(lifetime.firstPass <= lifetime.lastPass && "Transient lifetime is empty");
+        ImageInfo info { format, usage, VK_IMAGE_LAYOUT_UNDEFINED, std::move(width), std::move(height) };
+        m_transientImageInfos.insert({slot, TransientImageInfo { info, lifetime }});
+    }
+
+    // Device local, unlike the mapped buffers of defineBuffer
+    inline void defineTransientBuffer(uint32_t slot, VkBufferUsageFlags usage, VkDeviceSize size, TransientLifetime lifetime) {
+        assert(lifetime.firstPass <= lifetime.lastPass && "Transient lifetime is empty");
+        m_transientBufferInfos.insert({slot, TransientBufferInfo { BufferInfo { usage, size }, lifetime }});
+    }
 };
 
 struct ResourceFrame : public FrameExt {
@@ -50,6 +93,13 @@ struct ResourceFrame : public FrameExt {
 
     std::unordered_map<uint32_t, MappedBuffer> buffers;
 
+    // Transients own no memory themselves, they are placed in transientMemory
+    std::unordered_map<uint32_t, Image> transientImages;
+    std::unordered_map<uint32_t, Buffer> transientBuffers;
+    std::unordered_map<uint32_t, TransientPlacement> transientImagePlacements;
+    std::unordered_map<uint32_t, TransientPlacement> transientBufferPlacements;
+    VmaAllocation transientMemory = VK_NULL_HANDLE;
+
     inline const Image& get(uint32_t slot) const {
         assert(images.find(slot) != images.end() && "Image not registered before use");
         return images.at(slot);
@@ -64,6 +114,16 @@ struct ResourceFrame : public FrameExt {
         assert(buffers.find(slot) != buffers.end() && "Buffer not registered before use");
         return buffers[slot];
     }
+
+    inline const Image& getTransient(uint32_t slot) const {
+        assert(transientImages.find(slot) != transientImages.end() && "Image not registered before use");
+        return transientImages.at(slot);
+    }
+
+    inline const Buffer& getTransientBuffer(uint32_t slot) const {
+        assert(transientBuffers.find(slot) != transientBuffers.end() && "Buffer not registered before use");
+        return transientBuffers.at(slot);
+    }
 };
 
 
@@ -74,9 +134,14 @@ public:
 
     void embellishFrameContext(FrameContext& frame) override;
     void cleanupFrameContext(FrameContext& frame) override;
+    inline const ResourceStoreInfo& getInfo() const { return info; }
 private:
-    Image createImage(AppContext& ctx, uint32_t width, uint32_t height, ImageInfo& info);
+    // Leaves the initial transition to be recorded with the others in transitions
+    Image createImage(uint32_t width, uint32_t height, const ImageInfo& info, std::vector<VkImageMemoryBarrier>& transitions);
+    void submitTransitions(const std::vector<VkImageMemoryBarrier>& transitions);
+    void createTransients(FrameContext& frame, ResourceFrame& rFrame);
     ResourceStoreInfo info;
     std::unordered_map<uint32_t, Image> staticImages;
+    bool staticImagesCreated = false;
 };
 }
@@ -0,0 +1,31 @@
+#pragma once
+#include "precomp.h"
+
+namespace lv {
+
+class ThreadPool : NoCopy {
+public:
+    explicit ThreadPool(uint32_t nrThreads = std::max(1u, std::thread::hardware_concurrency()));
+    ~ThreadPool();
+
+    // Calls fn(begin, end) over [0, count) in chunks of at least grain elements.
+    // Blocks until every chunk ran, the calling thread works along so nesting cannot deadlock.
+    void parallelFor(size_t count, size_t grain, const std::function<void(size_t, size_t)>& fn);
+
+    inline uint32_t getNrThreads() const { return static_cast<uint32_t>(workers.size()) + 1; }
+
+    // Process wide pool, created on first use
+    static ThreadPool& shared();
+
+private:
+    void workerLoop();
+    void submit(std::function<void()> task);
+
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stopping = false;
+};
+
+}
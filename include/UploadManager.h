@@ -0,0 +1,94 @@
+#pragma once
+#include "precomp.h"
+#include "AppContext.h"
+#include "BufferTools.h"
+
+namespace lv {
+
+struct UploadManagerInfo {
+    // Persistently mapped staging memory shared by all uploads
+    VkDeviceSize ringSize = 64 * 1024 * 1024;
+    // Uploads larger than this get their own staging buffer instead of going through the ring
+    VkDeviceSize maxRingUpload = 16 * 1024 * 1024;
+};
+
+// Batches staging copies into a single submission, safe to use from any thread.
+// With a dedicated transfer family the copies run there and ownership moves to the graphics family.
+class UploadManager : NoCopy {
+public:
+    UploadManager(AppContext& ctx, UploadManagerInfo info = {});
+    ~UploadManager();
+
+    // Destinations must use exclusive sharing and are owned by the graphics family once complete.
+    // On a transfer queue the rest of the destination is not preserved, so only fill fresh resources
+    UploadToken uploadBuffer(VkBuffer dst, VkDeviceSize dstOffset, VkDeviceSize size, const void* data);
+    // fill writes straight into the staging memory, it runs without holding the lock
+    UploadToken uploadBuffer(VkBuffer dst, VkDeviceSize dstOffset, VkDeviceSize size, const std::function<void(void*)>& fill);
+    // Moves the whole image from UNDEFINED to finalLayout, data is tightly packed
+    UploadToken uploadImage(VkImage dst, uint32_t width, uint32_t height, VkDeviceSize size, const void* data, VkImageLayout finalLayout);
+
+    // Submits the batch being recorded and returns its token
+    UploadToken flush();
+    // Flushes if needed and blocks until the batch of token finished
+    void wait(UploadToken token);
+    // Never flushes, tokens of the batch being recorded stay incomplete until it is submitted
+    bool isComplete(UploadToken token);
+    void waitIdle();
+
+private:
+    struct StagingRegion {
+        VkBuffer buffer;
+        VmaAllocation memory;
+        VkDeviceSize offset;
+        void* data;
+    };
+
+    struct Batch {
+        UploadToken token = 0;
+        VkCommandBuffer cmdBuffer = VK_NULL_HANDLE;
+        VkFence fence = VK_NULL_HANDLE;
+        // Only used with a dedicated transfer queue, acquires the uploads on the graphics queue
+        VkCommandBuffer acquireCmdBuffer = VK_NULL_HANDLE;
+        VkSemaphore released = VK_NULL_HANDLE;
+        std::vector<VkBuffer> buffers;
+        std::vector<std::pair<VkImage, VkImageLayout>> images;
+        // Ring memory up to here is free once the fence signals
+        VkDeviceSize ringEnd = 0;
+        uint32_t nrCopies = 0;
+        // Copies that reserved staging in this batch but are still filling it
+        uint32_t pendingWrites = 0;
+        std::vector<Buffer> dedicatedStaging;
+    };
+
+    UploadToken record(VkDeviceSize size, const std::function<void(void*)>& fill, const std::function<void(VkCommandBuffer, const StagingRegion&)>& copy);
+    StagingRegion reserve(std::unique_lock<std::mutex>& lock, VkDeviceSize size);
+    bool tryReserveRing(VkDeviceSize size, VkDeviceSize& offset);
+    void beginBatch();
+    void submitBatch(std::unique_lock<std::mutex>& lock);
+    void submitTransferBatch();
+    void submitGraphicsBatch();
+    void retireBatches(bool waitOldest);
+
+    AppContext& ctx;
+    UploadManagerInfo info;
+
+    bool useTransferQueue;
+    // On the transfer family when useTransferQueue, otherwise on graphics
+    VkCommandPool commandPool;
+    VkCommandPool acquirePool = VK_NULL_HANDLE;
+    MappedBuffer ring;
+    VkDeviceSize ringHead = 0;
+    VkDeviceSize ringTail = 0;
+
+    Batch recording;
+    std::deque<Batch> inFlight;
+    std::vector<VkFence> freeFences;
+    std::vector<VkSemaphore> freeSemaphores;
+    UploadToken nextToken = 1;
+    UploadToken completedToken = 0;
+
+    std::mutex mutex;
+    std::condition_variable writesDone;
+};
+
+}
@@ -7,6 +7,15 @@
 namespace lv {
 
 class AppContext;
+class Window;
+
+template<>
+struct app_extensions<Window> {
+    void operator()(AppContextInfo& info) const {
+        info.requiresPresentation = true;
+        info.deviceExtensions.insert(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
+    }
+};
 
 struct SwapchainSupport {
     VkSurfaceCapabilitiesKHR capabilities;
@@ -26,6 +35,8 @@ struct WindowInfo {
     std::string windowName;
     uint32_t width;
     uint32_t height;
+    // 1 for the lowest input latency, more keep the GPU busy while the CPU records the next frame
+    uint32_t framesInFlight = 2;
 };
 
 
@@ -61,14 +72,15 @@ private:
     bool wasResized = false;
 
     struct {
-        uint32_t currentInFlight = 0;
         uint32_t imageIdx = 0;
         VkSwapchainKHR vkSwapchain = VK_NULL_HANDLE;
         VkSwapchainKHR vkOldSwapchain = VK_NULL_HANDLE;
         VkSurfaceFormatKHR surfaceFormat;
         VkExtent2D extent;
         std::vector<VkImage> images;
+        // Per frame in flight, the image is only known once acquiring it has been handed one
         std::vector<VkSemaphore> imageAvailableSemaphores;
+        // Per image, presenting may still hold one after its frame finished on the timeline
         std::vector<VkSemaphore> renderFinishedSemaphores;
     } swapchain;
 };
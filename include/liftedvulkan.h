@@ -4,11 +4,20 @@
 #include "AppContext.h"
 #include "FrameManager.h"
 #include "Window.h"
+#include "OffscreenFrameManager.h"
+#include "UploadManager.h"
+#include "ThreadPool.h"
+#include "AliasTable.h"
+#include "LightBvh.h"
 #include "ComputeShader.h"
+#include "Reduction.h"
 #include "Rasterizer.h"
 #include "RayTracer.h"
 #include "ResourceStore.h"
+#include "RenderGraph.h"
 #include "Overlay.h"
+#include "GpuProfiler.h"
 #include "Camera.h"
+#include "RenderBudget.h"
 
 
@@ -20,6 +20,18 @@ typedef unsigned char uchar;
 #include <utility>
 #include <optional>
 #include <typeindex>
+#include <chrono>
+#include <span>
+#include <filesystem>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <array>
+#include <algorithm>
+#include <charconv>
+#include <numeric>
 
 // GLFW
 #define GLFW_INCLUDE_VULKAN
@@ -0,0 +1,144 @@
+#include "AliasTable.h"
+
+namespace lv {
+
+namespace aliastable {
+    // Below this the bookkeeping of the parallel build costs more than it saves
+    static const size_t minItemsPerChunk = 16 * 1024;
+
+    static std::vector<AliasEntry> build_uniform(size_t count) {
+        std::vector<AliasEntry> ret(count);
+        const float pdf = 1.0f / static_cast<float>(count);
+        for(size_t i=0; i<count; i++) {
+            ret[i] = AliasEntry { .probability = 1.0f, .alias = static_cast<uint32_t>(i), .pdf = pdf };
+        }
+        return ret;
+    }
+
+    // Items are scaled to a mean of one. The sweep pairs lights (below one) and heavies in index
+    // order: a light fills its bucket from the current heavy, a heavy that dropped to one or
+    // below closes its own bucket with the next heavy as alias. Writing a(i) for the deficit of
+    // the lights before light i and b(j) for the surplus of the heavies up to and including
+    // heavy j, the sweep takes the light exactly when a(i) < b(j). That is a merge of two sorted
+    // sequences, so every chunk can find where it starts with a merge path binary search and
+    // runs independently of the others.
+    std::vector<AliasEntry> build(std::span<const float> weights, ThreadPool& pool) {
+        const size_t n = weights.size();
+        if (n == 0) return {};
+
+        const size_t nrChunks = std::clamp<size_t>(n / minItemsPerChunk, 1, pool.getNrThreads() * 4);
+        auto chunkBegin = [&](size_t chunk, size_t count) { return chunk * count / nrChunks; };
+
+        // Total weight
+        std::vector<double> chunkSums(nrChunks, 0.0);
+        pool.parallelFor(nrChunks, 1, [&](size_t begin, size_t end) {
+            for(size_t c=begin; c<end; c++) {
+                double sum = 0.0;
+                for(size_t k=chunkBegin(c, n); k<chunkBegin(c + 1, n); k++) sum += std::max(weights[k], 0.0f);
+                chunkSums[c] = sum;
+            }
+        });
+        const double total = std::accumulate(chunkSums.begin(), chunkSums.end(), 0.0);
+        if (!(total > 0.0)) return build_uniform(n);
+
+        const double scale = static_cast<double>(n) / total;
+        auto scaled = [&](size_t k) { return std::max(weights[k], 0.0f) * scale; };
+
+        // Stable split into lights and heavies, counted per chunk first
+        std::vector<size_t> chunkLights(nrChunks + 1, 0);
+        std::vector<double> chunkDeficit(nrChunks + 1, 0.0);
+        std::vector<double> chunkSurplus(nrChunks + 1, 0.0);
+        pool.parallelFor(nrChunks, 1, [&](size_t begin, size_t end) {
+            for(size_t c=begin; c<end; c++) {
+                for(size_t k=chunkBegin(c, n); k<chunkBegin(c + 1, n); k++) {
+                    const double p = scaled(k);
+                    if (p < 1.0) {
+                        chunkLights[c + 1]++;
+                        chunkDeficit[c + 1] += 1.0 - p;
+                    } else {
+                        chunkSurplus[c + 1] += p - 1.0;
+                    }
+                }
+            }
+        });
+        for(size_t c=0; c<nrChunks; c++) {
+            chunkLights[c + 1] += chunkLights[c];
+            chunkDeficit[c + 1] += chunkDeficit[c];
+            chunkSurplus[c + 1] += chunkSurplus[c];
+        }
+
+        const size_t nrLights = chunkLights[nrChunks];
+        const size_t nrHeavies = n - nrLights;
+        std::vector<uint32_t> lights(nrLights), heavies(nrHeavies);
+        // a has one extra entry, the full deficit, for when every light is taken
+        std::vector<double> a(nrLights + 1), b(nrHeavies);
+        pool.parallelFor(nrChunks, 1, [&](size_t begin, size_t end) {
+            for(size_t c=begin; c<end; c++) {
+                size_t l = chunkLights[c];
+                size_t h = chunkBegin(c, n) - chunkLights[c];
+                double deficit = chunkDeficit[c];
+                double surplus = chunkSurplus[c];
+                for(size_t k=chunkBegin(c, n); k<chunkBegin(c + 1, n); k++) {
+                    const double p = scaled(k);
+                    if (p < 1.0) {
+                        lights[l] = static_cast<uint32_t>(k);
+                        a[l++] = deficit;
+                        deficit += 1.0 - p;
+                    } else {
+                        surplus += p - 1.0;
+                        heavies[h] = static_cast<uint32_t>(k);
+                        b[h++] = surplus;
+                    }
+                }
+            }
+        });
+        a[nrLights] = chunkDeficit[nrChunks];
+
+        // Number of lights among the first d steps of the sweep, ties go to the heavy
+        auto mergePath = [&](size_t d) {
+            size_t lo = d > nrHeavies ? d - nrHeavies : 0;
+            size_t hi = std::min(d, nrLights);
+            while (lo < hi) {
+                const size_t mid = (lo + hi) / 2;
+                if (a[mid] < b[d - mid - 1]) lo = mid + 1;
+                else hi = mid;
+            }
+            return lo;
+        };
+
+        std::vector<AliasEntry> ret(n);
+        pool.parallelFor(nrChunks, 1, [&](size_t begin, size_t end) {
+            for(size_t c=begin; c<end; c++) {
+                const size_t first = chunkBegin(c, n);
+                size_t i = mergePath(first);
+                size_t j = first - i;
+                for(size_t step=first; step<chunkBegin(c + 1, n); step++) {
+                    if (i < nrLights && (j >= nrHeavies || a[i] < b[j])) {
+                        const uint32_t light = lights[i++];
+                        // Heavies only run out through rounding, the light then keeps its own bucket
+                        const bool paired = j < nrHeavies;
+                        ret[light].probability = paired ? static_cast<float>(scaled(light)) : 1.0f;
+                        ret[light].alias = paired ? heavies[j] : light;
+                    } else {
+                        const uint32_t heavy = heavies[j];
+                        // What is left of the heavy after filling every light before it
+                        const double left = 1.0 + b[j] - a[i];
+                        const bool paired = j + 1 < nrHeavies;
+                        ret[heavy].probability = paired ? static_cast<float>(std::clamp(left, 0.0, 1.0)) : 1.0f;
+                        ret[heavy].alias = paired ? heavies[j + 1] : heavy;
+                        j++;
+                    }
+                }
+            }
+        });
+
+        pool.parallelFor(n, minItemsPerChunk, [&](size_t begin, size_t end) {
+            for(size_t k=begin; k<end; k++) {
+                ret[k].pdf = static_cast<float>(std::max(weights[k], 0.0f) / total);
+            }
+        });
+        return ret;
+    }
+}
+
+}
@@ -2,6 +2,7 @@
 #include "Utils.h"
 #include "AppExt.h"
 #include "FrameManager.h"
+#include "UploadManager.h"
 
 namespace lv {
 
@@ -11,22 +12,35 @@ static struct {
 } windowHelper;
 
 
+// Layout of VK_PIPELINE_CACHE_HEADER_VERSION_ONE, every cache starts with it
+struct PipelineCacheHeader {
+    uint32_t headerSize;
+    uint32_t headerVersion;
+    uint32_t vendorID;
+    uint32_t deviceID;
+    uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+};
+
 static bool checkValidationLayersSupported(const std::vector<const char*>& layers);
 static bool deviceExtensionsSupported(VkPhysicalDevice physicalDevice, const std::set<const char*>& extensions);
 
 AppContext::AppContext(AppContextInfo info) 
     : info(info) {
-    initWindowingSystem();
+    // Headless contexts never touch GLFW or a surface
+    const bool windowed = info.requiresPresentation;
+    if (windowed) initWindowingSystem();
     finalizeInfo();
     createInstance();
-    createWindowSurface();
+    if (windowed) createWindowSurface();
     pickPhysicalDevice();
     findQueueFamilies();
     createLogicalDevice();
-    cleanupWindowHelper();
+    if (windowed) cleanupWindowHelper();
     createVmaAllocator();
     createCommandPool();
     createDescriptorPool();
+    createPipelineCache();
+    createUploadManager();
 }
 
 AppContext::~AppContext() {
@@ -41,6 +55,9 @@ AppContext::~AppContext() {
         it++;
     }
 
+    delete uploadManager;
+    savePipelineCache();
+    vkDestroyPipelineCache(vkDevice, vkPipelineCache, nullptr);
     vmaDestroyAllocator(vmaAllocator);
     vkDestroyDescriptorPool(vkDevice, vkDescriptorPool, nullptr);
     vkDestroyCommandPool(vkDevice, vkCommandPool, nullptr);
@@ -74,9 +91,18 @@ VkCommandBuffer AppContext::singleTimeCommandBuffer() const {
 void AppContext::endSingleTimeCommands(VkCommandBuffer cmdBuffer) const {
     vkCheck(vkEndCommandBuffer(cmdBuffer));
     auto submitInfo = vks::initializers::submitInfo(&cmdBuffer);
-    vkQueueSubmit(queues.graphics, 1, &submitInfo, VK_NULL_HANDLE);
 
-    vkCheck(vkQueueWaitIdle(queues.graphics));
+    // Wait on this submission only instead of draining the whole queue
+    VkFence fence;
+    auto fenceInfo = vks::initializers::fenceCreateInfo();
+    vkCheck(vkCreateFence(vkDevice, &fenceInfo, nullptr, &fence));
+    {
+        std::lock_guard<std::mutex> lock(graphicsQueueMutex);
+        vkCheck(vkQueueSubmit(queues.graphics, 1, &submitInfo, fence));
+    }
+    vkCheck(vkWaitForFences(vkDevice, 1, &fence, VK_TRUE, UINT64_MAX));
+
+    vkDestroyFence(vkDevice, fence, nullptr);
     vkFreeCommandBuffers(vkDevice, vkCommandPool, 1, &cmdBuffer);
 }
 
@@ -98,11 +124,15 @@ void AppContext::finalizeInfo() {
 #ifndef NDEBUG
     info.validationLayers.insert("VK_LAYER_KHRONOS_validation");
 #endif
-    info.deviceExtensions.insert(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
     info.deviceExtensions.insert("VK_KHR_get_memory_requirements2");
     info.deviceExtensions.insert("VK_KHR_dedicated_allocation");
     info.deviceExtensions.insert("VK_KHR_maintenance1");
 
+    if (!info.requiresPresentation) {
+        logger::info("No presentation requested, running headless");
+        return;
+    }
+
     uint32_t glfwExtCount = 0;
     const char** glfwExts = glfwGetRequiredInstanceExtensions(&glfwExtCount);
     for(uint32_t i=0; i<glfwExtCount; i++) {
@@ -179,6 +209,16 @@ void AppContext::findQueueFamilies() {
             logger::debug("Graphics supported on GPU on queue {}", i);
             queueFamilies.graphics = i;
         }
+        // Graphics and compute families can transfer too, only a family without them runs on the copy engines
+        const VkQueueFlags nonTransfer = VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT;
+        if ((queueFamily.queueFlags & VK_QUEUE_TRANSFER_BIT) && !(queueFamily.queueFlags & nonTransfer) && !queueFamilies.transfer.has_value()) {
+            logger::debug("Dedicated transfer supported on GPU on queue {}", i);
+            queueFamilies.transfer = i;
+        }
+
+        if (windowHelper.surface == VK_NULL_HANDLE) {
+            continue;
+        }
 
         VkBool32 presentSupport = false;
         vkGetPhysicalDeviceSurfaceSupportKHR(vkPhysicalDevice, i, windowHelper.surface, &presentSupport);
@@ -194,8 +234,13 @@ void AppContext::createLogicalDevice() {
     std::set<uint> uniqueQueueFamilies = {
             queueFamilies.compute.value(),
             queueFamilies.graphics.value(),
-            queueFamilies.present.value(),
     };
+    if (queueFamilies.present.has_value()) {
+        uniqueQueueFamilies.insert(queueFamilies.present.value());
+    }
+    if (queueFamilies.transfer.has_value()) {
+        uniqueQueueFamilies.insert(queueFamilies.transfer.value());
+    }
 
     queueCreateInfos.reserve(uniqueQueueFamilies.size());
     float queuePriority = 1.0f;
@@ -210,14 +255,29 @@ void AppContext::createLogicalDevice() {
     }
 
 
-    VkPhysicalDeviceFeatures deviceFeatures{
+    VkPhysicalDeviceRayTracingPipelineFeaturesKHR supportedRayTracingPipelineFeatures {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_TRACING_PIPELINE_FEATURES_KHR,
+    };
+    VkPhysicalDeviceFeatures2 supportedFeatures2 {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+        .pNext = &supportedRayTracingPipelineFeatures,
+    };
+    vkGetPhysicalDeviceFeatures2(vkPhysicalDevice, &supportedFeatures2);
+    const VkPhysicalDeviceFeatures& supportedFeatures = supportedFeatures2.features;
+    enabledFeatures = VkPhysicalDeviceFeatures {
         .samplerAnisotropy = VK_TRUE,
         .fragmentStoresAndAtomics = VK_TRUE,
+        // Optional, shaders touching storage images have variants that do without them
+        .shaderStorageImageExtendedFormats = supportedFeatures.shaderStorageImageExtendedFormats,
+        .shaderStorageImageReadWithoutFormat = supportedFeatures.shaderStorageImageReadWithoutFormat,
+        .shaderStorageImageWriteWithoutFormat = supportedFeatures.shaderStorageImageWriteWithoutFormat,
     };
 
     VkPhysicalDeviceRayTracingPipelineFeaturesKHR rayTracingPipelineFeatures {
         .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_TRACING_PIPELINE_FEATURES_KHR,
         .rayTracingPipeline = VK_TRUE,
+        // Optional, RayTracer leaves the wavefront backend out without it
+        .rayTracingPipelineTraceRaysIndirect = supportedRayTracingPipelineFeatures.rayTracingPipelineTraceRaysIndirect,
     };
 
     VkPhysicalDeviceAccelerationStructureFeaturesKHR accelerationStructureFeatures {
@@ -226,9 +286,16 @@ void AppContext::createLogicalDevice() {
         .accelerationStructure = VK_TRUE,
     };
 
+    // Frames signal a timeline instead of fences
+    VkPhysicalDeviceTimelineSemaphoreFeatures timelineSemaphoreFeatures {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES,
+        .pNext = &accelerationStructureFeatures,
+        .timelineSemaphore = VK_TRUE,
+    };
+
     VkPhysicalDeviceBufferDeviceAddressFeatures enabledBufferDevicesAddressFeatures {
         .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_BUFFER_DEVICE_ADDRESS_FEATURES,
-        .pNext = &accelerationStructureFeatures,
+        .pNext = &timelineSemaphoreFeatures,
         .bufferDeviceAddress = VK_TRUE,
     };
 
@@ -245,6 +312,33 @@ void AppContext::createLogicalDevice() {
         logger::error("Not all device extensions supported");
         exit(1);
     }
+    for(const char* extension : info.optionalDeviceExtensions) {
+        if (deviceExtensionsSupported(vkPhysicalDevice, { extension })) {
+            logger::debug("Enabling optional device extension {}", extension);
+            devicesExtensions.push_back(extension);
+        }
+    }
+    enabledDeviceExtensions.insert(devicesExtensions.begin(), devicesExtensions.end());
+
+    // Shader execution reorder, without it the reorder calls would be no-ops anyway
+    VkPhysicalDeviceRayTracingInvocationReorderFeaturesNV invocationReorderFeatures {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_TRACING_INVOCATION_REORDER_FEATURES_NV,
+        .pNext = &enabledBufferDevicesAddressFeatures,
+        .rayTracingInvocationReorder = VK_TRUE,
+    };
+    if (deviceExtensionEnabled(VK_NV_RAY_TRACING_INVOCATION_REORDER_EXTENSION_NAME)) {
+        enabledAtomicsFeatures.pNext = &invocationReorderFeatures;
+    }
+
+    // Only asked for by extensions that record sync2 barriers, e.g. the render graph
+    VkPhysicalDeviceSynchronization2FeaturesKHR synchronization2Features {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SYNCHRONIZATION_2_FEATURES_KHR,
+        .pNext = enabledAtomicsFeatures.pNext,
+        .synchronization2 = VK_TRUE,
+    };
+    if (deviceExtensionEnabled(VK_KHR_SYNCHRONIZATION_2_EXTENSION_NAME)) {
+        enabledAtomicsFeatures.pNext = &synchronization2Features;
+    }
 
     VkDeviceCreateInfo createInfo {
         .sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
@@ -253,7 +347,7 @@ void AppContext::createLogicalDevice() {
         .pQueueCreateInfos = queueCreateInfos.data(),
         .enabledExtensionCount = static_cast<uint32_t>(devicesExtensions.size()),
         .ppEnabledExtensionNames = devicesExtensions.data(),
-        .pEnabledFeatures = &deviceFeatures,
+        .pEnabledFeatures = &enabledFeatures,
     };
 
 
@@ -261,7 +355,14 @@ void AppContext::createLogicalDevice() {
 
     vkGetDeviceQueue(vkDevice, queueFamilies.compute.value(), 0, &queues.compute);
     vkGetDeviceQueue(vkDevice, queueFamilies.graphics.value(), 0, &queues.graphics);
-    vkGetDeviceQueue(vkDevice, queueFamilies.present.value(), 0, &queues.present);
+    queues.present = VK_NULL_HANDLE;
+    if (queueFamilies.present.has_value()) {
+        vkGetDeviceQueue(vkDevice, queueFamilies.present.value(), 0, &queues.present);
+    }
+    queues.transfer = VK_NULL_HANDLE;
+    if (queueFamilies.transfer.has_value()) {
+        vkGetDeviceQueue(vkDevice, queueFamilies.transfer.value(), 0, &queues.transfer);
+    }
 }    
 
 void AppContext::cleanupWindowHelper() const {
@@ -290,6 +391,73 @@ void AppContext::createCommandPool() {
     vkCheck(vkCreateCommandPool(vkDevice, &createInfo, nullptr, &vkCommandPool));
 }
 
+void AppContext::createPipelineCache() {
+    std::vector<char> data;
+    if (!info.pipelineCachePath.empty() && std::filesystem::exists(info.pipelineCachePath)) {
+        data = readFile(info.pipelineCachePath);
+    }
+
+    // Drivers are supposed to reject foreign caches themselves, not all of them do
+    if (!data.empty()) {
+        VkPhysicalDeviceProperties properties;
+        vkGetPhysicalDeviceProperties(vkPhysicalDevice, &properties);
+
+        PipelineCacheHeader header{};
+        memcpy(&header, data.data(), std::min(data.size(), sizeof(header)));
+        const bool valid = data.size() >= sizeof(header)
+            && header.headerSize >= sizeof(header)
+            && header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE
+            && header.vendorID == properties.vendorID
+            && header.deviceID == properties.deviceID
+            && memcmp(header.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+
+        if (valid) {
+            logger::debug("Loaded pipeline cache {} ({} bytes)", info.pipelineCachePath, data.size());
+        } else {
+            logger::info("Pipeline cache {} belongs to another device or driver, rebuilding it", info.pipelineCachePath);
+            data.clear();
+        }
+    }
+
+    VkPipelineCacheCreateInfo createInfo {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+        .initialDataSize = data.size(),
+        .pInitialData = data.empty() ? nullptr : data.data(),
+    };
+    vkCheck(vkCreatePipelineCache(vkDevice, &createInfo, nullptr, &vkPipelineCache));
+}
+
+void AppContext::savePipelineCache() const {
+    if (info.pipelineCachePath.empty()) return;
+
+    size_t size = 0;
+    vkCheck(vkGetPipelineCacheData(vkDevice, vkPipelineCache, &size, nullptr));
+    std::vector<char> data(size);
+    vkCheck(vkGetPipelineCacheData(vkDevice, vkPipelineCache, &size, data.data()));
+
+    // Renamed into place so a crash never leaves a truncated cache behind
+    const std::string tmpPath = info.pipelineCachePath + ".tmp";
+    {
+        std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+        if (!file) {
+            logger::warn("Could not write pipeline cache {}", info.pipelineCachePath);
+            return;
+        }
+        file.write(data.data(), static_cast<std::streamsize>(size));
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmpPath, info.pipelineCachePath, ec);
+    if (ec) {
+        logger::warn("Could not write pipeline cache {}: {}", info.pipelineCachePath, ec.message());
+        return;
+    }
+    logger::debug("Saved pipeline cache {} ({} bytes)", info.pipelineCachePath, size);
+}
+
+void AppContext::createUploadManager() {
+    uploadManager = new UploadManager(*this);
+}
+
 void AppContext::createDescriptorPool() {
     VkDescriptorPoolSize pool_sizes[] =
             {
@@ -1,4 +1,5 @@
 #include "BufferTools.h"
+#include "UploadManager.h"
 
 namespace lv {
 
@@ -26,18 +27,21 @@ void create_buffer_D(AppContext& ctx, VkBufferUsageFlags usage, size_t size, Buf
 }
 
 void create_buffer_D_data(AppContext& ctx, VkBufferUsageFlags usage, size_t size, void* data, Buffer* dst) {
-    Buffer staging;
-    create_buffer_H_data(ctx, usage | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, size, data, &staging);
+    ctx.uploadManager->wait(create_buffer_D_data_async(ctx, usage, size, data, dst));
+}
 
-    create_buffer_D(ctx, usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT, size, dst);
+void create_buffer_D_fill(AppContext& ctx, VkBufferUsageFlags usage, size_t size, const std::function<void(void*)>& fill, Buffer* dst) {
+    ctx.uploadManager->wait(create_buffer_D_fill_async(ctx, usage, size, fill, dst));
+}
 
-    auto cmdBuffer = ctx.singleTimeCommandBuffer();
-    VkBufferCopy copyRegion{};
-    copyRegion.size = static_cast<VkDeviceSize>(size);
-    vkCmdCopyBuffer(cmdBuffer, staging.buffer, dst->buffer, 1, &copyRegion);
-    ctx.endSingleTimeCommands(cmdBuffer);
+UploadToken create_buffer_D_data_async(AppContext& ctx, VkBufferUsageFlags usage, size_t size, const void* data, Buffer* dst) {
+    create_buffer_D(ctx, usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT, size, dst);
+    return ctx.uploadManager->uploadBuffer(dst->buffer, 0, size, data);
+}
 
-    buffertools::destroyBuffer(ctx, staging);
+UploadToken create_buffer_D_fill_async(AppContext& ctx, VkBufferUsageFlags usage, size_t size, const std::function<void(void*)>& fill, Buffer* dst) {
+    create_buffer_D(ctx, usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT, size, dst);
+    return ctx.uploadManager->uploadBuffer(dst->buffer, 0, size, fill);
 }
 
 void create_buffer_H(AppContext& ctx, VkBufferUsageFlags usage, size_t size, Buffer* dst) {
@@ -59,5 +63,17 @@ void destroyBuffer(AppContext& ctx, Buffer& buffer) {
     vmaDestroyBuffer(ctx.vmaAllocator, buffer.buffer, buffer.memory);
 }
 
+VkBufferMemoryBarrier ownership_barrier(VkBuffer buffer, uint32_t srcFamily, uint32_t dstFamily, VkAccessFlags srcAccess, VkAccessFlags dstAccess) {
+    auto barrier = vks::initializers::bufferMemoryBarrier();
+    barrier.srcAccessMask = srcAccess;
+    barrier.dstAccessMask = dstAccess;
+    barrier.srcQueueFamilyIndex = srcFamily;
+    barrier.dstQueueFamilyIndex = dstFamily;
+    barrier.buffer = buffer;
+    barrier.offset = 0;
+    barrier.size = VK_WHOLE_SIZE;
+    return barrier;
+}
+
 }
 }
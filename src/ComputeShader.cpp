@@ -71,16 +71,19 @@ void ComputeShader::createPipeline() {
     auto module = ctx.createShaderModule(filePath);
     auto pipelineInfo = vks::initializers::computePipelineCreateInfo(pipelineLayout);
     pipelineInfo.stage = vks::initializers::pipelineShaderStageCreateInfo(module, VK_SHADER_STAGE_COMPUTE_BIT);
-    vkCheck(vkCreateComputePipelines(ctx.vkDevice, nullptr, 1, &pipelineInfo, nullptr, &pipeline));
+    vkCheck(vkCreateComputePipelines(ctx.vkDevice, ctx.vkPipelineCache, 1, &pipelineInfo, nullptr, &pipeline));
     vkDestroyShaderModule(ctx.vkDevice, module, nullptr);
 }
 
 void ComputeShader::embellishFrameContext(FrameContext& frame) {
-    auto& ret = frame.registerExtFrame<ComputeFrame>();
+    if (descriptorSets.size() <= frame.idx) {
+        descriptorSets.resize(frame.idx + 1, VK_NULL_HANDLE);
+    }
+    VkDescriptorSet& descriptorSet = descriptorSets[frame.idx];
 
     std::vector<VkDescriptorSetLayout> layouts { descriptorSetLayout };
     auto allocInfo = vks::initializers::descriptorSetAllocateInfo(ctx.vkDescriptorPool, layouts);
-    vkCheck(vkAllocateDescriptorSets(ctx.vkDevice, &allocInfo, &ret.descriptorSet));
+    vkCheck(vkAllocateDescriptorSets(ctx.vkDevice, &allocInfo, &descriptorSet));
 
     for(const auto& pair : info.bindingSet) {
         auto& binding = pair.second;
@@ -88,12 +91,12 @@ void ComputeShader::embellishFrameContext(FrameContext& frame) {
             // TODO: make sure that the imageInfos are sorted by binding
             VkImageView imageView = binding.viewSelector(frame);
             auto imageInfo = vks::initializers::descriptorImageInfo(nullptr, imageView, VK_IMAGE_LAYOUT_GENERAL);
-            auto writeInfo = vks::initializers::writeDescriptorSet(ret.descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, binding.binding, &imageInfo);
+            auto writeInfo = vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, binding.binding, &imageInfo);
             vkUpdateDescriptorSets(frame.ctx.vkDevice, 1, &writeInfo, 0, nullptr);
         } else {
             VkBuffer buffer = binding.bufferSelector(frame);
             auto bufferInfo = vks::initializers::descriptorBufferInfo(buffer);
-            auto writeInfo = vks::initializers::writeDescriptorSet(ret.descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, binding.binding, &bufferInfo);
+            auto writeInfo = vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, binding.binding, &bufferInfo);
             vkUpdateDescriptorSets(frame.ctx.vkDevice, 1, &writeInfo, 0, nullptr);
         }
     }
@@ -102,4 +105,15 @@ void ComputeShader::embellishFrameContext(FrameContext& frame) {
 void ComputeShader::cleanupFrameContext(FrameContext& frame) {
 }
 
+void ComputeShader::bind(FrameContext& frame) const {
+    VkDescriptorSet descriptorSet = getDescriptorSet(frame);
+    vkCmdBindPipeline(frame.cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+    vkCmdBindDescriptorSets(frame.cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipelineLayout, 0, 1, &descriptorSet, 0, nullptr);
+}
+
+void ComputeShader::dispatch(FrameContext& frame, uint32_t x, uint32_t y, uint32_t z) const {
+    bind(frame);
+    vkCmdDispatch(frame.cmdBuffer, x, y, z);
+}
+
 }
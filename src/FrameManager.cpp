@@ -2,7 +2,8 @@
 
 namespace lv {
 
-FrameManager::FrameManager(AppContext& ctx) : AppExt(ctx) {
+FrameManager::FrameManager(AppContext& ctx, uint32_t nrFramesInFlight) : AppExt(ctx), nrFramesInFlight(nrFramesInFlight) {
+    assert(nrFramesInFlight > 0 && "Need at least one frame in flight");
 }
 
 FrameManager::~FrameManager() {
@@ -12,14 +13,17 @@ FrameManager::~FrameManager() {
         }
     }
 
-    for(auto& fence : inFlightFences) {
-        vkDestroyFence(ctx.vkDevice, fence, nullptr);
-    }
+    vkDestroySemaphore(ctx.vkDevice, timeline, nullptr);
 }
 
 void FrameManager::init(const std::vector<AppExt*>& extensions) {
     assert(frameContexts.empty() && "Already initialized");
     this->extensions = extensions;
+    // A frame context is busy until its frame finished, more slots than contexts would never be used
+    if (nrFramesInFlight > nrFrames) {
+        logger::info("Frame Manager limiting {} frames in flight to its {} frames", nrFramesInFlight, nrFrames);
+        nrFramesInFlight = nrFrames;
+    }
     logger::debug("Frame Manager initializing with {} frames ({} in flight) and {} extensions", nrFrames, nrFramesInFlight, extensions.size());
 
     // Create the frame contexts
@@ -31,7 +35,7 @@ void FrameManager::init(const std::vector<AppExt*>& extensions) {
         auto allocInfo = vks::initializers::commandBufferAllocateInfo(ctx.vkCommandPool, VK_COMMAND_BUFFER_LEVEL_PRIMARY, 1);
         vkCheck(vkAllocateCommandBuffers(ctx.vkDevice, &allocInfo, &frame.cmdBuffer));
 
-        frame.frameFinished = VK_NULL_HANDLE;
+        frame.frameValue = 0;
 
         // Allow derivations to extend the context
         embellishFrameContext(frame);
@@ -49,45 +53,76 @@ void FrameManager::init(const std::vector<AppExt*>& extensions) {
     }
 
 
-    // Create the in flight fences
-    auto fenceInfo = vks::initializers::fenceCreateInfo(VK_FENCE_CREATE_SIGNALED_BIT);
-    inFlightFences.resize(nrFramesInFlight);
-    for(auto& fence : inFlightFences) {
-        vkCheck(vkCreateFence(ctx.vkDevice, &fenceInfo, nullptr, &fence));
-    }
+    // One timeline replaces the fences of every slot and context, its value is the last finished frame
+    VkSemaphoreTypeCreateInfo typeInfo {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+        .semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+        .initialValue = 0,
+    };
+    auto semInfo = vks::initializers::semaphoreCreateInfo();
+    semInfo.pNext = &typeInfo;
+    vkCheck(vkCreateSemaphore(ctx.vkDevice, &semInfo, nullptr, &timeline));
+}
+
+uint64_t FrameManager::getCompletedFrame() const {
+    uint64_t value;
+    vkCheck(vkGetSemaphoreCounterValue(ctx.vkDevice, timeline, &value));
+    return value;
+}
+
+void FrameManager::waitForFrame(uint64_t frameValue) const {
+    VkSemaphoreWaitInfo waitInfo {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+        .semaphoreCount = 1,
+        .pSemaphores = &timeline,
+        .pValues = &frameValue,
+    };
+    vkCheck(vkWaitSemaphores(ctx.vkDevice, &waitInfo, UINT64_MAX));
 }
 
 void FrameManager::submitFrame(FrameContext& frame) {
+    VkTimelineSemaphoreSubmitInfo timelineInfo {
+        .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+        .signalSemaphoreValueCount = 1,
+        .pSignalSemaphoreValues = &frame.frameValue,
+    };
     auto submitInfo = vks::initializers::submitInfo(&frame.cmdBuffer);
-    vkCheck(vkQueueSubmit(ctx.queues.graphics, 1, &submitInfo, frame.frameFinished));
+    submitInfo.pNext = &timelineInfo;
+    submitInfo.signalSemaphoreCount = 1;
+    submitInfo.pSignalSemaphores = &timeline;
+    std::lock_guard<std::mutex> lock(ctx.graphicsQueueMutex);
+    vkCheck(vkQueueSubmit(ctx.queues.graphics, 1, &submitInfo, VK_NULL_HANDLE));
 
 }
 
 void FrameManager::nextFrame(const std::function<void(FrameContext&)>& callback) {
-    // make sure the flight spot is free and reset
-    vkCheck(vkWaitForFences(ctx.vkDevice, 1, &inFlightFences[currentInFlight], VK_TRUE, UINT64_MAX));
+    const uint64_t value = submittedValue + 1;
+
+    // The frame that last used this flight slot has to be done, which also frees the slot's semaphores
+    if (value > nrFramesInFlight) {
+        waitForFrame(value - nrFramesInFlight);
+    }
 
     // progress to the next frame
     frameIdx = acquireNextFrameIdx();
     auto& frame = getCurrentFrame();
 
-    // Make sure that this frame is also finished
-    if (frame.frameFinished != VK_NULL_HANDLE) {
-        vkCheck(vkWaitForFences(ctx.vkDevice, 1, &frame.frameFinished, VK_TRUE, UINT64_MAX));
-    }
-    vkCheck(vkResetFences(ctx.vkDevice, 1, &inFlightFences[currentInFlight]));
-
-    // mark the frame in flight
-    frame.frameFinished = inFlightFences[currentInFlight];
+    // Swapchains can hand out a context again before the slots came around, a no-op otherwise
+    waitForFrame(frame.frameValue);
+    frame.frameValue = value;
 
     vkCheck(vkResetCommandBuffer(frame.cmdBuffer, 0));
     auto beginInfo = vks::initializers::commandBufferBeginInfo();
     beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
     vkCheck(vkBeginCommandBuffer(frame.cmdBuffer, &beginInfo));
+    for(auto& ext : extensions) {
+        ext->beginFrame(frame);
+    }
     callback(frame);
     vkEndCommandBuffer(frame.cmdBuffer);
 
     submitFrame(frame);
+    submittedValue = value;
     currentInFlight = (currentInFlight + 1) % nrFramesInFlight;
 }
 
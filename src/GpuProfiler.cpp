@@ -0,0 +1,150 @@
+#include "GpuProfiler.h"
+
+namespace lv {
+
+GpuProfiler::GpuProfiler(AppContext& ctx, GpuProfilerInfo info)
+    : AppExt(ctx), info(info) {
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(ctx.vkPhysicalDevice, &properties);
+
+    uint32_t queueFamilyCount;
+    vkGetPhysicalDeviceQueueFamilyProperties(ctx.vkPhysicalDevice, &queueFamilyCount, nullptr);
+    std::vector<VkQueueFamilyProperties> families(queueFamilyCount);
+    vkGetPhysicalDeviceQueueFamilyProperties(ctx.vkPhysicalDevice, &queueFamilyCount, families.data());
+    const uint32_t validBits = families[ctx.queueFamilies.graphics.value()].timestampValidBits;
+
+    // Scopes turn into no-ops, callers do not have to care
+    supported = validBits > 0 && properties.limits.timestampPeriod > 0.0f;
+    if (!supported) {
+        logger::warn("GPU timestamps are not supported on the graphics queue, profiling disabled");
+        return;
+    }
+
+    timestampPeriod = properties.limits.timestampPeriod;
+    timestampMask = validBits >= 64 ? ~0ull : (1ull << validBits) - 1;
+}
+
+void GpuProfiler::embellishFrameContext(FrameContext& frame) {
+    auto& pFrame = frame.registerExtFrame<GpuProfilerFrame>();
+    if (!supported) return;
+
+    VkQueryPoolCreateInfo createInfo {
+        .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+        .queryType = VK_QUERY_TYPE_TIMESTAMP,
+        .queryCount = info.maxScopes * 2,
+    };
+    vkCheck(vkCreateQueryPool(ctx.vkDevice, &createInfo, nullptr, &pFrame.queryPool));
+}
+
+void GpuProfiler::cleanupFrameContext(FrameContext& frame) {
+    auto& pFrame = frame.getExtFrame<GpuProfilerFrame>();
+    if (pFrame.queryPool != VK_NULL_HANDLE) {
+        vkDestroyQueryPool(ctx.vkDevice, pFrame.queryPool, nullptr);
+    }
+}
+
+void GpuProfiler::beginFrame(FrameContext& frame) {
+    auto& pFrame = frame.getExtFrame<GpuProfilerFrame>();
+    if (!supported) return;
+
+    // The frame manager waited for this frame's last use on the timeline, so its queries are done
+    if (pFrame.nrQueries > 0) {
+        resolve(pFrame);
+    }
+
+    vkCmdResetQueryPool(frame.cmdBuffer, pFrame.queryPool, 0, info.maxScopes * 2);
+    pFrame.scopes.clear();
+    pFrame.nrQueries = 0;
+    pFrame.depth = 0;
+}
+
+void GpuProfiler::resolve(GpuProfilerFrame& pFrame) {
+    std::vector<uint64_t> results(pFrame.nrQueries);
+    // No wait flag, an unfinished frame is skipped instead of stalling
+    const VkResult result = vkGetQueryPoolResults(ctx.vkDevice, pFrame.queryPool, 0, pFrame.nrQueries,
+        results.size() * sizeof(uint64_t), results.data(), sizeof(uint64_t), VK_QUERY_RESULT_64_BIT);
+    if (result == VK_NOT_READY) return;
+    vkCheck(result);
+
+    timings.clear();
+    for(const auto& scope : pFrame.scopes) {
+        const uint64_t begin = results[scope.query] & timestampMask;
+        const uint64_t end = results[scope.query + 1] & timestampMask;
+        timings.push_back(GpuTiming {
+            .name = scope.name,
+            .depth = scope.depth,
+            .start = static_cast<uint64_t>(begin * static_cast<double>(timestampPeriod)),
+            .end = static_cast<uint64_t>(std::max(begin, end) * static_cast<double>(timestampPeriod)),
+        });
+    }
+
+    history.push_back(timings);
+    while (history.size() > info.historySize) {
+        history.pop_front();
+    }
+}
+
+GpuProfiler::Scope::Scope(GpuProfiler& profiler, FrameContext& frame, const char* name)
+    : profiler(profiler), frame(frame), scopeIdx(-1) {
+    auto& pFrame = frame.getExtFrame<GpuProfilerFrame>();
+    const uint32_t depth = pFrame.depth++;
+    if (!profiler.supported || pFrame.nrQueries + 2 > profiler.info.maxScopes * 2) return;
+
+    scopeIdx = static_cast<int32_t>(pFrame.scopes.size());
+    pFrame.scopes.push_back({ name, depth, pFrame.nrQueries });
+    vkCmdWriteTimestamp(frame.cmdBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, pFrame.queryPool, pFrame.nrQueries);
+    pFrame.nrQueries += 2;
+}
+
+GpuProfiler::Scope::~Scope() {
+    auto& pFrame = frame.getExtFrame<GpuProfilerFrame>();
+    pFrame.depth--;
+    if (scopeIdx < 0) return;
+
+    const uint32_t query = pFrame.scopes[scopeIdx].query + 1;
+    vkCmdWriteTimestamp(frame.cmdBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, pFrame.queryPool, query);
+}
+
+bool GpuProfiler::exportChromeTrace(const std::string& filename) const {
+    std::ofstream file(filename, std::ios::trunc);
+    if (!file) {
+        logger::error("Could not write GPU trace {}", filename);
+        return false;
+    }
+
+    uint64_t origin = std::numeric_limits<uint64_t>::max();
+    for(const auto& frameTimings : history) {
+        for(const auto& timing : frameTimings) {
+            origin = std::min(origin, timing.start);
+        }
+    }
+
+    auto escape = [](const std::string& name) {
+        std::string ret;
+        for(char c : name) {
+            if (c == '"' || c == '\\') ret.push_back('\\');
+            ret.push_back(c);
+        }
+        return ret;
+    };
+
+    // Complete events on one track, the viewer nests them by time
+    file << "{\"traceEvents\":[";
+    bool first = true;
+    for(const auto& frameTimings : history) {
+        for(const auto& timing : frameTimings) {
+            if (!first) file << ",";
+            first = false;
+            file << "{\"name\":\"" << escape(timing.name) << "\",\"cat\":\"gpu\",\"ph\":\"X\""
+                 << ",\"ts\":" << static_cast<double>(timing.start - origin) * 1e-3
+                 << ",\"dur\":" << static_cast<double>(timing.end - timing.start) * 1e-3
+                 << ",\"pid\":0,\"tid\":0}";
+        }
+    }
+    file << "],\"displayTimeUnit\":\"ms\"}";
+
+    logger::info("Wrote GPU trace of {} frames to {}", history.size(), filename);
+    return true;
+}
+
+}
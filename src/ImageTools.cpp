@@ -1,10 +1,11 @@
 #include "ImageTools.h"
 #include "BufferTools.h"
+#include "UploadManager.h"
 
 namespace lv {
 
 namespace imagetools {
-    void create_image_D(AppContext& ctx, uint32_t width, uint32_t height, VkImageUsageFlags usage, VkFormat format, VkImageLayout initialLayout, Image* dst) {
+    static void create_image_handle(AppContext& ctx, uint32_t width, uint32_t height, VkImageUsageFlags usage, VkFormat format, Image* dst) {
         dst->format = format;
         auto imageCreateInfo = vks::initializers::imageCreateInfo(width, height, format, usage);
         VmaAllocationCreateInfo allocInfo { .usage = VMA_MEMORY_USAGE_GPU_ONLY };
@@ -12,6 +13,10 @@ namespace imagetools {
 
         auto viewInfo = vks::initializers::imageViewCreateInfo(dst->image, format, VK_IMAGE_ASPECT_COLOR_BIT);
         vkCheck(vkCreateImageView(ctx.vkDevice, &viewInfo, nullptr, &dst->view));
+    }
+
+    void create_image_D(AppContext& ctx, uint32_t width, uint32_t height, VkImageUsageFlags usage, VkFormat format, VkImageLayout initialLayout, Image* dst) {
+        create_image_handle(ctx, width, height, usage, format, dst);
 
         auto cmdBuffer = ctx.singleTimeCommandBuffer();
         auto barrier = vks::initializers::imageMemoryBarrier(dst->image, VK_IMAGE_LAYOUT_UNDEFINED, initialLayout);
@@ -27,6 +32,10 @@ namespace imagetools {
     }
 
     void load_image_D(AppContext& ctx, VkImageLayout initialLayout, const char* filename, Image* dst) {
+        ctx.uploadManager->wait(load_image_D_async(ctx, initialLayout, filename, dst));
+    }
+
+    UploadToken load_image_D_async(AppContext& ctx, VkImageLayout initialLayout, const char* filename, Image* dst) {
         int width, height, nrChannels;
         stbi_uc* pixels = stbi_load(filename, &width, &height, &nrChannels, STBI_rgb_alpha);
         if (!pixels) {
@@ -34,44 +43,29 @@ namespace imagetools {
             exit(1);
         }
 
-        assert(nrChannels == 4 && "Image loading should produce a 4 channel buffer");
-
-
         // We are loading as 4 bytes per pixel
         VkDeviceSize imageSize = width * height * 4;
-        Buffer stagingBuffer;
-        buffertools::create_buffer_H(ctx, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, imageSize, &stagingBuffer);
-
-        void* data;
-        vkCheck(vmaMapMemory(ctx.vmaAllocator, stagingBuffer.memory, &data));
-        memcpy(data, pixels, static_cast<size_t>(imageSize));
-        vmaUnmapMemory(ctx.vmaAllocator, stagingBuffer.memory);
-        vmaFlushAllocation(ctx.vmaAllocator, stagingBuffer.memory, 0, imageSize);
-
-        create_image_D(ctx, width, height, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, dst);
-
-        auto cmdBuffer = ctx.singleTimeCommandBuffer();
-        VkBufferImageCopy copyRegion = vks::initializers::imageCopy(width, height);
-        vkCmdCopyBufferToImage(cmdBuffer, stagingBuffer.buffer, dst->image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copyRegion);
+        create_image_handle(ctx, width, height, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_FORMAT_R8G8B8A8_SRGB, dst);
 
-        auto barrier = vks::initializers::imageMemoryBarrier(dst->image, VK_IMAGE_LAYOUT_UNDEFINED, initialLayout);
-    vkCmdPipelineBarrier(
-            cmdBuffer,
-            VK_PIPELINE_STAGE_TRANSFER_BIT,
-            VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
-            VK_DEPENDENCY_BY_REGION_BIT,
-            0, nullptr,
-            0, nullptr,
-            1, &barrier);
-        ctx.endSingleTimeCommands(cmdBuffer);
-
-        buffertools::destroyBuffer(ctx, stagingBuffer);
+        // The pixels are in staging memory once this returns
+        auto token = ctx.uploadManager->uploadImage(dst->image, width, height, imageSize, pixels, initialLayout);
+        stbi_image_free(pixels);
+        return token;
     }
 
     void destroyImage(AppContext& ctx, Image& image) {
         vkDestroyImageView(ctx.vkDevice, image.view, nullptr);
         vmaDestroyImage(ctx.vmaAllocator, image.image, image.allocation);
     }
+
+    VkImageMemoryBarrier ownership_barrier(VkImage image, uint32_t srcFamily, uint32_t dstFamily, VkImageLayout oldLayout, VkImageLayout newLayout, VkAccessFlags srcAccess, VkAccessFlags dstAccess) {
+        auto barrier = vks::initializers::imageMemoryBarrier(image, oldLayout, newLayout);
+        barrier.srcAccessMask = srcAccess;
+        barrier.dstAccessMask = dstAccess;
+        barrier.srcQueueFamilyIndex = srcFamily;
+        barrier.dstQueueFamilyIndex = dstFamily;
+        return barrier;
+    }
 }
 
 
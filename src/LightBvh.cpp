@@ -0,0 +1,273 @@
+#include "LightBvh.h"
+
+namespace lv {
+
+static const uint32_t nrBins = 12;
+// Nodes with fewer lights are binned and built on a single thread
+static const size_t parallelThreshold = 8 * 1024;
+// Deeper splits fall back to the median, which keeps the traversal in the shader bounded
+static const uint32_t maxHeuristicDepth = 48;
+
+static LightBvhNode make_leaf(const LightPrimitive& light, uint32_t lightIdx) {
+    const glm::vec3 normal = glm::cross(light.v1 - light.v0, light.v2 - light.v0);
+    const float length = glm::length(normal);
+
+    LightBvhNode ret{};
+    ret.boundsMin = glm::min(light.v0, glm::min(light.v1, light.v2));
+    ret.boundsMax = glm::max(light.v0, glm::max(light.v1, light.v2));
+    ret.power = light.power;
+    ret.axis = length > 0.0f ? normal / length : glm::vec3(0, 0, 1);
+    ret.thetaO = 0.0f;
+    // Triangles only emit to the front
+    ret.thetaE = glm::half_pi<float>();
+    ret.index = lightIdx;
+    ret.isLeaf = 1;
+    return ret;
+}
+
+// Smallest cone containing both, from Conty and Kulla's many light BVH
+static void merge_cone(glm::vec3 axisA, float thetaOA, glm::vec3 axisB, float thetaOB, glm::vec3& axis, float& thetaO) {
+    if (thetaOA < thetaOB) {
+        std::swap(axisA, axisB);
+        std::swap(thetaOA, thetaOB);
+    }
+
+    const float thetaD = std::acos(std::clamp(glm::dot(axisA, axisB), -1.0f, 1.0f));
+    if (std::min(thetaD + thetaOB, glm::pi<float>()) <= thetaOA) {
+        axis = axisA;
+        thetaO = thetaOA;
+        return;
+    }
+
+    const float merged = 0.5f * (thetaOA + thetaD + thetaOB);
+    const glm::vec3 rotationAxis = glm::cross(axisA, axisB);
+    if (merged >= glm::pi<float>() || glm::length(rotationAxis) < 1e-6f) {
+        axis = axisA;
+        thetaO = glm::pi<float>();
+        return;
+    }
+
+    axis = glm::normalize(glm::angleAxis(merged - thetaOA, glm::normalize(rotationAxis)) * axisA);
+    thetaO = merged;
+}
+
+static LightBvhNode merge(const LightBvhNode& a, const LightBvhNode& b) {
+    LightBvhNode ret{};
+    ret.boundsMin = glm::min(a.boundsMin, b.boundsMin);
+    ret.boundsMax = glm::max(a.boundsMax, b.boundsMax);
+    ret.power = a.power + b.power;
+    ret.thetaE = std::max(a.thetaE, b.thetaE);
+    merge_cone(a.axis, a.thetaO, b.axis, b.thetaO, ret.axis, ret.thetaO);
+    ret.isLeaf = 0;
+    return ret;
+}
+
+static float surface_area(const LightBvhNode& node) {
+    const glm::vec3 d = glm::max(node.boundsMax - node.boundsMin, glm::vec3(0.0f));
+    return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+static float orientation_measure(float thetaO, float thetaE) {
+    const float thetaW = std::min(thetaO + thetaE, glm::pi<float>());
+    const float sinO = std::sin(thetaO);
+    const float cosO = std::cos(thetaO);
+    return glm::two_pi<float>() * (1.0f - cosO)
+        + glm::half_pi<float>() * (2.0f * thetaW * sinO - std::cos(thetaO - 2.0f * thetaW) - 2.0f * thetaO * sinO + cosO);
+}
+
+static glm::vec3 centroid(const LightBvhNode& node) { return 0.5f * (node.boundsMin + node.boundsMax); }
+
+namespace {
+    struct Bin {
+        LightBvhNode bounds;
+        uint32_t count = 0;
+
+        inline void add(const LightBvhNode& node) {
+            bounds = count == 0 ? node : merge(bounds, node);
+            count++;
+        }
+        inline void add(const Bin& other) {
+            if (other.count == 0) return;
+            bounds = count == 0 ? other.bounds : merge(bounds, other.bounds);
+            count += other.count;
+        }
+        inline float cost() const {
+            // The small count term keeps splits meaningful among lights without power
+            return count == 0 ? 0.0f : (bounds.power + 1e-6f * count) * surface_area(bounds) * orientation_measure(bounds.thetaO, bounds.thetaE);
+        }
+    };
+}
+
+void LightBvh::build(std::span<const LightPrimitive> lights, ThreadPool& pool) {
+    nrLights = lights.size();
+    nodes.assign(nrLights > 0 ? 2 * nrLights - 1 : 0, LightBvhNode{});
+    depths.assign(nodes.size(), 0);
+    levels.clear();
+    if (nrLights == 0) return;
+
+    leaves.resize(nrLights);
+    pool.parallelFor(nrLights, 4096, [&](size_t begin, size_t end) {
+        for(size_t i=begin; i<end; i++) leaves[i] = make_leaf(lights[i], static_cast<uint32_t>(i));
+    });
+
+    std::vector<uint32_t> lightIndices(nrLights);
+    std::iota(lightIndices.begin(), lightIndices.end(), 0);
+    buildNode(0, 0, lightIndices, pool);
+
+    const uint32_t maxDepth = *std::max_element(depths.begin(), depths.end());
+    levels.resize(maxDepth + 1);
+    for(uint32_t i=0; i<nodes.size(); i++) {
+        levels[depths[i]].push_back(i);
+    }
+
+    leaves.clear();
+    leaves.shrink_to_fit();
+}
+
+void LightBvh::buildNode(uint32_t nodeIdx, uint32_t depth, std::span<uint32_t> lightIndices, ThreadPool& pool) {
+    depths[nodeIdx] = depth;
+    const size_t count = lightIndices.size();
+    if (count == 1) {
+        nodes[nodeIdx] = leaves[lightIndices[0]];
+        return;
+    }
+
+    const bool parallel = count >= parallelThreshold;
+    std::mutex mutex;
+    auto forEachChunk = [&](const std::function<void(size_t, size_t)>& fn) {
+        if (parallel) pool.parallelFor(count, 4096, fn);
+        else fn(0, count);
+    };
+
+    glm::vec3 centroidMin(std::numeric_limits<float>::max());
+    glm::vec3 centroidMax(std::numeric_limits<float>::lowest());
+    Bin total;
+    forEachChunk([&](size_t begin, size_t end) {
+        glm::vec3 localMin(std::numeric_limits<float>::max());
+        glm::vec3 localMax(std::numeric_limits<float>::lowest());
+        Bin localTotal;
+        for(size_t i=begin; i<end; i++) {
+            const auto& leaf = leaves[lightIndices[i]];
+            localMin = glm::min(localMin, centroid(leaf));
+            localMax = glm::max(localMax, centroid(leaf));
+            localTotal.add(leaf);
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        centroidMin = glm::min(centroidMin, localMin);
+        centroidMax = glm::max(centroidMax, localMax);
+        total.add(localTotal);
+    });
+
+    const glm::vec3 extent = centroidMax - centroidMin;
+    const glm::vec3 boundsExtent = total.bounds.boundsMax - total.bounds.boundsMin;
+    const float maxBoundsExtent = std::max(boundsExtent.x, std::max(boundsExtent.y, boundsExtent.z));
+
+    auto binOf = [&](const LightBvhNode& leaf, int axis) {
+        const float t = (centroid(leaf)[axis] - centroidMin[axis]) / extent[axis];
+        return std::min(static_cast<uint32_t>(t * nrBins), nrBins - 1);
+    };
+
+    int bestAxis = -1;
+    uint32_t bestSplit = 0;
+    if (depth < maxHeuristicDepth) {
+        std::array<std::array<Bin, nrBins>, 3> bins{};
+        forEachChunk([&](size_t begin, size_t end) {
+            std::array<std::array<Bin, nrBins>, 3> localBins{};
+            for(size_t i=begin; i<end; i++) {
+                const auto& leaf = leaves[lightIndices[i]];
+                for(int axis=0; axis<3; axis++) {
+                    if (extent[axis] > 0.0f) localBins[axis][binOf(leaf, axis)].add(leaf);
+                }
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            for(int axis=0; axis<3; axis++) {
+                for(uint32_t b=0; b<nrBins; b++) bins[axis][b].add(localBins[axis][b]);
+            }
+        });
+
+        float bestCost = std::numeric_limits<float>::max();
+        for(int axis=0; axis<3; axis++) {
+            if (extent[axis] <= 0.0f) continue;
+            // Thin axes are penalized so cones do not get split into slivers
+            const float regularization = maxBoundsExtent / std::max(boundsExtent[axis], 1e-6f);
+
+            std::array<float, nrBins> rightCosts{};
+            Bin right;
+            for(uint32_t b=nrBins-1; b>0; b--) {
+                right.add(bins[axis][b]);
+                rightCosts[b] = right.cost();
+            }
+
+            Bin left;
+            for(uint32_t split=0; split<nrBins-1; split++) {
+                left.add(bins[axis][split]);
+                if (left.count == 0 || left.count == count) continue;
+                const float cost = regularization * (left.cost() + rightCosts[split + 1]);
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestSplit = split;
+                }
+            }
+        }
+    }
+
+    size_t leftCount = 0;
+    if (bestAxis >= 0) {
+        auto middle = std::partition(lightIndices.begin(), lightIndices.end(), [&](uint32_t lightIdx) {
+            return binOf(leaves[lightIdx], bestAxis) <= bestSplit;
+        });
+        leftCount = static_cast<size_t>(middle - lightIndices.begin());
+    }
+
+    if (leftCount == 0 || leftCount == count) {
+        const int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+        leftCount = count / 2;
+        std::nth_element(lightIndices.begin(), lightIndices.begin() + leftCount, lightIndices.end(), [&](uint32_t a, uint32_t b) {
+            return centroid(leaves[a])[axis] < centroid(leaves[b])[axis];
+        });
+    }
+
+    // Subtrees are laid out depth first, a subtree over n lights takes 2n - 1 nodes
+    const uint32_t leftIdx = nodeIdx + 1;
+    const uint32_t rightIdx = nodeIdx + 2 * static_cast<uint32_t>(leftCount);
+    auto leftLights = lightIndices.subspan(0, leftCount);
+    auto rightLights = lightIndices.subspan(leftCount);
+
+    if (parallel) {
+        pool.parallelFor(2, 1, [&](size_t begin, size_t end) {
+            for(size_t child=begin; child<end; child++) {
+                if (child == 0) buildNode(leftIdx, depth + 1, leftLights, pool);
+                else buildNode(rightIdx, depth + 1, rightLights, pool);
+            }
+        });
+    } else {
+        buildNode(leftIdx, depth + 1, leftLights, pool);
+        buildNode(rightIdx, depth + 1, rightLights, pool);
+    }
+
+    nodes[nodeIdx] = merge(nodes[leftIdx], nodes[rightIdx]);
+    nodes[nodeIdx].index = rightIdx;
+}
+
+void LightBvh::refit(std::span<const LightPrimitive> lights, ThreadPool& pool) {
+    assert(lights.size() == nrLights && "Refits need the lights the hierarchy was built over");
+
+    for(auto level = levels.rbegin(); level != levels.rend(); level++) {
+        pool.parallelFor(level->size(), 1024, [&](size_t begin, size_t end) {
+            for(size_t i=begin; i<end; i++) {
+                const uint32_t nodeIdx = (*level)[i];
+                auto& node = nodes[nodeIdx];
+                if (node.isLeaf) {
+                    node = make_leaf(lights[node.index], node.index);
+                } else {
+                    const uint32_t rightIdx = node.index;
+                    node = merge(nodes[nodeIdx + 1], nodes[rightIdx]);
+                    node.index = rightIdx;
+                }
+            }
+        });
+    }
+}
+
+}
@@ -1,45 +1,409 @@
 #include "Mesh.h"
+#include "ObjParser.h"
+#include "ThreadPool.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 namespace lv {
 
+static constexpr uint64_t cacheAlignment = 16;
+
+static uint64_t alignOffset(uint64_t offset) {
+    return (offset + cacheAlignment - 1) & ~(cacheAlignment - 1);
+}
+
+// Whether count elements of elementSize starting at offset lie within the cache, without overflowing
+static bool cacheArrayFits(uint64_t offset, uint64_t count, uint64_t elementSize, uint64_t size) {
+    return offset % cacheAlignment == 0 && offset <= size && count <= (size - offset) / elementSize;
+}
+
+// FNV-1a over the size and modification time of the OBJ, cheap enough to check on every launch
+static uint64_t hashSource(const char* filename) {
+    std::error_code ec;
+    const uint64_t size = std::filesystem::file_size(filename, ec);
+    if (ec) return 0;
+    const uint64_t mtime = std::filesystem::last_write_time(filename, ec).time_since_epoch().count();
+    if (ec) return 0;
+
+    uint64_t hash = 0xcbf29ce484222325ull;
+    auto mix = [&hash](uint64_t value) {
+        for(int i=0; i<8; i++) {
+            hash ^= (value >> (i * 8)) & 0xff;
+            hash *= 0x100000001b3ull;
+        }
+    };
+    mix(size);
+    mix(mtime);
+    mix(MeshCacheHeader::VERSION);
+    return hash;
+}
+
+VkFormat MeshPacking::getVkFormat() const {
+    switch(vertexFormat) {
+        case VertexFormat::Float32x4: return VK_FORMAT_R32G32B32A32_SFLOAT;
+        case VertexFormat::Float32x3: return VK_FORMAT_R32G32B32_SFLOAT;
+        case VertexFormat::Snorm16x4: return VK_FORMAT_R16G16B16A16_SNORM;
+    }
+    return VK_FORMAT_R32G32B32A32_SFLOAT;
+}
+
+uint32_t MeshPacking::getVertexStride() const {
+    switch(vertexFormat) {
+        case VertexFormat::Float32x4: return sizeof(Vertex);
+        case VertexFormat::Float32x3: return sizeof(glm::vec3);
+        case VertexFormat::Snorm16x4: return 4 * sizeof(int16_t);
+    }
+    return sizeof(Vertex);
+}
+
+std::array<float, 12> MeshPacking::getDequantization() const {
+    if (vertexFormat != VertexFormat::Snorm16x4) {
+        return { 1, 0, 0, 0,  0, 1, 0, 0,  0, 0, 1, 0 };
+    }
+    return {
+        halfExtent.x, 0, 0, center.x,
+        0, halfExtent.y, 0, center.y,
+        0, 0, halfExtent.z, center.z,
+    };
+}
+
+MeshPacking Mesh::choosePacking(float maxError, bool allowSnorm16) const {
+    MeshPacking ret { .vertexFormat = VertexFormat::Float32x3 };
+    // Indices are local to the mesh
+    if (vertices.size() <= std::numeric_limits<uint16_t>::max() + 1ull) {
+        ret.indexType = VK_INDEX_TYPE_UINT16;
+    }
+    if (!allowSnorm16 || vertices.empty()) return ret;
+
+    glm::vec3 boundsMin, boundsMax;
+    computeBounds(boundsMin, boundsMax);
+
+    // Flat axes still need a non zero scale to dequantize with
+    const glm::vec3 halfExtent = glm::max(0.5f * (boundsMax - boundsMin), glm::vec3(1e-6f));
+    // Rounding to the nearest of 65535 steps over [-1, 1] is off by half a step at most
+    const float worstError = std::max(halfExtent.x, std::max(halfExtent.y, halfExtent.z)) / 32767.0f * 0.5f;
+    if (worstError <= maxError) {
+        ret.vertexFormat = VertexFormat::Snorm16x4;
+        ret.center = 0.5f * (boundsMin + boundsMax);
+        ret.halfExtent = halfExtent;
+    }
+    return ret;
+}
+
+void Mesh::computeBounds(glm::vec3& boundsMin, glm::vec3& boundsMax) const {
+    std::mutex mutex;
+    boundsMin = glm::vec3(std::numeric_limits<float>::max());
+    boundsMax = glm::vec3(std::numeric_limits<float>::lowest());
+    ThreadPool::shared().parallelFor(vertices.size(), 1 << 16, [&](size_t begin, size_t end) {
+        glm::vec3 localMin(std::numeric_limits<float>::max());
+        glm::vec3 localMax(std::numeric_limits<float>::lowest());
+        for(size_t v=begin; v<end; v++) {
+            localMin = glm::min(localMin, glm::vec3(vertices[v].v));
+            localMax = glm::max(localMax, glm::vec3(vertices[v].v));
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        boundsMin = glm::min(boundsMin, localMin);
+        boundsMax = glm::max(boundsMax, localMax);
+    });
+}
+
+void Mesh::packVertices(const MeshPacking& packing, void* dst) const {
+    ThreadPool::shared().parallelFor(vertices.size(), 1 << 16, [&](size_t begin, size_t end) {
+        switch(packing.vertexFormat) {
+            case VertexFormat::Float32x4:
+                std::copy(vertices.begin() + begin, vertices.begin() + end, reinterpret_cast<Vertex*>(dst) + begin);
+                break;
+            case VertexFormat::Float32x3: {
+                auto* out = reinterpret_cast<glm::vec3*>(dst);
+                for(size_t v=begin; v<end; v++) out[v] = glm::vec3(vertices[v].v);
+                break;
+            }
+            case VertexFormat::Snorm16x4: {
+                auto* out = reinterpret_cast<int16_t*>(dst);
+                for(size_t v=begin; v<end; v++) {
+                    const glm::vec3 p = glm::clamp((glm::vec3(vertices[v].v) - packing.center) / packing.halfExtent, -1.0f, 1.0f);
+                    for(int c=0; c<3; c++) out[4*v + c] = static_cast<int16_t>(std::lround(p[c] * 32767.0f));
+                    out[4*v + 3] = 0;
+                }
+                break;
+            }
+        }
+    });
+}
+
+void Mesh::packIndices(const MeshPacking& packing, void* dst) const {
+    if (packing.indexType == VK_INDEX_TYPE_UINT32) {
+        std::copy(indices.begin(), indices.end(), reinterpret_cast<uint32_t*>(dst));
+        return;
+    }
+    auto* out = reinterpret_cast<uint16_t*>(dst);
+    ThreadPool::shared().parallelFor(indices.size(), 1 << 16, [&](size_t begin, size_t end) {
+        for(size_t i=begin; i<end; i++) out[i] = static_cast<uint16_t>(indices[i]);
+    });
+}
+
+Mesh::~Mesh() {
+    reset();
+}
+
+std::string Mesh::getCachePath(const char* filename) {
+    return std::string(filename) + ".lvmesh";
+}
+
 void Mesh::load(const char* filename) {
-    tinyobj::ObjReader reader;
-    reader.ParseFromFile(filename);
-    auto& attrib = reader.GetAttrib();
-    auto& shape = reader.GetShapes()[0];
-    for(size_t v=0; v<attrib.GetVertices().size(); v+=3) {
-        vertices.push_back(lv::Vertex { glm::vec4(attrib.vertices[v+0], attrib.vertices[v+1], attrib.vertices[v+2], 0) });
+    reset();
+    const std::string cachePath = getCachePath(filename);
+    const uint64_t sourceHash = hashSource(filename);
+
+    if (sourceHash != 0 && mapCache(cachePath, sourceHash)) {
+        logger::debug("Mapped mesh cache {}", cachePath);
+        return;
     }
 
-    for(const auto& idx : shape.mesh.indices) {
-        indices.push_back(idx.vertex_index);
+    // A failed parse leaves the mesh empty, caching that would hide the error until the OBJ changes
+    if (parseObj(filename) && sourceHash != 0) {
+        writeCache(cachePath, sourceHash);
+    }
+}
+
+MeshBakeResult Mesh::bake(const char* filename, bool force) {
+    const std::string cachePath = getCachePath(filename);
+    const uint64_t sourceHash = hashSource(filename);
+    if (sourceHash == 0) {
+        logger::error("Could not read {}", filename);
+        return MeshBakeResult::Failed;
+    }
+
+    Mesh mesh;
+    if (!force && mesh.mapCache(cachePath, sourceHash)) {
+        return MeshBakeResult::UpToDate;
+    }
+
+    if (!mesh.parseObj(filename) || !mesh.writeCache(cachePath, sourceHash)) {
+        return MeshBakeResult::Failed;
+    }
+    return MeshBakeResult::Baked;
+}
+
+bool Mesh::mapCache(const std::string& cachePath, uint64_t sourceHash) {
+    const int fd = open(cachePath.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(MeshCacheHeader)) {
+        close(fd);
+        return false;
+    }
+
+    const size_t size = static_cast<size_t>(st.st_size);
+    void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping keeps the file alive
+    close(fd);
+    if (data == MAP_FAILED) return false;
+
+    const auto* header = reinterpret_cast<const MeshCacheHeader*>(data);
+    const bool valid = header->magic == MeshCacheHeader::MAGIC
+        && header->version == MeshCacheHeader::VERSION
+        && header->sourceHash == sourceHash
+        && cacheArrayFits(header->vertexOffset, header->vertexCount, sizeof(Vertex), size)
+        && cacheArrayFits(header->indexOffset, header->indexCount, sizeof(uint32_t), size)
+        && cacheArrayFits(header->normalOffset, header->normalCount, sizeof(glm::vec3), size)
+        && cacheArrayFits(header->materialIdOffset, header->materialIdCount, sizeof(uint32_t), size)
+        && cacheArrayFits(header->namesOffset, header->namesSize, 1, size)
+        && header->indexCount % 3 == 0
+        && header->normalCount == header->indexCount
+        && header->materialIdCount == header->indexCount / 3
+        // Every material takes at least its length, every shape its range and name length
+        && header->materialCount <= header->namesSize / sizeof(uint32_t)
+        && header->shapeCount <= header->namesSize / (3 * sizeof(uint32_t));
+
+    // A corrupt cache is treated like a stale one, it gets reparsed and rewritten
+    auto stale = [&]() {
+        logger::debug("Mesh cache {} is stale", cachePath);
+        munmap(data, size);
+        return false;
+    };
+    if (!valid) return stale();
+
+    // Names are tiny compared to the geometry, those are copied out. Reading stops at the first
+    // value that runs past the end.
+    const auto* bytes = reinterpret_cast<const uchar*>(data);
+    const uchar* names = bytes + header->namesOffset;
+    const uchar* namesEnd = names + header->namesSize;
+    auto readU32 = [&](uint32_t& value) {
+        if (static_cast<size_t>(namesEnd - names) < sizeof(uint32_t)) return false;
+        memcpy(&value, names, sizeof(uint32_t));
+        names += sizeof(uint32_t);
+        return true;
+    };
+    auto readName = [&](std::string& name) {
+        uint32_t length;
+        if (!readU32(length) || static_cast<size_t>(namesEnd - names) < length) return false;
+        name.assign(reinterpret_cast<const char*>(names), length);
+        names += length;
+        return true;
+    };
+    std::vector<std::string> cachedMaterials;
+    std::vector<MeshShape> cachedShapes;
+    bool namesValid = true;
+    for(uint32_t i=0; namesValid && i<header->materialCount; i++) {
+        namesValid = readName(cachedMaterials.emplace_back());
+    }
+    for(uint32_t i=0; namesValid && i<header->shapeCount; i++) {
+        MeshShape& shape = cachedShapes.emplace_back();
+        namesValid = readU32(shape.firstIndex) && readU32(shape.indexCount) && readName(shape.name)
+            && shape.firstIndex <= header->indexCount && shape.indexCount <= header->indexCount - shape.firstIndex;
     }
 
-    normals.resize(indices.size());
+    if (!namesValid) return stale();
 
-    if (attrib.normals.size() == 0) {
-        for(uint32_t i=0; i<indices.size(); i+=3) {
-            const glm::vec3 v0 = vertices[indices[i+0]].v.xyz();
-            const glm::vec3 v1 = vertices[indices[i+1]].v.xyz();
-            const glm::vec3 v2 = vertices[indices[i+2]].v.xyz();
-            const glm::vec3 normal = glm::normalize(glm::cross(v0 - v1, v0 - v2));
-            normals[i+0] = normal;
-            normals[i+1] = normal;
-            normals[i+2] = normal;
+    mapped = data;
+    mappedSize = size;
+    vertices = { reinterpret_cast<const Vertex*>(bytes + header->vertexOffset), header->vertexCount };
+    indices = { reinterpret_cast<const uint32_t*>(bytes + header->indexOffset), header->indexCount };
+    normals = { reinterpret_cast<const glm::vec3*>(bytes + header->normalOffset), header->normalCount };
+    materialIds = { reinterpret_cast<const uint32_t*>(bytes + header->materialIdOffset), header->materialIdCount };
+    materials = std::move(cachedMaterials);
+    shapes = std::move(cachedShapes);
+    return true;
+}
+
+bool Mesh::writeCache(const std::string& cachePath, uint64_t sourceHash) const {
+    std::vector<uchar> names;
+    auto writeU32 = [&](uint32_t value) {
+        const auto* valueBytes = reinterpret_cast<const uchar*>(&value);
+        names.insert(names.end(), valueBytes, valueBytes + sizeof(uint32_t));
+    };
+    auto writeName = [&](const std::string& name) {
+        writeU32(static_cast<uint32_t>(name.size()));
+        names.insert(names.end(), name.begin(), name.end());
+    };
+    for(const auto& material : materials) {
+        writeName(material);
+    }
+    for(const auto& shape : shapes) {
+        writeU32(shape.firstIndex);
+        writeU32(shape.indexCount);
+        writeName(shape.name);
+    }
+
+    MeshCacheHeader header {
+        .magic = MeshCacheHeader::MAGIC,
+        .version = MeshCacheHeader::VERSION,
+        .sourceHash = sourceHash,
+        .vertexCount = vertices.size(),
+        .indexCount = indices.size(),
+        .normalCount = normals.size(),
+        .materialIdCount = materialIds.size(),
+        .namesSize = names.size(),
+        .materialCount = static_cast<uint32_t>(materials.size()),
+        .shapeCount = static_cast<uint32_t>(shapes.size()),
+    };
+    header.vertexOffset = alignOffset(sizeof(MeshCacheHeader));
+    header.indexOffset = alignOffset(header.vertexOffset + vertices.size_bytes());
+    header.normalOffset = alignOffset(header.indexOffset + indices.size_bytes());
+    header.materialIdOffset = alignOffset(header.normalOffset + normals.size_bytes());
+    header.namesOffset = alignOffset(header.materialIdOffset + materialIds.size_bytes());
+    const uint64_t totalSize = header.namesOffset + names.size();
+
+    std::vector<uchar> contents(totalSize, 0);
+    memcpy(contents.data(), &header, sizeof(MeshCacheHeader));
+    memcpy(contents.data() + header.vertexOffset, vertices.data(), vertices.size_bytes());
+    memcpy(contents.data() + header.indexOffset, indices.data(), indices.size_bytes());
+    memcpy(contents.data() + header.normalOffset, normals.data(), normals.size_bytes());
+    memcpy(contents.data() + header.materialIdOffset, materialIds.data(), materialIds.size_bytes());
+    memcpy(contents.data() + header.namesOffset, names.data(), names.size());
+
+    // Written next to the cache and renamed so a reader never maps a half written file
+    const std::string tmpPath = cachePath + ".tmp";
+    {
+        std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+        if (!file) {
+            logger::warn("Could not write mesh cache {}", cachePath);
+            return false;
         }
-    } else {
-        for(uint32_t i=0; i<shape.mesh.indices.size(); i+=3) {
-            const auto& ni0 = shape.mesh.indices[i+0].normal_index;
-            const auto& ni1 = shape.mesh.indices[i+1].normal_index;
-            const auto& ni2 = shape.mesh.indices[i+2].normal_index;
-            const auto n0 = glm::vec3(attrib.normals[ni0*3+0], attrib.normals[ni0*3+1], attrib.normals[ni0*3+2]);
-            const auto n1 = glm::vec3(attrib.normals[ni1*3+0], attrib.normals[ni1*3+1], attrib.normals[ni1*3+2]);
-            const auto n2 = glm::vec3(attrib.normals[ni2*3+0], attrib.normals[ni2*3+1], attrib.normals[ni2*3+2]);
-            normals[i+0] = n0;
-            normals[i+1] = n1;
-            normals[i+2] = n2;
+        file.write(reinterpret_cast<const char*>(contents.data()), static_cast<std::streamsize>(contents.size()));
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(tmpPath, cachePath, ec);
+    if (ec) {
+        logger::warn("Could not write mesh cache {}: {}", cachePath, ec.message());
+        std::filesystem::remove(tmpPath, ec);
+        return false;
+    }
+    logger::debug("Wrote mesh cache {}", cachePath);
+    return true;
+}
+
+void Mesh::reset() {
+    if (mapped != nullptr) {
+        munmap(mapped, mappedSize);
+        mapped = nullptr;
+        mappedSize = 0;
+    }
+    ownedVertices.clear();
+    ownedIndices.clear();
+    ownedNormals.clear();
+    ownedMaterialIds.clear();
+    materials.clear();
+    shapes.clear();
+    vertices = {};
+    indices = {};
+    normals = {};
+    materialIds = {};
+}
+
+bool Mesh::parseObj(const char* filename) {
+    auto& pool = ThreadPool::shared();
+    ObjData obj;
+    if (!objparser::parse(filename, pool, obj)) {
+        return false;
+    }
+
+    const size_t nrTriangles = obj.positionIndices.size() / 3;
+    ownedVertices.resize(obj.positions.size());
+    ownedNormals.resize(obj.positionIndices.size());
+
+    pool.parallelFor(obj.positions.size(), 1 << 16, [&](size_t begin, size_t end) {
+        for(size_t v=begin; v<end; v++) {
+            ownedVertices[v] = lv::Vertex { glm::vec4(obj.positions[v], 0) };
         }
+    });
+
+    // Corners without a normal in the file get the face normal
+    pool.parallelFor(nrTriangles, 1 << 14, [&](size_t begin, size_t end) {
+        for(size_t t=begin; t<end; t++) {
+            const size_t i = t * 3;
+            glm::vec3 faceNormal(0.0f);
+            if (obj.normalIndices[i+0] < 0 || obj.normalIndices[i+1] < 0 || obj.normalIndices[i+2] < 0) {
+                const glm::vec3 v0 = obj.positions[obj.positionIndices[i+0]];
+                const glm::vec3 v1 = obj.positions[obj.positionIndices[i+1]];
+                const glm::vec3 v2 = obj.positions[obj.positionIndices[i+2]];
+                faceNormal = glm::normalize(glm::cross(v0 - v1, v0 - v2));
+            }
+            for(size_t c=0; c<3; c++) {
+                const int32_t ni = obj.normalIndices[i+c];
+                ownedNormals[i+c] = ni < 0 ? faceNormal : obj.normals[ni];
+            }
+        }
+    });
+
+    ownedIndices = std::move(obj.positionIndices);
+    ownedMaterialIds = std::move(obj.materialIds);
+    materials = std::move(obj.materials);
+    for(const auto& shape : obj.shapes) {
+        shapes.push_back(MeshShape { shape.name, shape.firstTriangle * 3, shape.triangleCount * 3 });
     }
+
+    vertices = ownedVertices;
+    indices = ownedIndices;
+    normals = ownedNormals;
+    materialIds = ownedMaterialIds;
+    return true;
 }
 
 }
@@ -0,0 +1,276 @@
+#include "ObjParser.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace lv {
+namespace objparser {
+
+// Chunks smaller than this are not worth a task
+static constexpr size_t minChunkSize = 1 << 20;
+
+// Face indices are stored unresolved while parsing, relative ones need the vertex count of earlier chunks
+static constexpr int64_t ABSENT = std::numeric_limits<int64_t>::min();
+static constexpr int64_t RELATIVE_BIAS = int64_t(1) << 62;
+
+struct ObjEvent {
+    uint32_t triangle;
+    std::string name;
+};
+
+struct ObjChunk {
+    std::vector<glm::vec3> positions;
+    std::vector<glm::vec3> normals;
+    std::vector<int64_t> positionIndices;
+    std::vector<int64_t> normalIndices;
+    std::vector<ObjEvent> materialEvents;
+    std::vector<ObjEvent> shapeEvents;
+};
+
+static inline bool isSpace(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+static inline const char* skipSpace(const char* p, const char* end) {
+    while (p < end && isSpace(*p)) p++;
+    return p;
+}
+
+static inline const char* parseFloat(const char* p, const char* end, float& value) {
+    p = skipSpace(p, end);
+    // from_chars rejects a leading plus
+    if (p < end && *p == '+') p++;
+    auto result = std::from_chars(p, end, value);
+    if (result.ec != std::errc()) value = 0.0f;
+    return result.ptr;
+}
+
+static inline int64_t encodeIndex(int64_t idx, size_t localCount) {
+    if (idx > 0) return idx - 1;
+    if (idx < 0) return static_cast<int64_t>(localCount) + idx - RELATIVE_BIAS;
+    return ABSENT;
+}
+
+static inline std::string parseName(const char* p, const char* end) {
+    p = skipSpace(p, end);
+    const char* nameEnd = end;
+    while (nameEnd > p && isSpace(*(nameEnd - 1))) nameEnd--;
+    return std::string(p, nameEnd);
+}
+
+static void parseFace(const char* p, const char* end, ObjChunk& chunk) {
+    // Most faces are triangles or quads
+    std::array<int64_t, 16> localV, localN;
+    std::vector<int64_t> extraV, extraN;
+    size_t nrCorners = 0;
+
+    while (true) {
+        p = skipSpace(p, end);
+        if (p >= end) break;
+
+        int64_t v = 0, n = 0;
+        auto result = std::from_chars(p, end, v);
+        if (result.ec != std::errc()) break;
+        p = result.ptr;
+        if (p < end && *p == '/') {
+            p++;
+            // Texture coordinates are not used
+            if (p < end && *p != '/') {
+                int64_t vt;
+                p = std::from_chars(p, end, vt).ptr;
+            }
+            if (p < end && *p == '/') {
+                p++;
+                p = std::from_chars(p, end, n).ptr;
+            }
+        }
+        while (p < end && !isSpace(*p)) p++;
+
+        const int64_t encodedV = encodeIndex(v, chunk.positions.size());
+        const int64_t encodedN = encodeIndex(n, chunk.normals.size());
+        if (nrCorners < localV.size()) {
+            localV[nrCorners] = encodedV;
+            localN[nrCorners] = encodedN;
+        } else {
+            extraV.push_back(encodedV);
+            extraN.push_back(encodedN);
+        }
+        nrCorners++;
+    }
+
+    auto cornerV = [&](size_t i) { return i < localV.size() ? localV[i] : extraV[i - localV.size()]; };
+    auto cornerN = [&](size_t i) { return i < localN.size() ? localN[i] : extraN[i - localN.size()]; };
+
+    for(size_t i=1; i+1<nrCorners; i++) {
+        chunk.positionIndices.insert(chunk.positionIndices.end(), { cornerV(0), cornerV(i), cornerV(i+1) });
+        chunk.normalIndices.insert(chunk.normalIndices.end(), { cornerN(0), cornerN(i), cornerN(i+1) });
+    }
+}
+
+static void parseChunk(const char* begin, const char* end, ObjChunk& chunk) {
+    const char* line = begin;
+    while (line < end) {
+        const char* lineEnd = static_cast<const char*>(memchr(line, '\n', end - line));
+        if (lineEnd == nullptr) lineEnd = end;
+
+        const char* p = skipSpace(line, lineEnd);
+        const size_t length = lineEnd - p;
+        const uint32_t triangle = static_cast<uint32_t>(chunk.positionIndices.size() / 3);
+
+        if (length >= 2 && p[0] == 'v' && isSpace(p[1])) {
+            glm::vec3 v;
+            p = parseFloat(p + 2, lineEnd, v.x);
+            p = parseFloat(p, lineEnd, v.y);
+            parseFloat(p, lineEnd, v.z);
+            chunk.positions.push_back(v);
+        } else if (length >= 3 && p[0] == 'v' && p[1] == 'n' && isSpace(p[2])) {
+            glm::vec3 n;
+            p = parseFloat(p + 3, lineEnd, n.x);
+            p = parseFloat(p, lineEnd, n.y);
+            parseFloat(p, lineEnd, n.z);
+            chunk.normals.push_back(n);
+        } else if (length >= 2 && p[0] == 'f' && isSpace(p[1])) {
+            parseFace(p + 2, lineEnd, chunk);
+        } else if (length >= 2 && (p[0] == 'o' || p[0] == 'g') && isSpace(p[1])) {
+            chunk.shapeEvents.push_back({ triangle, parseName(p + 2, lineEnd) });
+        } else if (length >= 7 && strncmp(p, "usemtl", 6) == 0 && isSpace(p[6])) {
+            chunk.materialEvents.push_back({ triangle, parseName(p + 7, lineEnd) });
+        }
+
+        line = lineEnd + 1;
+    }
+}
+
+// Returns -1 for missing or out of range indices
+static inline int64_t resolveIndex(int64_t encoded, size_t chunkBase, size_t total) {
+    if (encoded == ABSENT) return -1;
+    const int64_t idx = encoded >= 0 ? encoded : static_cast<int64_t>(chunkBase) + encoded + RELATIVE_BIAS;
+    return idx < 0 || static_cast<size_t>(idx) >= total ? -1 : idx;
+}
+
+bool parse(const char* filename, ThreadPool& pool, ObjData& out) {
+    const int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        logger::error("Could not open {}", filename);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        logger::error("Could not stat {}", filename);
+        return false;
+    }
+    const size_t size = static_cast<size_t>(st.st_size);
+    if (size == 0) {
+        close(fd);
+        out = ObjData{};
+        return true;
+    }
+    void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        logger::error("Could not map {}", filename);
+        return false;
+    }
+    madvise(mapping, size, MADV_SEQUENTIAL);
+    const char* data = static_cast<const char*>(mapping);
+
+    // Split on line boundaries so no statement straddles two chunks
+    const size_t nrChunks = std::clamp<size_t>(size / minChunkSize, 1, pool.getNrThreads() * 4);
+    std::vector<const char*> bounds { data };
+    for(size_t i=1; i<nrChunks; i++) {
+        const char* split = std::max(bounds.back(), data + size * i / nrChunks);
+        const char* newline = static_cast<const char*>(memchr(split, '\n', data + size - split));
+        bounds.push_back(newline == nullptr ? data + size : newline + 1);
+    }
+    bounds.push_back(data + size);
+
+    std::vector<ObjChunk> chunks(nrChunks);
+    pool.parallelFor(nrChunks, 1, [&](size_t begin, size_t end) {
+        for(size_t i=begin; i<end; i++) {
+            parseChunk(bounds[i], bounds[i+1], chunks[i]);
+        }
+    });
+    munmap(mapping, size);
+
+    // Offsets of every chunk in the merged arrays
+    std::vector<size_t> positionBase(nrChunks + 1, 0), normalBase(nrChunks + 1, 0), triangleBase(nrChunks + 1, 0);
+    for(size_t i=0; i<nrChunks; i++) {
+        positionBase[i+1] = positionBase[i] + chunks[i].positions.size();
+        normalBase[i+1] = normalBase[i] + chunks[i].normals.size();
+        triangleBase[i+1] = triangleBase[i] + chunks[i].positionIndices.size() / 3;
+    }
+    const size_t nrTriangles = triangleBase[nrChunks];
+
+    // Events are rare, resolve them in order. Each chunk starts with the material active at the end of the last
+    out.materials = { "default" };
+    out.shapes.clear();
+    std::unordered_map<std::string, uint32_t> materialLookup;
+    std::vector<std::vector<std::pair<uint32_t, uint32_t>>> chunkMaterials(nrChunks);
+    uint32_t currentMaterial = 0;
+    ObjShape currentShape { "default", 0, 0 };
+    for(size_t i=0; i<nrChunks; i++) {
+        chunkMaterials[i].push_back({ 0, currentMaterial });
+        for(const auto& event : chunks[i].materialEvents) {
+            auto it = materialLookup.find(event.name);
+            if (it == materialLookup.end()) {
+                it = materialLookup.insert({ event.name, static_cast<uint32_t>(out.materials.size()) }).first;
+                out.materials.push_back(event.name);
+            }
+            currentMaterial = it->second;
+            chunkMaterials[i].push_back({ event.triangle, currentMaterial });
+        }
+        for(const auto& event : chunks[i].shapeEvents) {
+            const uint32_t triangle = static_cast<uint32_t>(triangleBase[i]) + event.triangle;
+            currentShape.triangleCount = triangle - currentShape.firstTriangle;
+            if (currentShape.triangleCount > 0) out.shapes.push_back(currentShape);
+            currentShape = { event.name, triangle, 0 };
+        }
+    }
+    currentShape.triangleCount = static_cast<uint32_t>(nrTriangles) - currentShape.firstTriangle;
+    if (currentShape.triangleCount > 0) out.shapes.push_back(currentShape);
+
+    out.positions.resize(positionBase[nrChunks]);
+    out.normals.resize(normalBase[nrChunks]);
+    out.positionIndices.resize(nrTriangles * 3);
+    out.normalIndices.resize(nrTriangles * 3);
+    out.materialIds.resize(nrTriangles);
+
+    std::atomic<uint32_t> nrInvalid = 0;
+    pool.parallelFor(nrChunks, 1, [&](size_t begin, size_t end) {
+        for(size_t i=begin; i<end; i++) {
+            const auto& chunk = chunks[i];
+            std::copy(chunk.positions.begin(), chunk.positions.end(), out.positions.begin() + positionBase[i]);
+            std::copy(chunk.normals.begin(), chunk.normals.end(), out.normals.begin() + normalBase[i]);
+
+            uint32_t chunkInvalid = 0;
+            const size_t indexBase = triangleBase[i] * 3;
+            for(size_t c=0; c<chunk.positionIndices.size(); c++) {
+                const int64_t v = resolveIndex(chunk.positionIndices[c], positionBase[i], out.positions.size());
+                if (v < 0) chunkInvalid++;
+                out.positionIndices[indexBase + c] = v < 0 ? 0 : static_cast<uint32_t>(v);
+                // Corners without a valid normal fall back to the face normal
+                out.normalIndices[indexBase + c] = static_cast<int32_t>(resolveIndex(chunk.normalIndices[c], normalBase[i], out.normals.size()));
+            }
+
+            const auto& materials = chunkMaterials[i];
+            const size_t chunkTriangles = chunk.positionIndices.size() / 3;
+            for(size_t m=0; m<materials.size(); m++) {
+                const size_t first = materials[m].first;
+                const size_t last = m + 1 < materials.size() ? materials[m+1].first : chunkTriangles;
+                std::fill(out.materialIds.begin() + triangleBase[i] + first, out.materialIds.begin() + triangleBase[i] + last, materials[m].second);
+            }
+            nrInvalid += chunkInvalid;
+        }
+    });
+
+    if (nrInvalid > 0) {
+        logger::warn("{} has {} out of range face indices", filename, nrInvalid.load());
+    }
+    logger::debug("Parsed {} in {} chunks: {} vertices, {} triangles, {} shapes, {} materials",
+        filename, nrChunks, out.positions.size(), nrTriangles, out.shapes.size(), out.materials.size());
+    return true;
+}
+
+}
+}
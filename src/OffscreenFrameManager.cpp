@@ -0,0 +1,30 @@
+#include "OffscreenFrameManager.h"
+
+namespace lv {
+
+OffscreenFrameManager::OffscreenFrameManager(AppContext& ctx, OffscreenInfo info)
+    : FrameManager(ctx, info.framesInFlight), info(info) {
+    assert(info.nrFrames > 0 && "Need at least one render target");
+    images.resize(info.nrFrames);
+    setNrFrames(info.nrFrames);
+}
+
+OffscreenFrameManager::~OffscreenFrameManager() {
+    for(auto& image : images) {
+        imagetools::destroyImage(ctx, image);
+    }
+}
+
+void OffscreenFrameManager::embellishFrameContext(FrameContext& frame) {
+    auto& image = images[frame.idx];
+    imagetools::create_image_D(ctx, info.width, info.height, info.usage, info.format, info.initialLayout, &image);
+
+    auto& windowFrame = frame.registerExtFrame<WindowFrame>();
+    windowFrame.width = info.width;
+    windowFrame.height = info.height;
+    windowFrame.format = info.format;
+    windowFrame.vkImage = image.image;
+    windowFrame.vkView = image.view;
+}
+
+}
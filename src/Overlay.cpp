@@ -49,6 +49,7 @@ void Overlay::initImgui() {
          .PhysicalDevice = ctx.vkPhysicalDevice,
          .Device = ctx.vkDevice,
          .Queue = ctx.queues.graphics,
+         .PipelineCache = ctx.vkPipelineCache,
          .DescriptorPool = imguiPool,
          .MinImageCount = info.frameManager->getNrFrames(),
          .ImageCount= info.frameManager->getNrFrames(),
@@ -73,10 +74,39 @@ void Overlay::render(FrameContext& frame, float energy, float fps) {
         ImGui::Text("FPS %0.2f", fps);
         ImGui::Text("Energy %.3f", energy);
         ImGui::Checkbox("NEE", &NEE);
+        ImGui::Checkbox("Adaptive sampling", &adaptiveSampling);
+        ImGui::Checkbox("Light BVH", &lightBvh);
+        ImGui::Checkbox("Wavefront", &wavefront);
+        ImGui::Checkbox("Reorder rays", &reorderRays);
+        ImGui::SliderFloat("Frame budget (ms)", &frameBudget, 4.0f, 50.0f);
     }
     ImGui::End();
+    if (info.profiler != nullptr) {
+        renderProfiler();
+    }
     ImGui::Render();
     ImGui_ImplVulkan_RenderDrawData(ImGui::GetDrawData(), frame.cmdBuffer);
 }
 
+void Overlay::renderProfiler() {
+    if (ImGui::Begin("GPU")) {
+        if (!info.profiler->isSupported()) {
+            ImGui::Text("Timestamps not supported");
+        }
+
+        double total = 0.0;
+        for(const auto& timing : info.profiler->getTimings()) {
+            if (timing.depth == 0) total += timing.getMilliseconds();
+            ImGui::Text("%*s%-20s %7.3f ms", timing.depth * 2, "", timing.name.c_str(), timing.getMilliseconds());
+        }
+        ImGui::Separator();
+        ImGui::Text("%-20s %7.3f ms", "Total", total);
+
+        if (ImGui::Button("Export trace")) {
+            info.profiler->exportChromeTrace("gpu_trace.json");
+        }
+    }
+    ImGui::End();
+}
+
 }
@@ -114,7 +114,7 @@ void Rasterizer::createRenderPass() {
             .stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
             .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
             .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-            .finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+            .finalLayout = info.finalLayout,
         });
 
         attachmentRefs.push_back(VkAttachmentReference {
@@ -210,7 +210,7 @@ void Rasterizer::createPipeline() {
         .subpass = 0
     };
 
-    vkCheck(vkCreateGraphicsPipelines(ctx.vkDevice, nullptr, 1, &pipelineInfo, nullptr, &pipeline));
+    vkCheck(vkCreateGraphicsPipelines(ctx.vkDevice, ctx.vkPipelineCache, 1, &pipelineInfo, nullptr, &pipeline));
 
     vkDestroyShaderModule(ctx.vkDevice, vertShader, nullptr);
     vkDestroyShaderModule(ctx.vkDevice, fragShader, nullptr);
@@ -1,28 +1,198 @@
 #include "RayTracer.h"
+#include "UploadManager.h"
 
 namespace lv {
 
+// Upper bound on the scratch memory a single BLAS batch may hold on to
+static const VkDeviceSize maxBatchScratchSize = 256 * 1024 * 1024;
+
+// Matches the push constants of sampleBudget.comp
+struct SampleBudgetConstants {
+    float threshold;
+    uint32_t minSamples;
+    uint32_t maxSamples;
+    uint32_t accumulationMode;
+};
+
+// Raygen groups in SBT order, the megakernel first. The reordering megakernel needs shader
+// execution reorder and is left out without it, so it has to stay last.
+enum RaygenGroup : uint32_t {
+    Megakernel, WavefrontGenerate, WavefrontExtend, WavefrontShade, WavefrontShadow, WavefrontResolve,
+    WavefrontSortCount, WavefrontSortBlocks, WavefrontSortScan, WavefrontSortScatter, MegakernelReorder, RaygenGroupCount
+};
+static const std::array<const char*, RaygenGroupCount> raygenShaders {
+    "./app/shaders_bin/raygen.rgen",
+    "./app/shaders_bin/wavefrontGenerate.rgen",
+    "./app/shaders_bin/wavefrontExtend.rgen",
+    "./app/shaders_bin/wavefrontShade.rgen",
+    "./app/shaders_bin/wavefrontShadow.rgen",
+    "./app/shaders_bin/wavefrontResolve.rgen",
+    "./app/shaders_bin/wavefrontSortCount.rgen",
+    "./app/shaders_bin/wavefrontSortBlocks.rgen",
+    "./app/shaders_bin/wavefrontSortScan.rgen",
+    "./app/shaders_bin/wavefrontSortScatter.rgen",
+    "./app/shaders_bin/raygenReorder.rgen",
+};
+
+// Matches the push constants in pathtracer.glsl, shared by every raygen group
+struct RayTracerConstants {
+    uint32_t sampleIdx;
+    uint32_t rayQueue;
+    uint32_t capacity;
+    uint32_t sorted;
+    glm::vec4 sceneMin;
+    // Maps scene bounds onto the Morton grid of the sort keys
+    glm::vec4 sceneScale;
+    uint32_t firstTile;
+    uint32_t tileSize;
+    uint32_t pad[2];
+};
+
+// Matches QueueHeader in wavefront.glsl, also read as VkTraceRaysIndirectCommandKHR
+struct WavefrontQueueHeader {
+    uint32_t count;
+    uint32_t height;
+    uint32_t depth;
+    uint32_t traced;
+};
+static const uint32_t shadowQueue = 2;
+// Matches SORT_BLOCKS_LAUNCH and SORT_SCAN_LAUNCH in wavefront.glsl, written by the sort count when it has rays
+static const uint32_t sortBlocksLaunch = 3;
+static const uint32_t sortScanLaunch = 4;
+// Matches SORT_BINS and SORT_BLOCK in wavefront.glsl, 3 Morton bits per axis and the direction octant
+static const uint32_t sortBins = 4096;
+static const uint32_t sortBlock = 64;
+static const uint32_t mortonCells = 8;
+
+// Scene bounds for the coherence keys, the rest is up to the stage
+static RayTracerConstants coherence_constants(const glm::vec3& boundsMin, const glm::vec3& boundsMax) {
+    return RayTracerConstants {
+        .sceneMin = glm::vec4(boundsMin, 0.0f),
+        .sceneScale = glm::vec4(static_cast<float>(mortonCells) / glm::max(boundsMax - boundsMin, glm::vec3(1e-6f)), 0.0f),
+    };
+}
+
+// Sizes of the records in wavefront.glsl
+static const VkDeviceSize wavefrontRaySize = 48;
+static const VkDeviceSize wavefrontHitSize = 48;
+static const VkDeviceSize wavefrontShadowRaySize = 48;
+static const VkDeviceSize wavefrontPixelSize = 48;
+
+static VkDeviceSize alignUp(VkDeviceSize value, VkDeviceSize alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+// Area times emitted luminance, emission sits in the w components
+static float get_light_power(const TriangleData& td) {
+    const glm::vec3 v0(td.vertices[0]), v1(td.vertices[1]), v2(td.vertices[2]);
+    const float area = 0.5f * glm::length(glm::cross(v1 - v0, v2 - v0));
+    const glm::vec3 emission(td.vertices[0].w, td.vertices[1].w, td.vertices[2].w);
+    return area * glm::dot(emission, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
+static float max3(const glm::vec3& v) { return std::max(v.x, std::max(v.y, v.z)); }
+
+// Octahedral map of a direction onto two snorm16, decoded by decodeOctahedral in common.glsl
+static uint32_t encode_octahedral(glm::vec3 n) {
+    const float l1 = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+    if (l1 <= 0.0f) return glm::packSnorm2x16(glm::vec2(0.0f));
+    n /= l1;
+    glm::vec2 e(n.x, n.y);
+    if (n.z < 0.0f) {
+        const glm::vec2 signs(n.x >= 0.0f ? 1.0f : -1.0f, n.y >= 0.0f ? 1.0f : -1.0f);
+        e = (1.0f - glm::abs(glm::vec2(n.y, n.x))) * signs;
+    }
+    return glm::packSnorm2x16(e);
+}
+
+// Shaders touching the sampling images come in two builds, see formatted_shader in app/CMakeLists.txt
+static std::string storage_shader_path(const char* path, bool formatlessStorage) {
+    return std::string(path) + (formatlessStorage ? ".spv" : ".formatted.spv");
+}
+
+// Images of this format can be loaded and stored by shaders that do not name the format
+static bool storage_without_format(const AppContext& ctx, VkFormat format) {
+    if (!ctx.enabledFeatures.shaderStorageImageReadWithoutFormat || !ctx.enabledFeatures.shaderStorageImageWriteWithoutFormat) return false;
+    if (!ctx.deviceExtensionEnabled(VK_KHR_FORMAT_FEATURE_FLAGS_2_EXTENSION_NAME)) {
+        // Without per-format flags the features cover every format that can be a storage image
+        VkFormatProperties properties;
+        vkGetPhysicalDeviceFormatProperties(ctx.vkPhysicalDevice, format, &properties);
+        return properties.optimalTilingFeatures & VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT;
+    }
+    VkFormatProperties3KHR properties3 { .sType = VK_STRUCTURE_TYPE_FORMAT_PROPERTIES_3_KHR };
+    VkFormatProperties2 properties { .sType = VK_STRUCTURE_TYPE_FORMAT_PROPERTIES_2, .pNext = &properties3 };
+    vkGetPhysicalDeviceFormatProperties2(ctx.vkPhysicalDevice, format, &properties);
+    const VkFormatFeatureFlags2KHR required = VK_FORMAT_FEATURE_2_STORAGE_IMAGE_BIT_KHR
+        | VK_FORMAT_FEATURE_2_STORAGE_READ_WITHOUT_FORMAT_BIT_KHR | VK_FORMAT_FEATURE_2_STORAGE_WRITE_WITHOUT_FORMAT_BIT_KHR;
+    return (properties3.optimalTilingFeatures & required) == required;
+}
+
+bool RayTracerInfo::storesWithoutFormat(const AppContext& ctx) const {
+    return storage_without_format(ctx, getAccumulationFormat()) && storage_without_format(ctx, getMomentFormat())
+        && storage_without_format(ctx, sampleCountFormat);
+}
+
+void RayTracerInfo::adaptFormats(const AppContext& ctx) {
+    if (storesWithoutFormat(ctx)) return;
+    if (accumulationMode != AccumulationMode::Sum32) {
+        logger::info("Accumulation mode {} can not be stored without a format on this device, falling back to Sum32", static_cast<int>(accumulationMode));
+        accumulationMode = AccumulationMode::Sum32;
+    }
+    // The formatted shaders declare R32 counts
+    if (sampleCountFormat != VK_FORMAT_R32_UINT && !storesWithoutFormat(ctx)) {
+        logger::debug("Sample counts can not be stored as R16_UINT without a format, falling back to R32_UINT");
+        sampleCountFormat = VK_FORMAT_R32_UINT;
+    }
+}
+
+static VkBuildAccelerationStructureFlagsKHR getBuildFlags(BuildPolicy policy) {
+    switch(policy) {
+        case BuildPolicy::FastTrace: return VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
+        case BuildPolicy::FastBuild: return VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_BUILD_BIT_KHR;
+        case BuildPolicy::LowMemory: return VK_BUILD_ACCELERATION_STRUCTURE_LOW_MEMORY_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR;
+        case BuildPolicy::AllowUpdate: return VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR;
+    }
+    return VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
+}
+
 RayTracer::RayTracer(AppContext& ctx, RayTracerInfo info) : AppExt(ctx), info(info) {
     loadFunctions();
     getFeatures();
+    checkAccumulationFormats();
     createRayTracingPipeline();
+    createSampleBudgetPipeline();
     createShaderBindingTable();
     createBottomLevelAccelerationStructures();
-    createTopLevelAccelerationStructure();
+    for(uint32_t i=0; i<bottomACs.size(); i++) {
+        addInstance(i);
+    }
     imagetools::load_image_D(ctx, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, "./app/bluenoise.png", &blueNoise);
 }
 
 RayTracer::~RayTracer() {
     imagetools::destroyImage(ctx, blueNoise);
+    if (samplingWidth > 0) {
+        imagetools::destroyImage(ctx, momentImage);
+        imagetools::destroyImage(ctx, budgetImage);
+        imagetools::destroyImage(ctx, sampleCountImage);
+    }
     buffertools::destroyBuffer(ctx, vertexBuffer);
     buffertools::destroyBuffer(ctx, indexBuffer);
-    buffertools::destroyBuffer(ctx, triangleDataBuffer);
-    buffertools::destroyBuffer(ctx, emissiveTriangleBuffer);
+    buffertools::destroyBuffer(ctx, triangleAttributeBuffer);
+    buffertools::destroyBuffer(ctx, materialBuffer);
     buffertools::destroyBuffer(ctx, transformBuffer);
-    buffertools::destroyBuffer(ctx, raygenShaderBindingTable);
+    for(auto& table : raygenShaderBindingTables)
+        buffertools::destroyBuffer(ctx, table);
+    if (wavefrontCapacity > 0) {
+        buffertools::destroyBuffer(ctx, wavefrontQueueHeaders);
+        buffertools::destroyBuffer(ctx, wavefrontRays);
+        buffertools::destroyBuffer(ctx, wavefrontHits);
+        buffertools::destroyBuffer(ctx, wavefrontShadowRays);
+        buffertools::destroyBuffer(ctx, wavefrontPixels);
+        buffertools::destroyBuffer(ctx, wavefrontSortBins);
+    }
     buffertools::destroyBuffer(ctx, missShaderBindingTable);
     buffertools::destroyBuffer(ctx, hitShaderBindingTable);
-    destroyAccelerationStructure(topAC);
     for(auto& as : bottomACs)
         destroyAccelerationStructure(as);
 
@@ -30,6 +200,9 @@ RayTracer::~RayTracer() {
     vkDestroyPipeline(ctx.vkDevice, pipeline, nullptr);
     vkDestroyPipelineLayout(ctx.vkDevice, pipelineLayout, nullptr);
     vkDestroyDescriptorSetLayout(ctx.vkDevice, descriptorSetLayout, nullptr);
+    vkDestroyPipeline(ctx.vkDevice, budgetPipeline, nullptr);
+    vkDestroyPipelineLayout(ctx.vkDevice, budgetPipelineLayout, nullptr);
+    vkDestroyDescriptorSetLayout(ctx.vkDevice, budgetDescriptorSetLayout, nullptr);
 }
 
 void RayTracer::embellishFrameContext(FrameContext& frame) {
@@ -46,7 +219,10 @@ void RayTracer::embellishFrameContext(FrameContext& frame) {
         .projInverse = glm::inverse(projectionMatrix),
     };
 
-    buffertools::create_buffer_H2D_data(ctx, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, sizeof(RayTracerCamera), &camera, &ret.cameraBuffer);
+    buffertools::create_buffer_H2D(ctx, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, sizeof(RayTracerCamera), &ret.cameraBuffer);
+    vkCheck(vmaMapMemory(ctx.vmaAllocator, ret.cameraBuffer.memory, &ret.cameraBuffer.data));
+    memcpy(ret.cameraBuffer.data, &camera, sizeof(RayTracerCamera));
+    vmaFlushAllocation(ctx.vmaAllocator, ret.cameraBuffer.memory, 0, sizeof(RayTracerCamera));
 
     // Blue noise sampler
     auto samplerInfo = vks::initializers::samplerCreateInfo(1.0f);
@@ -56,21 +232,33 @@ void RayTracer::embellishFrameContext(FrameContext& frame) {
     auto allocInfo = vks::initializers::descriptorSetAllocateInfo(ctx.vkDescriptorPool, &descriptorSetLayout, 1);
     vkCheck(vkAllocateDescriptorSets(ctx.vkDevice, &allocInfo, &ret.descriptorSet));
 
-    VkWriteDescriptorSetAccelerationStructureKHR writeASInfo{};
-    writeASInfo.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET_ACCELERATION_STRUCTURE_KHR;
-    writeASInfo.accelerationStructureCount = 1;
-    writeASInfo.pAccelerationStructures = &topAC.AShandle;
+    const VkImageView accumulatorView = frame.getExtFrame<lv::ResourceFrame>().getStatic(1)->view;
+    if (samplingWidth == 0) {
+        createSamplingImages(wFrame.width, wFrame.height);
+        createWavefrontQueues(wFrame.width, wFrame.height);
 
-    VkWriteDescriptorSet writeAS{};
-    writeAS.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    writeAS.pNext = &writeASInfo;
-    writeAS.dstSet = ret.descriptorSet;
-    writeAS.dstBinding = 0;
-    writeAS.descriptorCount = 1;
-    writeAS.descriptorType = VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR;
+        auto budgetAllocInfo = vks::initializers::descriptorSetAllocateInfo(ctx.vkDescriptorPool, &budgetDescriptorSetLayout, 1);
+        vkCheck(vkAllocateDescriptorSets(ctx.vkDevice, &budgetAllocInfo, &budgetDescriptorSet));
+
+        std::array<VkDescriptorImageInfo, 4> budgetImageInfos {
+            vks::initializers::descriptorImageInfo(VK_NULL_HANDLE, accumulatorView, VK_IMAGE_LAYOUT_GENERAL),
+            vks::initializers::descriptorImageInfo(VK_NULL_HANDLE, momentImage.view, VK_IMAGE_LAYOUT_GENERAL),
+            vks::initializers::descriptorImageInfo(VK_NULL_HANDLE, budgetImage.view, VK_IMAGE_LAYOUT_GENERAL),
+            vks::initializers::descriptorImageInfo(VK_NULL_HANDLE, sampleCountImage.view, VK_IMAGE_LAYOUT_GENERAL),
+        };
+        std::array<VkWriteDescriptorSet, 4> budgetWrites;
+        for(uint32_t i=0; i<budgetWrites.size(); i++) {
+            budgetWrites[i] = vks::initializers::writeDescriptorSet(budgetDescriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, i, &budgetImageInfos[i]);
+        }
+        vkUpdateDescriptorSets(ctx.vkDevice, static_cast<uint32_t>(budgetWrites.size()), budgetWrites.data(), 0, nullptr);
+    }
+
+    // The TLAS is only built right before it is first traced
+    createTopLevelAccelerationStructure(ret, std::max(nrLiveInstances, 16u));
+    writeTopLevelDescriptor(ret);
 
     VkDescriptorImageInfo imageDescriptorInfo{};
-    imageDescriptorInfo.imageView = frame.getExtFrame<lv::ResourceFrame>().getStatic(1)->view;
+    imageDescriptorInfo.imageView = accumulatorView;
     imageDescriptorInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
     auto imageWrite = vks::initializers::writeDescriptorSet(ret.descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1, &imageDescriptorInfo);
 
@@ -80,38 +268,42 @@ void RayTracer::embellishFrameContext(FrameContext& frame) {
     bufferDescriptorInfo.range = VK_WHOLE_SIZE;
     VkWriteDescriptorSet uniformBufferWrite = vks::initializers::writeDescriptorSet(ret.descriptorSet, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 2, &bufferDescriptorInfo);
 
-    VkDescriptorBufferInfo indexBufferDescriptorInfo{};
-    indexBufferDescriptorInfo.buffer = indexBuffer.buffer;
-    indexBufferDescriptorInfo.offset = 0;
-    indexBufferDescriptorInfo.range = VK_WHOLE_SIZE;
-    VkWriteDescriptorSet indexBufferWrite = vks::initializers::writeDescriptorSet(ret.descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 3, &indexBufferDescriptorInfo);
+    auto triangleAttributeBufferInfo = vks::initializers::descriptorBufferInfo(triangleAttributeBuffer.buffer);
+    auto triangleAttributeBufferWrite = vks::initializers::writeDescriptorSet(ret.descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 5, &triangleAttributeBufferInfo);
 
-    VkDescriptorBufferInfo vertexBufferDescriptorInfo{};
-    vertexBufferDescriptorInfo.buffer = vertexBuffer.buffer;
-    vertexBufferDescriptorInfo.offset = 0;
-    vertexBufferDescriptorInfo.range = VK_WHOLE_SIZE;
-    VkWriteDescriptorSet vertexBufferWrite = vks::initializers::writeDescriptorSet(ret.descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 4, &vertexBufferDescriptorInfo);
+    auto momentImageInfo = vks::initializers::descriptorImageInfo(VK_NULL_HANDLE, momentImage.view, VK_IMAGE_LAYOUT_GENERAL);
+    auto momentImageWrite = vks::initializers::writeDescriptorSet(ret.descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 7, &momentImageInfo);
 
-    VkDescriptorBufferInfo triangleDataBufferDescriptorInfo{};
-    triangleDataBufferDescriptorInfo.buffer = triangleDataBuffer.buffer;
-    triangleDataBufferDescriptorInfo.offset = 0;
-    triangleDataBufferDescriptorInfo.range = VK_WHOLE_SIZE;
-    VkWriteDescriptorSet triangleDataBufferWrite = vks::initializers::writeDescriptorSet(ret.descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 5, &triangleDataBufferDescriptorInfo);
+    auto budgetImageInfo = vks::initializers::descriptorImageInfo(VK_NULL_HANDLE, budgetImage.view, VK_IMAGE_LAYOUT_GENERAL);
+    auto budgetImageWrite = vks::initializers::writeDescriptorSet(ret.descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 8, &budgetImageInfo);
 
-    VkDescriptorBufferInfo emissiveTriangleBufferDescriptorInfo{};
-    emissiveTriangleBufferDescriptorInfo.buffer = emissiveTriangleBuffer.buffer;
-    emissiveTriangleBufferDescriptorInfo.offset = 0;
-    emissiveTriangleBufferDescriptorInfo.range = VK_WHOLE_SIZE;
-    VkWriteDescriptorSet emissiveTriangleBufferWrite = vks::initializers::writeDescriptorSet(ret.descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 6, &emissiveTriangleBufferDescriptorInfo);
+    auto sampleCountImageInfo = vks::initializers::descriptorImageInfo(VK_NULL_HANDLE, sampleCountImage.view, VK_IMAGE_LAYOUT_GENERAL);
+    auto sampleCountImageWrite = vks::initializers::writeDescriptorSet(ret.descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 9, &sampleCountImageInfo);
 
+    // Sized for one instance per mesh, uploadLights grows them when there are more
+    createLightBuffers(ret, static_cast<uint32_t>(emissiveObjectTriangles.size()));
 
+    auto materialBufferInfo = vks::initializers::descriptorBufferInfo(materialBuffer.buffer);
+    auto materialBufferWrite = vks::initializers::writeDescriptorSet(ret.descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 13, &materialBufferInfo);
 
-    std::array<VkWriteDescriptorSet, 7> writes { writeAS, imageWrite, uniformBufferWrite, indexBufferWrite, vertexBufferWrite, triangleDataBufferWrite, emissiveTriangleBufferWrite };
+    std::array<VkWriteDescriptorSet, 7> writes { imageWrite, uniformBufferWrite, triangleAttributeBufferWrite, momentImageWrite, budgetImageWrite, sampleCountImageWrite, materialBufferWrite };
     vkUpdateDescriptorSets(ctx.vkDevice, static_cast<uint32_t>(writes.size()), writes.data(), 0, nullptr);
+
+    const std::array<VkBuffer, 6> wavefrontBuffers { wavefrontQueueHeaders.buffer, wavefrontRays.buffer, wavefrontHits.buffer, wavefrontShadowRays.buffer, wavefrontPixels.buffer, wavefrontSortBins.buffer };
+    std::array<VkDescriptorBufferInfo, 6> wavefrontInfos;
+    std::array<VkWriteDescriptorSet, 6> wavefrontWrites;
+    for(uint32_t i=0; i<wavefrontBuffers.size(); i++) {
+        wavefrontInfos[i] = vks::initializers::descriptorBufferInfo(wavefrontBuffers[i]);
+        wavefrontWrites[i] = vks::initializers::writeDescriptorSet(ret.descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 14 + i, &wavefrontInfos[i]);
+    }
+    vkUpdateDescriptorSets(ctx.vkDevice, static_cast<uint32_t>(wavefrontWrites.size()), wavefrontWrites.data(), 0, nullptr);
 }
 
 void RayTracer::cleanupFrameContext(FrameContext& frame) {
     auto& myFrame = frame.getExtFrame<RayTracerFrame>();
+    destroyTopLevelAccelerationStructure(myFrame);
+    destroyLightBuffers(myFrame);
+    vmaUnmapMemory(ctx.vmaAllocator, myFrame.cameraBuffer.memory);
     buffertools::destroyBuffer(ctx, myFrame.cameraBuffer);
     vkDestroySampler(ctx.vkDevice, myFrame.blueNoiseSampler, nullptr);
 }
@@ -125,8 +317,11 @@ void RayTracer::loadFunctions() {
     vkGetAccelerationStructureBuildSizesKHR = reinterpret_cast<PFN_vkGetAccelerationStructureBuildSizesKHR>(vkGetDeviceProcAddr(ctx.vkDevice, "vkGetAccelerationStructureBuildSizesKHR"));
     vkGetAccelerationStructureDeviceAddressKHR = reinterpret_cast<PFN_vkGetAccelerationStructureDeviceAddressKHR>(vkGetDeviceProcAddr(ctx.vkDevice, "vkGetAccelerationStructureDeviceAddressKHR"));
     vkCmdTraceRaysKHR = reinterpret_cast<PFN_vkCmdTraceRaysKHR>(vkGetDeviceProcAddr(ctx.vkDevice, "vkCmdTraceRaysKHR"));
+    vkCmdTraceRaysIndirectKHR = reinterpret_cast<PFN_vkCmdTraceRaysIndirectKHR>(vkGetDeviceProcAddr(ctx.vkDevice, "vkCmdTraceRaysIndirectKHR"));
     vkGetRayTracingShaderGroupHandlesKHR = reinterpret_cast<PFN_vkGetRayTracingShaderGroupHandlesKHR>(vkGetDeviceProcAddr(ctx.vkDevice, "vkGetRayTracingShaderGroupHandlesKHR"));
     vkCreateRayTracingPipelinesKHR = reinterpret_cast<PFN_vkCreateRayTracingPipelinesKHR>(vkGetDeviceProcAddr(ctx.vkDevice, "vkCreateRayTracingPipelinesKHR"));
+    vkCmdWriteAccelerationStructuresPropertiesKHR = reinterpret_cast<PFN_vkCmdWriteAccelerationStructuresPropertiesKHR>(vkGetDeviceProcAddr(ctx.vkDevice, "vkCmdWriteAccelerationStructuresPropertiesKHR"));
+    vkCmdCopyAccelerationStructureKHR = reinterpret_cast<PFN_vkCmdCopyAccelerationStructureKHR>(vkGetDeviceProcAddr(ctx.vkDevice, "vkCmdCopyAccelerationStructureKHR"));
 
 }
 
@@ -143,9 +338,30 @@ AccelerationStructure RayTracer::createAccelerationStructureBuffer(VkAcceleratio
     AccelerationStructure ret{};
     buffertools::create_buffer_D(ctx, usage, buildSizeInfo.accelerationStructureSize, &ret); 
     ret.deviceAddress = getBufferDeviceAddress(ret.buffer);                                                         
+    ret.size = buildSizeInfo.accelerationStructureSize;
     return ret;                                                                                                     
 }
 
+AccelerationStructure RayTracer::createAccelerationStructure(VkAccelerationStructureTypeKHR type, VkDeviceSize size) {
+    VkAccelerationStructureBuildSizesInfoKHR sizeInfo{};
+    sizeInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
+    sizeInfo.accelerationStructureSize = size;
+    auto ret = createAccelerationStructureBuffer(sizeInfo);
+
+    VkAccelerationStructureCreateInfoKHR createInfo{};
+    createInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR;
+    createInfo.buffer = ret.buffer;
+    createInfo.size = size;
+    createInfo.type = type;
+    vkCheck(vkCreateAccelerationStructureKHR(ctx.vkDevice, &createInfo, nullptr, &ret.AShandle));
+
+    VkAccelerationStructureDeviceAddressInfoKHR addressInfo{};
+    addressInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR;
+    addressInfo.accelerationStructure = ret.AShandle;
+    ret.deviceAddress = vkGetAccelerationStructureDeviceAddressKHR(ctx.vkDevice, &addressInfo);
+    return ret;
+}
+
 uint64_t RayTracer::getBufferDeviceAddress(VkBuffer buffer) const {
     VkBufferDeviceAddressInfoKHR info {
         .sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO,
@@ -155,41 +371,80 @@ uint64_t RayTracer::getBufferDeviceAddress(VkBuffer buffer) const {
 }
 
 void RayTracer::getFeatures() {
+    accelerationStructureProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_PROPERTIES_KHR;
     rayTracingPipelineProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_TRACING_PIPELINE_PROPERTIES_KHR;
+    rayTracingPipelineProperties.pNext = &accelerationStructureProperties;
     VkPhysicalDeviceProperties2 deviceProperties{};
     deviceProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
     deviceProperties.pNext = &rayTracingPipelineProperties;
     vkGetPhysicalDeviceProperties2(ctx.vkPhysicalDevice, &deviceProperties);
 
+    VkPhysicalDeviceRayTracingPipelineFeaturesKHR rayTracingPipelineFeatures {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_TRACING_PIPELINE_FEATURES_KHR,
+    };
     accelerationStructureFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_FEATURES_KHR;
+    accelerationStructureFeatures.pNext = &rayTracingPipelineFeatures;
     VkPhysicalDeviceFeatures2 deviceFeatures{};
     deviceFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
     deviceFeatures.pNext = &accelerationStructureFeatures;
     vkGetPhysicalDeviceFeatures2(ctx.vkPhysicalDevice, &deviceFeatures);
+    accelerationStructureFeatures.pNext = nullptr;
+
+    // AppContext enables indirect traces wherever they are supported, every wavefront stage after generate needs them
+    if (info.allowWavefront && !rayTracingPipelineFeatures.rayTracingPipelineTraceRaysIndirect) {
+        logger::info("No indirect ray tracing on this device, leaving out the wavefront backend");
+        info.allowWavefront = false;
+        info.backend = RayTracerBackend::Megakernel;
+        if (info.rayReordering == RayReordering::Sort) info.rayReordering = RayReordering::None;
+    }
+
+    executionReorderSupported = ctx.deviceExtensionEnabled(VK_NV_RAY_TRACING_INVOCATION_REORDER_EXTENSION_NAME);
+    if (info.rayReordering == RayReordering::ExecutionReorder && !executionReorderSupported) {
+        logger::info("No shader execution reorder on this device, rays are traced unordered");
+        info.rayReordering = RayReordering::None;
+    }
+    if (info.rayReordering == RayReordering::Sort && !info.allowWavefront) {
+        logger::error("Sorting rays needs RayTracerInfo::allowWavefront");
+        exit(1);
+    }
 }
 
 void RayTracer::createRayTracingPipeline() {
     auto ASLayoutBinding = vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 0);
     auto resultImageLayoutBinding = vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 1);
     auto uniformBufferBinding = vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 2);
-    auto indexBufferBinding = vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 3);
-    auto vertexBufferBinding = vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 4);
-    auto triangleDataBufferBinding = vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR | VK_SHADER_STAGE_RAYGEN_BIT_KHR, 5);
-    auto emissiveTriangleBufferBinding = vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 6);
-    std::vector<VkDescriptorSetLayoutBinding> bindings { ASLayoutBinding, resultImageLayoutBinding, uniformBufferBinding, indexBufferBinding, vertexBufferBinding, triangleDataBufferBinding, emissiveTriangleBufferBinding };
+    // 3 and 4 are free, the packed geometry is only read by BLAS builds and the hit shader gets by on triangle attributes
+    auto triangleAttributeBufferBinding = vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 5);
+    // 6 is free, the number of lights comes with the camera
+    auto momentImageBinding = vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 7);
+    auto budgetImageBinding = vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 8);
+    auto sampleCountImageBinding = vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 9);
+    auto lightAliasBufferBinding = vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 10);
+    auto lightBvhBufferBinding = vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 11);
+    auto lightTriangleBufferBinding = vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 12);
+    auto materialBufferBinding = vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 13);
+    std::vector<VkDescriptorSetLayoutBinding> bindings { ASLayoutBinding, resultImageLayoutBinding, uniformBufferBinding, triangleAttributeBufferBinding, momentImageBinding, budgetImageBinding, sampleCountImageBinding, lightAliasBufferBinding, lightBvhBufferBinding, lightTriangleBufferBinding, materialBufferBinding };
+    // Wavefront queue headers, rays, hits, shadow rays, pixel state and sort bins
+    for(uint32_t binding=14; binding<20; binding++) {
+        bindings.push_back(vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR, binding));
+    }
 
     auto layoutCreateInfo = vks::initializers::descriptorSetLayoutCreateInfo(bindings);
     vkCheck(vkCreateDescriptorSetLayout(ctx.vkDevice, &layoutCreateInfo, nullptr, &descriptorSetLayout));
 
+    VkPushConstantRange pushConstantRange { VK_SHADER_STAGE_RAYGEN_BIT_KHR, 0, sizeof(RayTracerConstants) };
     auto pipelineLayoutInfo = vks::initializers::pipelineLayoutCreateInfo(&descriptorSetLayout);
+    pipelineLayoutInfo.pushConstantRangeCount = 1;
+    pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
     vkCheck(vkCreatePipelineLayout(ctx.vkDevice, &pipelineLayoutInfo, nullptr, &pipelineLayout));
 
     // Setup ray tracing shader groups
     std::vector<VkPipelineShaderStageCreateInfo> shaderStages;
 
-    {
-        // Ray gen 
-        shaderStages.push_back(vks::initializers::pipelineShaderStageCreateInfo(vks::tools::loadShader("./app/shaders_bin/raygen.rgen.spv", ctx.vkDevice), VK_SHADER_STAGE_RAYGEN_BIT_KHR));
+    const uint32_t nrRaygenGroups = executionReorderSupported ? RaygenGroupCount : MegakernelReorder;
+    for(uint32_t group=0; group<nrRaygenGroups; group++) {
+        // Ray gen
+        shaderStages.push_back(vks::initializers::pipelineShaderStageCreateInfo(vks::tools::loadShader(storage_shader_path(raygenShaders[group], formatlessStorage).c_str(), ctx.vkDevice), VK_SHADER_STAGE_RAYGEN_BIT_KHR));
         VkRayTracingShaderGroupCreateInfoKHR shaderGroup{};
         shaderGroup.sType = VK_STRUCTURE_TYPE_RAY_TRACING_SHADER_GROUP_CREATE_INFO_KHR;
         shaderGroup.type = VK_RAY_TRACING_SHADER_GROUP_TYPE_GENERAL_KHR;
@@ -234,241 +489,722 @@ void RayTracer::createRayTracingPipeline() {
     rayTracingPipelineCI.pGroups = shaderGroups.data();
     rayTracingPipelineCI.maxPipelineRayRecursionDepth = 16;
     rayTracingPipelineCI.layout = pipelineLayout;
-    vkCheck(vkCreateRayTracingPipelinesKHR(ctx.vkDevice, VK_NULL_HANDLE, VK_NULL_HANDLE, 1, &rayTracingPipelineCI, nullptr, &pipeline));
+    vkCheck(vkCreateRayTracingPipelinesKHR(ctx.vkDevice, VK_NULL_HANDLE, ctx.vkPipelineCache, 1, &rayTracingPipelineCI, nullptr, &pipeline));
 
     for(const auto& stage : shaderStages) {
         vkDestroyShaderModule(ctx.vkDevice, stage.module, nullptr);
     }
 }
 
+void RayTracer::createSampleBudgetPipeline() {
+    std::vector<VkDescriptorSetLayoutBinding> bindings;
+    for(uint32_t i=0; i<4; i++) {
+        bindings.push_back(vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_COMPUTE_BIT, i));
+    }
+    auto layoutCreateInfo = vks::initializers::descriptorSetLayoutCreateInfo(bindings);
+    vkCheck(vkCreateDescriptorSetLayout(ctx.vkDevice, &layoutCreateInfo, nullptr, &budgetDescriptorSetLayout));
+
+    VkPushConstantRange pushConstantRange {
+        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+        .offset = 0,
+        .size = sizeof(SampleBudgetConstants),
+    };
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+        .setLayoutCount = 1,
+        .pSetLayouts = &budgetDescriptorSetLayout,
+        .pushConstantRangeCount = 1,
+        .pPushConstantRanges = &pushConstantRange,
+    };
+    vkCheck(vkCreatePipelineLayout(ctx.vkDevice, &pipelineLayoutInfo, nullptr, &budgetPipelineLayout));
+
+    auto module = ctx.createShaderModule(storage_shader_path("./app/shaders_bin/sampleBudget.comp", formatlessStorage).c_str());
+    auto pipelineInfo = vks::initializers::computePipelineCreateInfo(budgetPipelineLayout);
+    pipelineInfo.stage = vks::initializers::pipelineShaderStageCreateInfo(module, VK_SHADER_STAGE_COMPUTE_BIT);
+    vkCheck(vkCreateComputePipelines(ctx.vkDevice, ctx.vkPipelineCache, 1, &pipelineInfo, nullptr, &budgetPipeline));
+    vkDestroyShaderModule(ctx.vkDevice, module, nullptr);
+}
+
+void RayTracer::checkAccumulationFormats() {
+    assert((info.sampleCountFormat == VK_FORMAT_R16_UINT || info.sampleCountFormat == VK_FORMAT_R32_UINT) && "Sample counts are R16_UINT or R32_UINT");
+
+    // The caller sized the accumulator from its own copy of the info, only the counts may still change here
+    const AccumulationMode requestedMode = info.accumulationMode;
+    info.adaptFormats(ctx);
+    if (info.accumulationMode != requestedMode) {
+        logger::error("Accumulation mode not supported on this device, call RayTracerInfo::adaptFormats before creating the accumulator");
+        exit(1);
+    }
+    formatlessStorage = info.storesWithoutFormat(ctx);
+    logger::debug("Sampling images are {}", formatlessStorage ? "format-less" : "formatted, the mean modes are unavailable");
+
+    for(VkFormat format : { info.getAccumulationFormat(), info.getMomentFormat(), info.sampleCountFormat }) {
+        VkFormatProperties properties;
+        vkGetPhysicalDeviceFormatProperties(ctx.vkPhysicalDevice, format, &properties);
+        if (!(properties.optimalTilingFeatures & VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT)) {
+            logger::error("Accumulation format {} can not be used as a storage image on this device", static_cast<int>(format));
+            exit(1);
+        }
+    }
+}
+
+void RayTracer::createSamplingImages(uint32_t width, uint32_t height) {
+    samplingWidth = width;
+    samplingHeight = height;
+    nrTiles = ((width + info.tileSize - 1) / info.tileSize) * ((height + info.tileSize - 1) / info.tileSize);
+    const VkImageUsageFlags usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+    imagetools::create_image_D(ctx, width, height, usage, info.getMomentFormat(), VK_IMAGE_LAYOUT_GENERAL, &momentImage);
+    imagetools::create_image_D(ctx, width, height, usage, VK_FORMAT_R32_UINT, VK_IMAGE_LAYOUT_GENERAL, &budgetImage);
+    // Always created so the descriptors stay valid, Sum32 keeps its count in the accumulator
+    imagetools::create_image_D(ctx, width, height, usage, info.sampleCountFormat, VK_IMAGE_LAYOUT_GENERAL, &sampleCountImage);
+
+    // Until the first budget pass ran every pixel gets the full amount
+    auto cmdBuffer = ctx.singleTimeCommandBuffer();
+    VkImageSubresourceRange range { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+    VkClearColorValue zero {};
+    vkCmdClearColorImage(cmdBuffer, momentImage.image, VK_IMAGE_LAYOUT_GENERAL, &zero, 1, &range);
+    VkClearColorValue full { .uint32 = { 255, 0, 0, 0 } };
+    vkCmdClearColorImage(cmdBuffer, budgetImage.image, VK_IMAGE_LAYOUT_GENERAL, &full, 1, &range);
+    vkCmdClearColorImage(cmdBuffer, sampleCountImage.image, VK_IMAGE_LAYOUT_GENERAL, &zero, 1, &range);
+    ctx.endSingleTimeCommands(cmdBuffer);
+}
+
+void RayTracer::createWavefrontQueues(uint32_t width, uint32_t height) {
+    // One path per pixel is in flight at a time, the samples of a frame are traced one after another
+    wavefrontCapacity = info.allowWavefront ? width * height : 1;
+
+    const VkBufferUsageFlags usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+    // The ray queues, the shadow queue and the two sort launches
+    std::array<WavefrontQueueHeader, 5> headers;
+    headers.fill(WavefrontQueueHeader { 0, 1, 1, 0 });
+    buffertools::create_buffer_D_data_async(ctx, usage | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        sizeof(headers), headers.data(), &wavefrontQueueHeaders);
+    // Bin counts start at zero, offsets and block counts are rewritten before every use
+    const std::vector<uint32_t> bins(2 * sortBins + sortBins / sortBlock, 0);
+    const UploadToken uploaded = buffertools::create_buffer_D_data_async(ctx, usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT, bins.size() * sizeof(uint32_t), bins.data(), &wavefrontSortBins);
+    // Two ray queues, bounces read one and fill the other, the third holds a sorted queue
+    buffertools::create_buffer_D(ctx, usage, 3 * wavefrontCapacity * wavefrontRaySize, &wavefrontRays);
+    buffertools::create_buffer_D(ctx, usage, wavefrontCapacity * wavefrontHitSize, &wavefrontHits);
+    buffertools::create_buffer_D(ctx, usage, wavefrontCapacity * wavefrontShadowRaySize, &wavefrontShadowRays);
+    buffertools::create_buffer_D(ctx, usage, wavefrontCapacity * wavefrontPixelSize, &wavefrontPixels);
+    ctx.uploadManager->wait(uploaded);
+
+    if (info.allowWavefront) {
+        const VkDeviceSize total = wavefrontCapacity * (3 * wavefrontRaySize + wavefrontHitSize + wavefrontShadowRaySize + wavefrontPixelSize);
+        logger::debug("Wavefront queues take {:.1f}MB", total / (1024.0f * 1024.0f));
+    }
+}
+
+static void memory_barrier(VkCommandBuffer cmdBuffer, VkPipelineStageFlags srcStage, VkAccessFlags srcAccess, VkPipelineStageFlags dstStage, VkAccessFlags dstAccess) {
+    auto barrier = vks::initializers::memoryBarrier();
+    barrier.srcAccessMask = srcAccess;
+    barrier.dstAccessMask = dstAccess;
+    vkCmdPipelineBarrier(cmdBuffer, srcStage, dstStage, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+void RayTracer::traceWavefront(FrameContext& frame, uint32_t firstTile, uint32_t frameTiles, bool preview) {
+    auto& wFrame = frame.getExtFrame<WindowFrame>();
+    assert(wavefrontCapacity >= wFrame.width * wFrame.height && "Wavefront queues were not sized for this frame");
+    const VkCommandBuffer cmdBuffer = frame.cmdBuffer;
+
+    const uint32_t handleSizeAligned = vks::tools::alignedSize(rayTracingPipelineProperties.shaderGroupHandleSize, rayTracingPipelineProperties.shaderGroupHandleAlignment);
+    auto region = [&](const Buffer& table) {
+        return VkStridedDeviceAddressRegionKHR { getBufferDeviceAddress(table.buffer), handleSizeAligned, handleSizeAligned };
+    };
+    const VkStridedDeviceAddressRegionKHR missRegion = region(missShaderBindingTable);
+    const VkStridedDeviceAddressRegionKHR hitRegion = region(hitShaderBindingTable);
+    const VkStridedDeviceAddressRegionKHR callableRegion{};
+    const uint64_t headerAddress = getBufferDeviceAddress(wavefrontQueueHeaders.buffer);
+
+    auto trace = [&](RaygenGroup group, uint32_t width, uint32_t height, uint32_t depth) {
+        const VkStridedDeviceAddressRegionKHR raygenRegion = region(raygenShaderBindingTables[group]);
+        vkCmdTraceRaysKHR(cmdBuffer, &raygenRegion, &missRegion, &hitRegion, &callableRegion, width, height, depth);
+    };
+    // Width is whatever the previous stage pushed into the queue
+    auto traceQueue = [&](RaygenGroup group, uint32_t queue) {
+        const VkStridedDeviceAddressRegionKHR raygenRegion = region(raygenShaderBindingTables[group]);
+        vkCmdTraceRaysIndirectKHR(cmdBuffer, &raygenRegion, &missRegion, &hitRegion, &callableRegion, headerAddress + queue * sizeof(WavefrontQueueHeader));
+    };
+
+    const VkPipelineStageFlags traceStages = VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR | VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT;
+    const VkAccessFlags traceAccess = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
+    auto stageBarrier = [&]() { memory_barrier(cmdBuffer, traceStages, traceAccess, traceStages, traceAccess); };
+
+    // Earlier frames may still be working through the queues
+    memory_barrier(cmdBuffer, traceStages | VK_PIPELINE_STAGE_TRANSFER_BIT, traceAccess | VK_ACCESS_TRANSFER_WRITE_BIT, traceStages, traceAccess);
+
+    const uint32_t nrSamples = preview ? 1 : std::min(info.maxSamplesPerFrame, 255u);
+    // Same as getPathDepth in pathtracer.glsl
+    const uint32_t depth = preview ? 2 : 16;
+    const bool sort = info.rayReordering == RayReordering::Sort;
+    glm::vec3 boundsMin, boundsMax;
+    getSceneBounds(boundsMin, boundsMax);
+    RayTracerConstants constants = coherence_constants(boundsMin, boundsMax);
+    constants.capacity = wavefrontCapacity;
+    constants.sorted = sort ? 1 : 0;
+    constants.firstTile = firstTile;
+    constants.tileSize = info.tileSize;
+    uint32_t rayQueue = 0;
+
+    for(uint32_t sampleIdx=0; sampleIdx<nrSamples; sampleIdx++) {
+        constants.sampleIdx = sampleIdx;
+        constants.rayQueue = rayQueue;
+        vkCmdPushConstants(cmdBuffer, pipelineLayout, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 0, sizeof(RayTracerConstants), &constants);
+        trace(WavefrontGenerate, info.tileSize, info.tileSize, frameTiles);
+        stageBarrier();
+
+        for(uint32_t bounce=0; bounce<depth; bounce++) {
+            constants.rayQueue = rayQueue;
+            vkCmdPushConstants(cmdBuffer, pipelineLayout, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 0, sizeof(RayTracerConstants), &constants);
+            // Everything is launched indirectly, so once the paths died out a bounce costs its barriers only
+            if (sort) {
+                // Counting sort into the third queue, extend and shade then read that one
+                traceQueue(WavefrontSortCount, rayQueue);
+                stageBarrier();
+                traceQueue(WavefrontSortBlocks, sortBlocksLaunch);
+                stageBarrier();
+                traceQueue(WavefrontSortScan, sortScanLaunch);
+                stageBarrier();
+                traceQueue(WavefrontSortScatter, rayQueue);
+                stageBarrier();
+            }
+            traceQueue(WavefrontExtend, rayQueue);
+            stageBarrier();
+            traceQueue(WavefrontShade, rayQueue);
+            stageBarrier();
+            traceQueue(WavefrontShadow, shadowQueue);
+
+            // The queues just consumed start empty for the next bounce
+            memory_barrier(cmdBuffer, traceStages, traceAccess, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+            vkCmdFillBuffer(cmdBuffer, wavefrontQueueHeaders.buffer, rayQueue * sizeof(WavefrontQueueHeader), sizeof(uint32_t), 0);
+            vkCmdFillBuffer(cmdBuffer, wavefrontQueueHeaders.buffer, shadowQueue * sizeof(WavefrontQueueHeader), sizeof(uint32_t), 0);
+            if (sort) {
+                vkCmdFillBuffer(cmdBuffer, wavefrontQueueHeaders.buffer, sortBlocksLaunch * sizeof(WavefrontQueueHeader), sizeof(uint32_t), 0);
+                vkCmdFillBuffer(cmdBuffer, wavefrontQueueHeaders.buffer, sortScanLaunch * sizeof(WavefrontQueueHeader), sizeof(uint32_t), 0);
+                vkCmdFillBuffer(cmdBuffer, wavefrontSortBins.buffer, 0, sortBins * sizeof(uint32_t), 0);
+            }
+            memory_barrier(cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT | traceStages, VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_SHADER_WRITE_BIT, traceStages, traceAccess);
+            rayQueue = 1 - rayQueue;
+        }
+    }
+
+    trace(WavefrontResolve, info.tileSize, info.tileSize, frameTiles);
+}
+
+void RayTracer::getSceneBounds(glm::vec3& boundsMin, glm::vec3& boundsMax) const {
+    boundsMin = glm::vec3(std::numeric_limits<float>::max());
+    boundsMax = glm::vec3(std::numeric_limits<float>::lowest());
+    for(const auto& instance : instances) {
+        if (!instance.has_value()) continue;
+        const auto& bounds = meshBounds[instance->meshIdx];
+        for(uint32_t corner=0; corner<8; corner++) {
+            const glm::vec3 p((corner & 1) ? bounds[1].x : bounds[0].x, (corner & 2) ? bounds[1].y : bounds[0].y, (corner & 4) ? bounds[1].z : bounds[0].z);
+            const glm::vec3 world = glm::vec3(instance->transform * glm::vec4(p, 1.0f));
+            boundsMin = glm::min(boundsMin, world);
+            boundsMax = glm::max(boundsMax, world);
+        }
+    }
+    if (boundsMin.x > boundsMax.x) {
+        boundsMin = boundsMax = glm::vec3(0.0f);
+    }
+}
+
+uint64_t RayTracer::takeWavefrontRayCount() {
+    if (wavefrontCapacity == 0) return 0;
+
+    Buffer readback;
+    buffertools::create_buffer_H(ctx, VK_BUFFER_USAGE_TRANSFER_DST_BIT, 3 * sizeof(WavefrontQueueHeader), &readback);
+
+    // Submitted after every frame recorded so far, the barrier makes their counts visible
+    auto cmdBuffer = ctx.singleTimeCommandBuffer();
+    memory_barrier(cmdBuffer, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT);
+    VkBufferCopy region { 0, 0, 3 * sizeof(WavefrontQueueHeader) };
+    vkCmdCopyBuffer(cmdBuffer, wavefrontQueueHeaders.buffer, readback.buffer, 1, &region);
+    memory_barrier(cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+    for(uint32_t queue=0; queue<3; queue++) {
+        vkCmdFillBuffer(cmdBuffer, wavefrontQueueHeaders.buffer, queue * sizeof(WavefrontQueueHeader) + offsetof(WavefrontQueueHeader, traced), sizeof(uint32_t), 0);
+    }
+    ctx.endSingleTimeCommands(cmdBuffer);
+
+    void* data;
+    vkCheck(vmaMapMemory(ctx.vmaAllocator, readback.memory, &data));
+    uint64_t ret = 0;
+    for(uint32_t queue=0; queue<3; queue++) {
+        ret += reinterpret_cast<const WavefrontQueueHeader*>(data)[queue].traced;
+    }
+    vmaUnmapMemory(ctx.vmaAllocator, readback.memory);
+    buffertools::destroyBuffer(ctx, readback);
+    return ret;
+}
+
+void RayTracer::computeSampleBudget(FrameContext& frame) {
+    // The tracer wrote the accumulator and moments, the budget pass reads them
+    auto barrier = vks::initializers::memoryBarrier();
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    vkCmdPipelineBarrier(frame.cmdBuffer, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+        0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+    SampleBudgetConstants constants {
+        .threshold = info.varianceThreshold,
+        .minSamples = info.minSamples,
+        .maxSamples = std::min(info.maxSamplesPerFrame, 255u),
+        .accumulationMode = static_cast<uint32_t>(info.accumulationMode),
+    };
+    vkCmdBindPipeline(frame.cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, budgetPipeline);
+    vkCmdBindDescriptorSets(frame.cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, budgetPipelineLayout, 0, 1, &budgetDescriptorSet, 0, nullptr);
+    vkCmdPushConstants(frame.cmdBuffer, budgetPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(SampleBudgetConstants), &constants);
+    vkCmdDispatch(frame.cmdBuffer, (samplingWidth + 15) / 16, (samplingHeight + 15) / 16, 1);
+
+    // The next trace reads the budget
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    vkCmdPipelineBarrier(frame.cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+        0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+void RayTracer::choosePackings() {
+    VkFormatProperties snormProperties;
+    vkGetPhysicalDeviceFormatProperties(ctx.vkPhysicalDevice, VK_FORMAT_R16G16B16A16_SNORM, &snormProperties);
+    const bool allowSnorm16 = info.maxQuantizationError > 0.0f
+        && (snormProperties.bufferFeatures & VK_FORMAT_FEATURE_ACCELERATION_STRUCTURE_VERTEX_BUFFER_BIT_KHR);
+
+    VkDeviceSize vertexBytes = 0;
+    VkDeviceSize indexBytes = 0;
+    VkDeviceSize unpackedBytes = 0;
+    for(uint32_t meshIdx=0; meshIdx<info.meshes.size(); meshIdx++) {
+        const Mesh* mesh = info.meshes[meshIdx];
+        const MeshPacking packing = mesh->choosePacking(info.maxQuantizationError, allowSnorm16);
+        meshPackings.push_back(packing);
+        auto& bounds = meshBounds.emplace_back();
+        mesh->computeBounds(bounds[0], bounds[1]);
+
+        // Geometry inputs need their components aligned, 16 covers every format
+        vertexOffsets.push_back(vertexBytes);
+        indexOffsets.push_back(indexBytes);
+        vertexBytes += alignUp(mesh->vertices.size() * packing.getVertexStride(), 16);
+        indexBytes += alignUp(mesh->indices.size() * packing.getIndexSize(), 16);
+        unpackedBytes += mesh->vertices.size() * sizeof(Vertex) + mesh->indices.size() * sizeof(uint32_t);
+
+        logger::debug("Mesh {} uses vertex format {} and {} bit indices", meshIdx, static_cast<int>(packing.getVkFormat()), packing.getIndexSize() * 8);
+    }
+    vertexBufferSize = vertexBytes;
+    indexBufferSize = indexBytes;
+
+    const float toMB = 1.0f / (1024.0f * 1024.0f);
+    logger::info("Packed geometry takes {:.2f}MB instead of {:.2f}MB, saving {:.0f}%", (vertexBytes + indexBytes) * toMB, unpackedBytes * toMB,
+        unpackedBytes > 0 ? 100.0f * (1.0f - static_cast<float>(vertexBytes + indexBytes) / unpackedBytes) : 0.0f);
+}
+
 void RayTracer::createBottomLevelAccelerationStructures() {
-    uint32_t totalVertices = 0;
     uint32_t totalIndices = 0;
 
     for (auto& mesh : info.meshes) {
         triangleDataOffsets.push_back(totalIndices/3);
-        totalVertices += mesh->vertices.size();
         totalIndices += mesh->indices.size();
     }
+    choosePackings();
 
-    std::vector<Vertex> allVertices(totalVertices);
-    std::vector<uint32_t> allIndices(totalIndices);
-    std::vector<TriangleData> allTriangleData(totalIndices/3);
-    std::vector<uint32_t> emissiveTriangles;
-    emissiveTriangles.push_back(0);
+    std::vector<TriangleAttributes> triangleAttributes(totalIndices/3);
 
+    // The second mesh is the emitter, this stands in until meshes carry their own materials
+    const std::array<RayTracerMaterial, 2> materials {
+        RayTracerMaterial { .albedo = glm::vec4(0.4f), .emission = glm::vec4(0.0f) },
+        RayTracerMaterial { .albedo = glm::vec4(0.4f), .emission = glm::vec4(5.0f, 5.0f, 15.0f, 0.0f) },
+    };
+    meshHasEmitters.assign(info.meshes.size(), false);
 
-    uint32_t vertexBufferOffset = 0;
     uint32_t indexBufferOffset = 0;
-    uint32_t transformBufferOffset = 0;
     uint32_t modelIdx = 0;
     for (const auto& model : info.meshes) {
-        memcpy(allVertices.data() + vertexBufferOffset, model->vertices.data(), model->vertices.size() * sizeof(Vertex));
-        memcpy(allIndices.data() + indexBufferOffset, model->indices.data(), model->indices.size() * sizeof(uint32_t));
         assert(model->normals.size() == model->indices.size());
-        for(uint32_t i=0; i<model->indices.size(); i+=3) {
-            TriangleData triangleData{};
-            triangleData.vertices[0] = model->vertices[model->indices[i+0]].v;
-            triangleData.vertices[1] = model->vertices[model->indices[i+1]].v;
-            triangleData.vertices[2] = model->vertices[model->indices[i+2]].v;
-
-            if (modelIdx == 1) {
-                triangleData.vertices[0].w = 5.0f;
-                triangleData.vertices[1].w = 5.0f;
-                triangleData.vertices[2].w = 15.0f;
-                emissiveTriangles.push_back(indexBufferOffset/3 + i/3);
+        const uint32_t material = modelIdx == 1 ? 1 : 0;
+        const uint32_t firstTriangle = indexBufferOffset/3;
+        const size_t nrTriangles = model->indices.size()/3;
+
+        ThreadPool::shared().parallelFor(nrTriangles, 16 * 1024, [&](size_t begin, size_t end) {
+            for(size_t t=begin; t<end; t++) {
+                const glm::vec3 v0(model->vertices[model->indices[3*t+0]].v);
+                const glm::vec3 v1(model->vertices[model->indices[3*t+1]].v);
+                const glm::vec3 v2(model->vertices[model->indices[3*t+2]].v);
+                triangleAttributes[firstTriangle + t] = TriangleAttributes {
+                    .normal = encode_octahedral(glm::cross(v1 - v0, v2 - v0)),
+                    .material = material,
+                };
             }
-
-            allTriangleData[indexBufferOffset/3 + i/3] = triangleData;
+        });
+
+        // Emitters keep their positions on the CPU, the light samplers need them in world space
+        const glm::vec4 emission = materials[material].emission;
+        meshEmitterRanges.push_back({ static_cast<uint32_t>(emissiveObjectTriangles.size()), 0 });
+        if (max3(glm::vec3(emission)) > 0.0f) {
+            for(uint32_t t=0; t<nrTriangles; t++) {
+                TriangleData triangleData{};
+                for(uint32_t k=0; k<3; k++) {
+                    triangleData.vertices[k] = glm::vec4(glm::vec3(model->vertices[model->indices[3*t+k]].v), emission[k]);
+                }
+                emissiveObjectTriangles.push_back(triangleData);
+            }
+            meshEmitterRanges.back().second = static_cast<uint32_t>(nrTriangles);
+            meshHasEmitters[modelIdx] = true;
         }
-        vertexBufferOffset += model->vertices.size();
         indexBufferOffset += model->indices.size();
         modelIdx++;
     }
 
-    emissiveTriangles[0] = emissiveTriangles.size() - 1;
-
-    // Must be identity for NEE to know where the triangles are
-    VkTransformMatrixKHR transformMatrix = {
-        1.0f, 0.0f, 0.0f, 0.0f,
-        0.0f, 1.0f, 0.0f, 0.0f,
-        0.0f, 0.0f, 1.0f, 0.0f,
-    };
-
-    std::vector<VkTransformMatrixKHR> allTransforms(info.meshes.size(), transformMatrix);
+    // Only undo quantization, NEE and the triangle attributes assume object space is the mesh's own
+    std::vector<VkTransformMatrixKHR> allTransforms(info.meshes.size());
+    for(uint32_t meshIdx=0; meshIdx<info.meshes.size(); meshIdx++) {
+        const auto dequantization = meshPackings[meshIdx].getDequantization();
+        memcpy(&allTransforms[meshIdx], dequantization.data(), sizeof(VkTransformMatrixKHR));
+    }
 
     const VkBufferUsageFlags bufferUsage = VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR;
-    buffertools::create_buffer_D_data(ctx, bufferUsage | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, allVertices.size() * sizeof(Vertex), allVertices.data(), &vertexBuffer);
-    buffertools::create_buffer_D_data(ctx, bufferUsage | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, allIndices.size() * sizeof(uint32_t), allIndices.data(), &indexBuffer);
-    buffertools::create_buffer_D_data(ctx, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, allTriangleData.size() * sizeof(TriangleData), allTriangleData.data(), &triangleDataBuffer);
-    buffertools::create_buffer_D_data(ctx, bufferUsage, allTransforms.size() * sizeof(VkTransformMatrixKHR), allTransforms.data(), &transformBuffer);
-    buffertools::create_buffer_D_data(ctx, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, emissiveTriangles.size() * sizeof(uint32_t), emissiveTriangles.data(), &emissiveTriangleBuffer);
-
-    VkDeviceOrHostAddressConstKHR vertexBufferDeviceAddress{};
-    VkDeviceOrHostAddressConstKHR indexBufferDeviceAddress{};
+    // Mesh spans may point into a mapped cache, copy them straight into staging. All uploads share one submission
+    buffertools::create_buffer_D_fill_async(ctx, bufferUsage, std::max<VkDeviceSize>(vertexBufferSize, 16), [&](void* dst) {
+        for(uint32_t meshIdx=0; meshIdx<info.meshes.size(); meshIdx++) {
+            info.meshes[meshIdx]->packVertices(meshPackings[meshIdx], static_cast<char*>(dst) + vertexOffsets[meshIdx]);
+        }
+    }, &vertexBuffer);
+    buffertools::create_buffer_D_fill_async(ctx, bufferUsage, std::max<VkDeviceSize>(indexBufferSize, 16), [&](void* dst) {
+        for(uint32_t meshIdx=0; meshIdx<info.meshes.size(); meshIdx++) {
+            info.meshes[meshIdx]->packIndices(meshPackings[meshIdx], static_cast<char*>(dst) + indexOffsets[meshIdx]);
+        }
+    }, &indexBuffer);
+    buffertools::create_buffer_D_data_async(ctx, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, triangleAttributes.size() * sizeof(TriangleAttributes), triangleAttributes.data(), &triangleAttributeBuffer);
+    buffertools::create_buffer_D_data_async(ctx, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, materials.size() * sizeof(RayTracerMaterial), materials.data(), &materialBuffer);
+    logger::debug("Triangle attributes take {:.1f}MB, {} bytes per triangle", triangleAttributes.size() * sizeof(TriangleAttributes) / (1024.0f * 1024.0f), sizeof(TriangleAttributes));
+    const UploadToken uploaded = buffertools::create_buffer_D_data_async(ctx, bufferUsage, allTransforms.size() * sizeof(VkTransformMatrixKHR), allTransforms.data(), &transformBuffer);
+    ctx.uploadManager->wait(uploaded);
+
+    const uint64_t vertexBufferAddress = getBufferDeviceAddress(vertexBuffer.buffer);
+    const uint64_t indexBufferAddress = getBufferDeviceAddress(indexBuffer.buffer);
     VkDeviceOrHostAddressConstKHR transformBufferDeviceAddress{};
-
-    vertexBufferDeviceAddress.deviceAddress = getBufferDeviceAddress(vertexBuffer.buffer);
-    indexBufferDeviceAddress.deviceAddress = getBufferDeviceAddress(indexBuffer.buffer);
     transformBufferDeviceAddress.deviceAddress = getBufferDeviceAddress(transformBuffer.buffer);
 
-    vertexBufferOffset = 0;
-    indexBufferOffset = 0;
+    std::vector<BottomLevelBuild> builds;
+    uint32_t transformBufferOffset = 0;
+    modelIdx = 0;
     for(const auto& model : info.meshes) {
-        // The actual build
+        const MeshPacking& packing = meshPackings[modelIdx];
+        // Strides differ between meshes, so every mesh gets its own base address instead of firstVertex
+        VkDeviceOrHostAddressConstKHR vertexDeviceAddress{};
+        vertexDeviceAddress.deviceAddress = vertexBufferAddress + vertexOffsets[modelIdx];
+        VkDeviceOrHostAddressConstKHR indexDeviceAddress{};
+        indexDeviceAddress.deviceAddress = indexBufferAddress + indexOffsets[modelIdx];
+
         VkAccelerationStructureGeometryTrianglesDataKHR triangleData {
             .sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_TRIANGLES_DATA_KHR,
-            .vertexFormat = VK_FORMAT_R32G32B32A32_SFLOAT,
-            .vertexData = vertexBufferDeviceAddress,
-            .vertexStride = sizeof(Vertex),
-            // TODO: why does this not seem to matter?
-            .maxVertex = static_cast<uint32_t>(vertexBufferOffset + model->vertices.size()),
-            .indexType = VK_INDEX_TYPE_UINT32,
-            .indexData = indexBufferDeviceAddress,
+            .vertexFormat = packing.getVkFormat(),
+            .vertexData = vertexDeviceAddress,
+            .vertexStride = packing.getVertexStride(),
+            .maxVertex = static_cast<uint32_t>(std::max<size_t>(model->vertices.size(), 1) - 1),
+            .indexType = packing.indexType,
+            .indexData = indexDeviceAddress,
             .transformData = transformBufferDeviceAddress,
         };
-        
-
-        VkAccelerationStructureGeometryKHR accelerationStructureGeometry{};
-        accelerationStructureGeometry.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
-        accelerationStructureGeometry.flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
-        accelerationStructureGeometry.geometryType = VK_GEOMETRY_TYPE_TRIANGLES_KHR;
-        accelerationStructureGeometry.geometry.triangles = triangleData;
-
-        VkAccelerationStructureBuildGeometryInfoKHR accelerationStructureBuildGeometryInfo{};
-        accelerationStructureBuildGeometryInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
-        accelerationStructureBuildGeometryInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
-        accelerationStructureBuildGeometryInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
-        accelerationStructureBuildGeometryInfo.geometryCount = 1;
-        accelerationStructureBuildGeometryInfo.pGeometries = &accelerationStructureGeometry;
-
-        const uint32_t numTriangles = model->indices.size() / 3;
-        VkAccelerationStructureBuildSizesInfoKHR accelerationStructureBuildSizesInfo{};
-        accelerationStructureBuildSizesInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
-        vkGetAccelerationStructureBuildSizesKHR(ctx.vkDevice, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &accelerationStructureBuildGeometryInfo, &numTriangles, &accelerationStructureBuildSizesInfo);
-
-        bottomACs.push_back(createAccelerationStructureBuffer(accelerationStructureBuildSizesInfo));
+
+        BottomLevelBuild build{};
+        build.geometry.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
+        build.geometry.flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
+        build.geometry.geometryType = VK_GEOMETRY_TYPE_TRIANGLES_KHR;
+        build.geometry.geometry.triangles = triangleData;
+        build.flags = getBuildFlags(info.getBuildPolicy(modelIdx));
+        if (info.compactAccelerationStructures) {
+            build.flags |= VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR;
+        }
+        build.range.primitiveCount = static_cast<uint32_t>(model->indices.size() / 3);
+        build.range.primitiveOffset = 0;
+        build.range.firstVertex = 0;
+        build.range.transformOffset = transformBufferOffset * sizeof(VkTransformMatrixKHR);
+        builds.push_back(build);
+
+        transformBufferOffset += 1;
+        modelIdx++;
+    }
+
+    buildBottomLevelBatch(builds);
+}
+
+void RayTracer::buildBottomLevelBatch(const std::vector<BottomLevelBuild>& builds) {
+    const VkDeviceSize scratchAlignment = accelerationStructureProperties.minAccelerationStructureScratchOffsetAlignment;
+    const size_t firstAC = bottomACs.size();
+
+    std::vector<VkAccelerationStructureBuildGeometryInfoKHR> buildInfos(builds.size());
+    std::vector<VkDeviceSize> scratchSizes(builds.size());
+
+    // Create all the acceleration structures up front so their sizes are known
+    for(size_t i=0; i<builds.size(); i++) {
+        auto& buildInfo = buildInfos[i];
+        buildInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
+        buildInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+        buildInfo.flags = builds[i].flags;
+        buildInfo.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+        buildInfo.geometryCount = 1;
+        buildInfo.pGeometries = &builds[i].geometry;
+
+        const uint32_t numTriangles = builds[i].range.primitiveCount;
+        VkAccelerationStructureBuildSizesInfoKHR buildSizesInfo{};
+        buildSizesInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
+        vkGetAccelerationStructureBuildSizesKHR(ctx.vkDevice, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &buildInfo, &numTriangles, &buildSizesInfo);
+
+        bottomACs.push_back(createAccelerationStructure(VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR, buildSizesInfo.accelerationStructureSize));
         auto& bottomAC = bottomACs.back();
 
-        VkAccelerationStructureCreateInfoKHR accelerationStructureCreateInfo{};
-        accelerationStructureCreateInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR;
-        accelerationStructureCreateInfo.buffer = bottomAC.buffer;
-        accelerationStructureCreateInfo.size = accelerationStructureBuildSizesInfo.accelerationStructureSize;
-        accelerationStructureCreateInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
-        vkCheck(vkCreateAccelerationStructureKHR(ctx.vkDevice, &accelerationStructureCreateInfo, nullptr, &bottomAC.AShandle));
+        buildInfo.dstAccelerationStructure = bottomAC.AShandle;
+        scratchSizes[i] = alignUp(buildSizesInfo.buildScratchSize, scratchAlignment);
+    }
+
+    uint32_t nrBatches = 0;
+    size_t batchBegin = 0;
+    while(batchBegin < builds.size()) {
+        // Grow the batch until the scratch budget is spent, a single oversized build gets a batch of its own
+        size_t batchEnd = batchBegin;
+        VkDeviceSize scratchTotal = 0;
+        while(batchEnd < builds.size() && (batchEnd == batchBegin || scratchTotal + scratchSizes[batchEnd] <= maxBatchScratchSize)) {
+            scratchTotal += scratchSizes[batchEnd];
+            batchEnd++;
+        }
 
-        auto scratchBuffer = createScratchBuffer(accelerationStructureBuildSizesInfo.buildScratchSize);
+        // One arena for the whole batch, every build gets its own aligned slice
+        auto scratchArena = createScratchBuffer(scratchTotal + scratchAlignment);
+        VkDeviceAddress scratchAddress = alignUp(getBufferDeviceAddress(scratchArena.buffer), scratchAlignment);
 
-        accelerationStructureBuildGeometryInfo.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
-        accelerationStructureBuildGeometryInfo.dstAccelerationStructure = bottomAC.AShandle;
-        accelerationStructureBuildGeometryInfo.scratchData.deviceAddress = getBufferDeviceAddress(scratchBuffer.buffer);
+        std::vector<const VkAccelerationStructureBuildRangeInfoKHR*> rangeInfoPtrs;
+        for(size_t i=batchBegin; i<batchEnd; i++) {
+            buildInfos[i].scratchData.deviceAddress = scratchAddress;
+            scratchAddress += scratchSizes[i];
+            rangeInfoPtrs.push_back(&builds[i].range);
+        }
 
-        VkAccelerationStructureBuildRangeInfoKHR accelerationStructureBuildRangeInfo{};
-        accelerationStructureBuildRangeInfo.primitiveCount = numTriangles;
-        accelerationStructureBuildRangeInfo.primitiveOffset = indexBufferOffset * sizeof(uint32_t);
-        accelerationStructureBuildRangeInfo.firstVertex = vertexBufferOffset;
-        accelerationStructureBuildRangeInfo.transformOffset = transformBufferOffset * sizeof(VkTransformMatrixKHR);
+        std::vector<size_t> compactIndices;
+        std::vector<VkAccelerationStructureKHR> compactHandles;
+        for(size_t i=batchBegin; i<batchEnd; i++) {
+            if (builds[i].flags & VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR) {
+                compactIndices.push_back(firstAC + i);
+                compactHandles.push_back(bottomACs[firstAC + i].AShandle);
+            }
+        }
 
-        auto rangeInfoPtr = &accelerationStructureBuildRangeInfo;
+        VkQueryPool queryPool = VK_NULL_HANDLE;
+        if (!compactIndices.empty()) {
+            VkQueryPoolCreateInfo queryPoolInfo {
+                .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+                .queryType = VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR,
+                .queryCount = static_cast<uint32_t>(compactIndices.size()),
+            };
+            vkCheck(vkCreateQueryPool(ctx.vkDevice, &queryPoolInfo, nullptr, &queryPool));
+        }
 
         auto cmdBuffer = ctx.singleTimeCommandBuffer();
-        vkCmdBuildAccelerationStructuresKHR(cmdBuffer, 1, &accelerationStructureBuildGeometryInfo, &rangeInfoPtr);
+        if (queryPool != VK_NULL_HANDLE) {
+            vkCmdResetQueryPool(cmdBuffer, queryPool, 0, static_cast<uint32_t>(compactIndices.size()));
+        }
 
-        VkAccelerationStructureDeviceAddressInfoKHR accelerationDeviceAddressInfo{};
-        accelerationDeviceAddressInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR;
-        accelerationDeviceAddressInfo.accelerationStructure = bottomAC.AShandle;
-        bottomAC.deviceAddress = vkGetAccelerationStructureDeviceAddressKHR(ctx.vkDevice, &accelerationDeviceAddressInfo);
+        vkCmdBuildAccelerationStructuresKHR(cmdBuffer, static_cast<uint32_t>(batchEnd - batchBegin), buildInfos.data() + batchBegin, rangeInfoPtrs.data());
+
+        if (queryPool != VK_NULL_HANDLE) {
+            // The compacted size can only be queried once the builds are done
+            auto barrier = vks::initializers::memoryBarrier();
+            barrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+            barrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
+            vkCmdPipelineBarrier(
+                    cmdBuffer,
+                    VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                    VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                    0,
+                    1, &barrier,
+                    0, nullptr,
+                    0, nullptr);
+            vkCmdWriteAccelerationStructuresPropertiesKHR(cmdBuffer, static_cast<uint32_t>(compactHandles.size()), compactHandles.data(), VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR, queryPool, 0);
+        }
         ctx.endSingleTimeCommands(cmdBuffer);
 
-        buffertools::destroyBuffer(ctx, scratchBuffer);
-        vertexBufferOffset += model->vertices.size();
-        indexBufferOffset += model->indices.size();
-        transformBufferOffset += 1;
+        // Release the scratch before allocating the compacted copies to keep the peak down
+        buffertools::destroyBuffer(ctx, scratchArena);
+
+        if (queryPool != VK_NULL_HANDLE) {
+            compactBottomLevel(compactIndices, queryPool);
+            vkDestroyQueryPool(ctx.vkDevice, queryPool, nullptr);
+        }
+
+        batchBegin = batchEnd;
+        nrBatches++;
     }
+
+    logger::debug("Built {} bottom level acceleration structures in {} batch(es)", bottomACs.size() - firstAC, nrBatches);
 }
 
-void RayTracer::createTopLevelAccelerationStructure() {
-    VkTransformMatrixKHR transformMatrix {
-        1.0f, 0.0f, 0.0f, 0.0f,
-        0.0f, 1.0f, 0.0f, 0.0f,
-        0.0f, 0.0f, 1.0f, 0.0f,
-    };
+void RayTracer::compactBottomLevel(const std::vector<size_t>& acIndices, VkQueryPool compactedSizes) {
+    const auto count = static_cast<uint32_t>(acIndices.size());
+    std::vector<VkDeviceSize> sizes(count);
+    vkCheck(vkGetQueryPoolResults(ctx.vkDevice, compactedSizes, 0, count, count * sizeof(VkDeviceSize), sizes.data(), sizeof(VkDeviceSize), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT));
 
-    std::vector<VkAccelerationStructureInstanceKHR> instances;
-    for(uint32_t i=0; i<bottomACs.size(); i++) {
-        const auto& bottomAC = bottomACs[i];
-        VkAccelerationStructureInstanceKHR instance{};
-        instance.transform = transformMatrix;
-        instance.instanceCustomIndex = triangleDataOffsets[i];
-        instance.mask = 0xFF;
-        instance.instanceShaderBindingTableRecordOffset = 0;
-        instance.flags = VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR;
-        instance.accelerationStructureReference = bottomAC.deviceAddress;
-        instances.push_back(instance);
-    }
-
-    Buffer instanceBuffer;
-    const VkBufferUsageFlags usage = VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT_KHR | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR;
-    buffertools::create_buffer_D_data(ctx, usage, instances.size() * sizeof(VkAccelerationStructureInstanceKHR), instances.data(), &instanceBuffer);
+    std::vector<AccelerationStructure> compacted;
+    auto cmdBuffer = ctx.singleTimeCommandBuffer();
+    for(uint32_t i=0; i<count; i++) {
+        compacted.push_back(createAccelerationStructure(VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR, sizes[i]));
+
+        VkCopyAccelerationStructureInfoKHR copyInfo {
+            .sType = VK_STRUCTURE_TYPE_COPY_ACCELERATION_STRUCTURE_INFO_KHR,
+            .src = bottomACs[acIndices[i]].AShandle,
+            .dst = compacted.back().AShandle,
+            .mode = VK_COPY_ACCELERATION_STRUCTURE_MODE_COMPACT_KHR,
+        };
+        vkCmdCopyAccelerationStructureKHR(cmdBuffer, &copyInfo);
+    }
+    ctx.endSingleTimeCommands(cmdBuffer);
 
-    VkDeviceOrHostAddressConstKHR instanceDataDeviceAddress{};
-    instanceDataDeviceAddress.deviceAddress = getBufferDeviceAddress(instanceBuffer.buffer);
+    VkDeviceSize totalSaved = 0;
+    for(uint32_t i=0; i<count; i++) {
+        auto& original = bottomACs[acIndices[i]];
+        const VkDeviceSize saved = original.size - compacted[i].size;
+        logger::info("Compacted BLAS of mesh {} from {} to {} bytes, saved {} bytes", acIndices[i], original.size, compacted[i].size, saved);
+        totalSaved += saved;
+
+        destroyAccelerationStructure(original);
+        original = compacted[i];
+    }
+
+    logger::info("Compaction saved {} bytes over {} bottom level structures", totalSaved, count);
+}
+
+VkBuildAccelerationStructureFlagsKHR RayTracer::getTopLevelFlags() const {
+    // Always updatable, instances are expected to move
+    return getBuildFlags(info.topLevelPolicy) | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR;
+}
+
+VkAccelerationStructureGeometryKHR RayTracer::getTopLevelGeometry(const RayTracerFrame& rFrame) const {
+    VkAccelerationStructureGeometryKHR geometry{};
+    geometry.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
+    geometry.geometryType = VK_GEOMETRY_TYPE_INSTANCES_KHR;
+    geometry.flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
+    geometry.geometry.instances.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR;
+    geometry.geometry.instances.arrayOfPointers = VK_FALSE;
+    geometry.geometry.instances.data.deviceAddress = getBufferDeviceAddress(rFrame.instanceBuffer.buffer);
+    return geometry;
+}
 
-    VkAccelerationStructureGeometryKHR accelerationStructureGeometry {};
-    accelerationStructureGeometry.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
-    accelerationStructureGeometry.geometryType = VK_GEOMETRY_TYPE_INSTANCES_KHR;
-    accelerationStructureGeometry.flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
-    accelerationStructureGeometry.geometry.instances.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR;
-    accelerationStructureGeometry.geometry.instances.arrayOfPointers = VK_FALSE;
-    accelerationStructureGeometry.geometry.instances.data = instanceDataDeviceAddress;
+void RayTracer::createTopLevelAccelerationStructure(RayTracerFrame& rFrame, uint32_t capacity) {
+    rFrame.instanceCapacity = capacity;
 
-    // Get the size info
+    // Persistently mapped, instances are written straight into it every time they change
+    const VkBufferUsageFlags usage = VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT_KHR | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR;
+    buffertools::create_buffer_H2D(ctx, usage, capacity * sizeof(VkAccelerationStructureInstanceKHR), &rFrame.instanceBuffer);
+    vkCheck(vmaMapMemory(ctx.vmaAllocator, rFrame.instanceBuffer.memory, &rFrame.instanceBuffer.data));
+
+    auto geometry = getTopLevelGeometry(rFrame);
     VkAccelerationStructureBuildGeometryInfoKHR buildInfo{};
     buildInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
     buildInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
-    buildInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
+    buildInfo.flags = getTopLevelFlags();
     buildInfo.geometryCount = 1;
-    buildInfo.pGeometries = &accelerationStructureGeometry;
-
-    uint32_t primitiveCount = instances.size();
+    buildInfo.pGeometries = &geometry;
 
     VkAccelerationStructureBuildSizesInfoKHR buildSizesInfo{};
     buildSizesInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
-    vkGetAccelerationStructureBuildSizesKHR(ctx.vkDevice, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &buildInfo, &primitiveCount, &buildSizesInfo);
-
-    topAC = createAccelerationStructureBuffer(buildSizesInfo);
-
-    VkAccelerationStructureCreateInfoKHR ASInfo{};
-    ASInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR;
-    ASInfo.buffer = topAC.buffer;
-    ASInfo.size = buildSizesInfo.accelerationStructureSize;
-    ASInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
-    vkCheck(vkCreateAccelerationStructureKHR(ctx.vkDevice, &ASInfo, nullptr, &topAC.AShandle));
-
-    auto scratchBuffer = createScratchBuffer(buildSizesInfo.buildScratchSize);
-
-    buildInfo.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
-    buildInfo.dstAccelerationStructure = topAC.AShandle;
-    buildInfo.scratchData.deviceAddress = getBufferDeviceAddress(scratchBuffer.buffer);
- 
-    VkAccelerationStructureBuildRangeInfoKHR accelerationStructureBuildRangeInfo{};
-    accelerationStructureBuildRangeInfo.primitiveCount = instances.size();
-    accelerationStructureBuildRangeInfo.primitiveOffset = 0;
-    accelerationStructureBuildRangeInfo.firstVertex = 0;
-    accelerationStructureBuildRangeInfo.transformOffset = 0;
-    VkAccelerationStructureBuildRangeInfoKHR* buildRangeInfoPtr = &accelerationStructureBuildRangeInfo;
+    vkGetAccelerationStructureBuildSizesKHR(ctx.vkDevice, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &buildInfo, &capacity, &buildSizesInfo);
 
-    auto cmdBuffer = ctx.singleTimeCommandBuffer();
-    vkCmdBuildAccelerationStructuresKHR(cmdBuffer, 1, &buildInfo, &buildRangeInfoPtr);
-    ctx.endSingleTimeCommands(cmdBuffer);
+    rFrame.topAC = createAccelerationStructure(VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR, buildSizesInfo.accelerationStructureSize);
 
-    VkAccelerationStructureDeviceAddressInfoKHR addressInfo{};
-    addressInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR;
-    addressInfo.accelerationStructure = topAC.AShandle;
-    topAC.deviceAddress = vkGetAccelerationStructureDeviceAddressKHR(ctx.vkDevice, &addressInfo);
+    const VkDeviceSize scratchAlignment = accelerationStructureProperties.minAccelerationStructureScratchOffsetAlignment;
+    rFrame.scratchBuffer = createScratchBuffer(std::max(buildSizesInfo.buildScratchSize, buildSizesInfo.updateScratchSize) + scratchAlignment);
 
-    buffertools::destroyBuffer(ctx, scratchBuffer);
-    buffertools::destroyBuffer(ctx, instanceBuffer);
+    // Forces a full build on first use
+    rFrame.builtInstanceCount = 0;
+    rFrame.structureVersion = 0;
+    rFrame.contentVersion = 0;
+}
+
+void RayTracer::destroyTopLevelAccelerationStructure(RayTracerFrame& rFrame) {
+    vmaUnmapMemory(ctx.vmaAllocator, rFrame.instanceBuffer.memory);
+    buffertools::destroyBuffer(ctx, rFrame.instanceBuffer);
+    buffertools::destroyBuffer(ctx, rFrame.scratchBuffer);
+    destroyAccelerationStructure(rFrame.topAC);
+}
+
+void RayTracer::writeTopLevelDescriptor(RayTracerFrame& rFrame) const {
+    VkWriteDescriptorSetAccelerationStructureKHR writeASInfo{};
+    writeASInfo.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET_ACCELERATION_STRUCTURE_KHR;
+    writeASInfo.accelerationStructureCount = 1;
+    writeASInfo.pAccelerationStructures = &rFrame.topAC.AShandle;
+
+    VkWriteDescriptorSet writeAS{};
+    writeAS.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writeAS.pNext = &writeASInfo;
+    writeAS.dstSet = rFrame.descriptorSet;
+    writeAS.dstBinding = 0;
+    writeAS.descriptorCount = 1;
+    writeAS.descriptorType = VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR;
+    vkUpdateDescriptorSets(ctx.vkDevice, 1, &writeAS, 0, nullptr);
+}
+
+void RayTracer::updateTopLevelAccelerationStructure(FrameContext& frame) {
+    auto& rFrame = frame.getExtFrame<RayTracerFrame>();
+    if (rFrame.structureVersion == structureVersion && rFrame.contentVersion == contentVersion) {
+        return;
+    }
+
+    // This frame finished executing before we got here, so its resources are free to replace
+    if (nrLiveInstances > rFrame.instanceCapacity) {
+        destroyTopLevelAccelerationStructure(rFrame);
+        createTopLevelAccelerationStructure(rFrame, std::max(nrLiveInstances, rFrame.instanceCapacity * 2));
+        writeTopLevelDescriptor(rFrame);
+    }
+
+    auto instanceData = rFrame.instanceBuffer.getData<VkAccelerationStructureInstanceKHR>();
+    uint32_t instanceCount = 0;
+    for(const auto& instance : instances) {
+        if (!instance.has_value()) continue;
+
+        // VkTransformMatrixKHR is row major, glm is column major
+        const glm::mat4 transform = glm::transpose(instance->transform);
+        VkAccelerationStructureInstanceKHR& data = instanceData[instanceCount++];
+        data = VkAccelerationStructureInstanceKHR{};
+        memcpy(&data.transform, &transform, sizeof(VkTransformMatrixKHR));
+        data.instanceCustomIndex = triangleDataOffsets[instance->meshIdx];
+        data.mask = instance->mask;
+        data.instanceShaderBindingTableRecordOffset = 0;
+        data.flags = VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR;
+        data.accelerationStructureReference = bottomACs[instance->meshIdx].deviceAddress;
+    }
+    vmaFlushAllocation(ctx.vmaAllocator, rFrame.instanceBuffer.memory, 0, instanceCount * sizeof(VkAccelerationStructureInstanceKHR));
+
+    // Only a changed set of instances needs a rebuild, moved instances are refitted
+    const bool refit = rFrame.structureVersion == structureVersion && rFrame.builtInstanceCount == instanceCount;
+
+    auto geometry = getTopLevelGeometry(rFrame);
+    VkAccelerationStructureBuildGeometryInfoKHR buildInfo{};
+    buildInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
+    buildInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
+    buildInfo.flags = getTopLevelFlags();
+    buildInfo.mode = refit ? VK_BUILD_ACCELERATION_STRUCTURE_MODE_UPDATE_KHR : VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+    buildInfo.srcAccelerationStructure = refit ? rFrame.topAC.AShandle : VK_NULL_HANDLE;
+    buildInfo.dstAccelerationStructure = rFrame.topAC.AShandle;
+    buildInfo.geometryCount = 1;
+    buildInfo.pGeometries = &geometry;
+    buildInfo.scratchData.deviceAddress = alignUp(getBufferDeviceAddress(rFrame.scratchBuffer.buffer), accelerationStructureProperties.minAccelerationStructureScratchOffsetAlignment);
+
+    VkAccelerationStructureBuildRangeInfoKHR rangeInfo{};
+    rangeInfo.primitiveCount = instanceCount;
+    const VkAccelerationStructureBuildRangeInfoKHR* rangeInfoPtr = &rangeInfo;
+    vkCmdBuildAccelerationStructuresKHR(frame.cmdBuffer, 1, &buildInfo, &rangeInfoPtr);
+
+    auto barrier = vks::initializers::memoryBarrier();
+    barrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+    barrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
+    vkCmdPipelineBarrier(
+            frame.cmdBuffer,
+            VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+            VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+            0,
+            1, &barrier,
+            0, nullptr,
+            0, nullptr);
+
+    rFrame.builtInstanceCount = instanceCount;
+    rFrame.structureVersion = structureVersion;
+    rFrame.contentVersion = contentVersion;
 }
 
 void RayTracer::createShaderBindingTable() {
@@ -481,9 +1217,13 @@ void RayTracer::createShaderBindingTable() {
     vkCheck(vkGetRayTracingShaderGroupHandlesKHR(ctx.vkDevice, pipeline, 0, groupCount, sbtSize, shaderHandleStorage.data()));
 
     const VkBufferUsageFlags bufferUsageFlags = VK_BUFFER_USAGE_SHADER_BINDING_TABLE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
-    buffertools::create_buffer_D_data(ctx, bufferUsageFlags, handleSize, shaderHandleStorage.data() + handleSizeAlligned * 0, &raygenShaderBindingTable);
-    buffertools::create_buffer_D_data(ctx, bufferUsageFlags, handleSize, shaderHandleStorage.data() + handleSizeAlligned * 1, &missShaderBindingTable);
-    buffertools::create_buffer_D_data(ctx, bufferUsageFlags, handleSize, shaderHandleStorage.data() + handleSizeAlligned * 2, &hitShaderBindingTable);
+    const uint32_t nrRaygenGroups = executionReorderSupported ? RaygenGroupCount : MegakernelReorder;
+    raygenShaderBindingTables.resize(nrRaygenGroups);
+    for(uint32_t i=0; i<nrRaygenGroups; i++) {
+        buffertools::create_buffer_D_data_async(ctx, bufferUsageFlags, handleSize, shaderHandleStorage.data() + handleSizeAlligned * i, &raygenShaderBindingTables[i]);
+    }
+    buffertools::create_buffer_D_data_async(ctx, bufferUsageFlags, handleSize, shaderHandleStorage.data() + handleSizeAlligned * nrRaygenGroups, &missShaderBindingTable);
+    ctx.uploadManager->wait(buffertools::create_buffer_D_data_async(ctx, bufferUsageFlags, handleSize, shaderHandleStorage.data() + handleSizeAlligned * (nrRaygenGroups + 1), &hitShaderBindingTable));
 }
 
 void RayTracer::destroyAccelerationStructure(AccelerationStructure& structure) const {
@@ -492,35 +1232,212 @@ void RayTracer::destroyAccelerationStructure(AccelerationStructure& structure) c
 }
 
 
+void RayTracer::updateLights() {
+    if (builtLightVersion == lightVersion) return;
+
+    // Every live instance of an emitting mesh contributes all of that mesh's emitters
+    std::vector<const RayTracerInstance*> lightInstances;
+    std::vector<size_t> firstLights;
+    size_t nrLights = 0;
+    for(const auto& instance : instances) {
+        if (!instance || !meshHasEmitters[instance->meshIdx]) continue;
+        lightInstances.push_back(&*instance);
+        firstLights.push_back(nrLights);
+        nrLights += meshEmitterRanges[instance->meshIdx].second;
+    }
+
+    lightTriangles.resize(nrLights);
+    lightPrimitives.resize(nrLights);
+    ThreadPool::shared().parallelFor(nrLights, 4096, [&](size_t begin, size_t end) {
+        for(size_t i=begin; i<end; i++) {
+            const size_t owner = std::upper_bound(firstLights.begin(), firstLights.end(), i) - firstLights.begin() - 1;
+            const RayTracerInstance* instance = lightInstances[owner];
+            TriangleData world = emissiveObjectTriangles[meshEmitterRanges[instance->meshIdx].first + (i - firstLights[owner])];
+            for(auto& v : world.vertices) {
+                v = glm::vec4(glm::vec3(instance->transform * glm::vec4(glm::vec3(v), 1.0f)), v.w);
+            }
+            lightTriangles[i] = world;
+            lightPrimitives[i] = LightPrimitive {
+                .v0 = glm::vec3(world.vertices[0]),
+                .v1 = glm::vec3(world.vertices[1]),
+                .v2 = glm::vec3(world.vertices[2]),
+                .power = get_light_power(world),
+            };
+        }
+    });
+
+    // Lights are picked proportional to their world space area times emitted luminance
+    const auto aliasStart = std::chrono::steady_clock::now();
+    std::vector<float> lightPowers(nrLights);
+    for(size_t i=0; i<nrLights; i++) lightPowers[i] = lightPrimitives[i].power;
+    lightAliasTable = aliastable::build(lightPowers);
+    logger::debug("Built the light alias table over {} emitters in {:.2f}ms", nrLights,
+        std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - aliasStart).count());
+    // Buffers can not be empty, a scene without lights never reads it
+    if (lightAliasTable.empty()) {
+        lightAliasTable.push_back(AliasEntry { .probability = 1.0f, .alias = 0, .pdf = 1.0f });
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    const bool refit = lightBvh.isBuilt() && lightBvh.getNrLights() == nrLights;
+    if (refit) lightBvh.refit(lightPrimitives);
+    else lightBvh.build(lightPrimitives);
+    logger::debug("{} the light BVH over {} emitters in {:.2f}ms", refit ? "Refitted" : "Built", nrLights,
+        std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count());
+
+    builtLightVersion = lightVersion;
+}
+
+void RayTracer::uploadLights(FrameContext& frame) {
+    auto& rFrame = frame.getExtFrame<RayTracerFrame>();
+    if (rFrame.lightVersion == builtLightVersion) return;
+
+    // The frame's last use finished on the timeline, nothing reads these buffers anymore
+    if (rFrame.lightCapacity < lightTriangles.size()) {
+        createLightBuffers(rFrame, static_cast<uint32_t>(lightTriangles.size()));
+    }
+    const auto& nodes = lightBvh.getNodes();
+    memcpy(rFrame.lightBvhBuffer.data, nodes.data(), nodes.size() * sizeof(LightBvhNode));
+    vmaFlushAllocation(ctx.vmaAllocator, rFrame.lightBvhBuffer.memory, 0, nodes.size() * sizeof(LightBvhNode));
+    memcpy(rFrame.lightTriangleBuffer.data, lightTriangles.data(), lightTriangles.size() * sizeof(TriangleData));
+    vmaFlushAllocation(ctx.vmaAllocator, rFrame.lightTriangleBuffer.memory, 0, lightTriangles.size() * sizeof(TriangleData));
+    memcpy(rFrame.lightAliasBuffer.data, lightAliasTable.data(), lightAliasTable.size() * sizeof(AliasEntry));
+    vmaFlushAllocation(ctx.vmaAllocator, rFrame.lightAliasBuffer.memory, 0, lightAliasTable.size() * sizeof(AliasEntry));
+
+    rFrame.lightVersion = builtLightVersion;
+}
+
+void RayTracer::createLightBuffers(RayTracerFrame& frame, uint32_t capacity) {
+    if (frame.lightCapacity > 0) destroyLightBuffers(frame);
+
+    // Buffers can not be empty, a scene without lights never reads them
+    frame.lightCapacity = std::max(capacity, 1u);
+    buffertools::create_buffer_H2D(ctx, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, (2 * frame.lightCapacity - 1) * sizeof(LightBvhNode), &frame.lightBvhBuffer);
+    vkCheck(vmaMapMemory(ctx.vmaAllocator, frame.lightBvhBuffer.memory, &frame.lightBvhBuffer.data));
+    buffertools::create_buffer_H2D(ctx, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, frame.lightCapacity * sizeof(TriangleData), &frame.lightTriangleBuffer);
+    vkCheck(vmaMapMemory(ctx.vmaAllocator, frame.lightTriangleBuffer.memory, &frame.lightTriangleBuffer.data));
+    buffertools::create_buffer_H2D(ctx, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, frame.lightCapacity * sizeof(AliasEntry), &frame.lightAliasBuffer);
+    vkCheck(vmaMapMemory(ctx.vmaAllocator, frame.lightAliasBuffer.memory, &frame.lightAliasBuffer.data));
+
+    auto lightAliasBufferInfo = vks::initializers::descriptorBufferInfo(frame.lightAliasBuffer.buffer);
+    auto lightBvhBufferInfo = vks::initializers::descriptorBufferInfo(frame.lightBvhBuffer.buffer);
+    auto lightTriangleBufferInfo = vks::initializers::descriptorBufferInfo(frame.lightTriangleBuffer.buffer);
+    std::array<VkWriteDescriptorSet, 3> writes {
+        vks::initializers::writeDescriptorSet(frame.descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 10, &lightAliasBufferInfo),
+        vks::initializers::writeDescriptorSet(frame.descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 11, &lightBvhBufferInfo),
+        vks::initializers::writeDescriptorSet(frame.descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 12, &lightTriangleBufferInfo),
+    };
+    vkUpdateDescriptorSets(ctx.vkDevice, static_cast<uint32_t>(writes.size()), writes.data(), 0, nullptr);
+}
+
+void RayTracer::destroyLightBuffers(RayTracerFrame& frame) {
+    vmaUnmapMemory(ctx.vmaAllocator, frame.lightBvhBuffer.memory);
+    buffertools::destroyBuffer(ctx, frame.lightBvhBuffer);
+    vmaUnmapMemory(ctx.vmaAllocator, frame.lightTriangleBuffer.memory);
+    buffertools::destroyBuffer(ctx, frame.lightTriangleBuffer);
+    vmaUnmapMemory(ctx.vmaAllocator, frame.lightAliasBuffer.memory);
+    buffertools::destroyBuffer(ctx, frame.lightAliasBuffer);
+    frame.lightCapacity = 0;
+}
+
+uint32_t RayTracer::addInstance(uint32_t meshIdx, const glm::mat4& transform, uint8_t mask) {
+    assert(meshIdx < bottomACs.size() && "Instance of unknown mesh");
+    RayTracerInstance instance { meshIdx, transform, mask };
+
+    uint32_t instanceId;
+    if (freeInstanceIds.empty()) {
+        instanceId = static_cast<uint32_t>(instances.size());
+        instances.emplace_back(instance);
+    } else {
+        instanceId = freeInstanceIds.back();
+        freeInstanceIds.pop_back();
+        instances[instanceId] = instance;
+    }
+
+    nrLiveInstances++;
+    structureVersion++;
+    if (meshHasEmitters[meshIdx]) lightVersion++;
+    return instanceId;
+}
+
+void RayTracer::removeInstance(uint32_t instanceId) {
+    assert(instanceId < instances.size() && instances[instanceId].has_value() && "Instance does not exist");
+    if (meshHasEmitters[instances[instanceId]->meshIdx]) lightVersion++;
+    instances[instanceId].reset();
+    freeInstanceIds.push_back(instanceId);
+    nrLiveInstances--;
+    structureVersion++;
+}
+
+void RayTracer::setInstanceTransform(uint32_t instanceId, const glm::mat4& transform) {
+    assert(instanceId < instances.size() && instances[instanceId].has_value() && "Instance does not exist");
+    instances[instanceId]->transform = transform;
+    contentVersion++;
+    if (meshHasEmitters[instances[instanceId]->meshIdx]) lightVersion++;
+}
+
+void RayTracer::setInstanceMask(uint32_t instanceId, uint8_t mask) {
+    assert(instanceId < instances.size() && instances[instanceId].has_value() && "Instance does not exist");
+    instances[instanceId]->mask = mask;
+    contentVersion++;
+}
+
 void RayTracer::render(FrameContext& frame, const Camera& camera, bool NEE) {
     const uint32_t handleSizeAligned = vks::tools::alignedSize(rayTracingPipelineProperties.shaderGroupHandleSize, rayTracingPipelineProperties.shaderGroupHandleAlignment);
 
+    // A moved camera gets a cheap preview over every tile first, as many tiles per frame as it is
+    // given. Otherwise the budgeted tiles continue where the last frame stopped.
+    if (shouldReset) previewTilesLeft = nrTiles;
+    const bool preview = previewTilesLeft > 0;
+    uint32_t frameTiles, firstTile;
+    if (preview) {
+        frameTiles = std::min(previewTilesPerFrame == 0 ? nrTiles : previewTilesPerFrame, previewTilesLeft);
+        firstTile = nextPreviewTile % nrTiles;
+        nextPreviewTile = (firstTile + frameTiles) % nrTiles;
+        previewTilesLeft -= frameTiles;
+    } else {
+        frameTiles = tilesPerFrame == 0 ? nrTiles : std::min(tilesPerFrame, nrTiles);
+        firstTile = nextTile % nrTiles;
+        nextTile = (firstTile + frameTiles) % nrTiles;
+    }
+
     auto& wFrame = frame.getExtFrame<WindowFrame>();
     const float aspectRatio = (float)wFrame.width / (float)wFrame.height;
     glm::mat4 projectionMatrix = glm::perspective(45.0f, aspectRatio, 0.1f, 100.0f);
 
 
+    updateLights();
+    uploadLights(frame);
+
     RayTracerCamera cameraInfo {
         .viewInverse = glm::inverse(camera.getViewMatrix()),
         .projInverse = glm::inverse(projectionMatrix),
         .viewDir = glm::vec4(camera.getViewDir(), 0),
     };
 
-    cameraInfo.setTime(static_cast<float>(glfwGetTime()));
+    cameraInfo.setTime(std::chrono::duration<float>(std::chrono::steady_clock::now() - startTime).count());
     cameraInfo.setTick(tick++);
-    cameraInfo.setShouldReset(shouldReset);
+    cameraInfo.setShouldReset(preview);
     cameraInfo.setNEE(NEE);
+    cameraInfo.setMaxSamples(std::min(info.maxSamplesPerFrame, 255u));
+    cameraInfo.setAdaptive(info.adaptiveSampling);
+    cameraInfo.setAccumulationMode(info.accumulationMode);
+    cameraInfo.setMaxSampleCount(info.sampleCountFormat == VK_FORMAT_R16_UINT ? 0xFFFFu : 0xFFFFFFFFu);
+    cameraInfo.setLightSampling(info.lightSampling);
+    cameraInfo.setNrLights(static_cast<uint32_t>(lightTriangles.size()));
 
     auto& myFrame = frame.getExtFrame<RayTracerFrame>();
-    void* data;
-    vkCheck(vmaMapMemory(ctx.vmaAllocator, myFrame.cameraBuffer.memory, &data));
-    memcpy(data, &cameraInfo, sizeof(RayTracerCamera));
-    vmaUnmapMemory(ctx.vmaAllocator, myFrame.cameraBuffer.memory);
+    *myFrame.cameraBuffer.getData<RayTracerCamera>() = cameraInfo;
     vmaFlushAllocation(ctx.vmaAllocator, myFrame.cameraBuffer.memory, 0, sizeof(RayTracerCamera));
 
 
+    myFrame.tracedSamples = preview ? 1 : std::min(info.maxSamplesPerFrame, 255u);
+    myFrame.tracedTiles = frameTiles;
+    myFrame.tracedPreview = preview;
+
     VkStridedDeviceAddressRegionKHR raygenShaderSbtEntry{};
-    raygenShaderSbtEntry.deviceAddress = getBufferDeviceAddress(raygenShaderBindingTable.buffer);
+    const RaygenGroup megakernel = info.rayReordering == RayReordering::ExecutionReorder ? MegakernelReorder : Megakernel;
+    raygenShaderSbtEntry.deviceAddress = getBufferDeviceAddress(raygenShaderBindingTables[megakernel].buffer);
     raygenShaderSbtEntry.stride = handleSizeAligned;
     raygenShaderSbtEntry.size = handleSizeAligned;
 
@@ -536,9 +1453,32 @@ void RayTracer::render(FrameContext& frame, const Camera& camera, bool NEE) {
 
     VkStridedDeviceAddressRegionKHR callableShaderSbtEntry{};
 
+    updateTopLevelAccelerationStructure(frame);
+
     vkCmdBindPipeline(frame.cmdBuffer, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, pipeline);
     vkCmdBindDescriptorSets(frame.cmdBuffer, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, pipelineLayout, 0, 1, &frame.getExtFrame<RayTracerFrame>().descriptorSet, 0, 0);
-    vkCmdTraceRaysKHR(frame.cmdBuffer, &raygenShaderSbtEntry, &missShaderSbtEntry, &hitShaderSbtEntry, &callableShaderSbtEntry, wFrame.width, wFrame.height,1);
+    if (info.backend == RayTracerBackend::Wavefront) {
+        traceWavefront(frame, firstTile, frameTiles, preview);
+    } else {
+        RayTracerConstants constants {};
+        if (megakernel == MegakernelReorder) {
+            // Same coherence keys as the wavefront sort
+            glm::vec3 boundsMin, boundsMax;
+            getSceneBounds(boundsMin, boundsMax);
+            constants = coherence_constants(boundsMin, boundsMax);
+        }
+        constants.firstTile = firstTile;
+        constants.tileSize = info.tileSize;
+        // Earlier frames in flight may still be accumulating into the same pixels
+        memory_barrier(frame.cmdBuffer, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+            VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+        vkCmdPushConstants(frame.cmdBuffer, pipelineLayout, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 0, sizeof(RayTracerConstants), &constants);
+        vkCmdTraceRaysKHR(frame.cmdBuffer, &raygenShaderSbtEntry, &missShaderSbtEntry, &hitShaderSbtEntry, &callableShaderSbtEntry, info.tileSize, info.tileSize, frameTiles);
+    }
+
+    if (info.adaptiveSampling) {
+        computeSampleBudget(frame);
+    }
 
     shouldReset = false;
 }
@@ -0,0 +1,178 @@
+#include "Reduction.h"
+
+namespace lv {
+
+// Keep in sync with local_size_x of the reduce shaders
+static const uint32_t groupSize = 256;
+// Every invocation folds at least this many elements before the subgroup step
+static const uint32_t itemsPerInvocation = 4;
+// Bounds the partials the final pass has to fold, larger inputs just loop more
+static const uint32_t maxGroups = 1024;
+
+// Layout of the result buffer, histogram bins follow the header
+struct ReductionResultHeader {
+    float value;
+    uint32_t count;
+    uint32_t pad[2];
+};
+
+Reduction::Reduction(AppContext& ctx, ReductionInfo info) : AppExt(ctx), info(info) {
+    checkSubgroupSupport();
+
+    for(auto& pair : this->info.slots) {
+        const uint32_t slotIdx = pair.first;
+        auto& slotInfo = pair.second;
+        assert((slotInfo.op != ReductionOp::Histogram || slotInfo.bins > 0) && "Histograms need bins, use setHistogram");
+
+        Slot& slot = slots[slotIdx];
+        slot.info = slotInfo;
+
+        ComputeShaderInfo firstInfo{};
+        const char* firstPath;
+        if (slotInfo.source == ReductionSource::Image) {
+            firstInfo.addImageBinding(0, slotInfo.view);
+            // Without format-less loads only rgba32f images can be reduced
+            firstPath = ctx.enabledFeatures.shaderStorageImageReadWithoutFormat ? "./app/shaders_bin/reduceImage.comp.spv" : "./app/shaders_bin/reduceImage.comp.formatted.spv";
+        } else {
+            firstInfo.addBufferBinding(0, slotInfo.buffer);
+            firstPath = "./app/shaders_bin/reduceBuffer.comp.spv";
+        }
+        firstInfo.addBufferBinding(1, [this, slotIdx](FrameContext& frame) { return getSlotFrame(frame, slotIdx).partials.buffer; });
+        firstInfo.setPushConstantType<ReductionConstants>();
+        slot.firstPass = std::make_unique<ComputeShader>(ctx, firstPath, firstInfo);
+
+        ComputeShaderInfo finalInfo{};
+        finalInfo.addBufferBinding(0, [this, slotIdx](FrameContext& frame) { return getSlotFrame(frame, slotIdx).partials.buffer; });
+        finalInfo.addBufferBinding(1, [this, slotIdx](FrameContext& frame) { return getSlotFrame(frame, slotIdx).result.buffer; });
+        finalInfo.setPushConstantType<ReductionConstants>();
+        slot.finalPass = std::make_unique<ComputeShader>(ctx, "./app/shaders_bin/reduceFinal.comp.spv", finalInfo);
+    }
+}
+
+void Reduction::checkSubgroupSupport() const {
+    VkPhysicalDeviceSubgroupProperties subgroupProperties {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SUBGROUP_PROPERTIES,
+    };
+    VkPhysicalDeviceProperties2 properties {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+        .pNext = &subgroupProperties,
+    };
+    vkGetPhysicalDeviceProperties2(ctx.vkPhysicalDevice, &properties);
+
+    const VkSubgroupFeatureFlags required = VK_SUBGROUP_FEATURE_BASIC_BIT | VK_SUBGROUP_FEATURE_ARITHMETIC_BIT;
+    if ((subgroupProperties.supportedOperations & required) != required || !(subgroupProperties.supportedStages & VK_SHADER_STAGE_COMPUTE_BIT)) {
+        logger::error("Reductions need subgroup arithmetic in compute shaders");
+        exit(1);
+    }
+    logger::debug("Reductions running with a subgroup size of {}", subgroupProperties.subgroupSize);
+}
+
+Reduction::SlotFrame& Reduction::getSlotFrame(const FrameContext& frame, uint32_t slot) {
+    auto& frames = slots.at(slot).frames;
+    assert(frame.idx < frames.size() && "Frame was not embellished by the reduction");
+    return frames[frame.idx];
+}
+
+void Reduction::embellishFrameContext(FrameContext& frame) {
+    for(auto& pair : slots) {
+        auto& slot = pair.second;
+        if (slot.frames.size() <= frame.idx) {
+            slot.frames.resize(frame.idx + 1);
+        }
+        auto& slotFrame = slot.frames[frame.idx];
+
+        const uint32_t partialsPerGroup = std::max(slot.info.bins, 1u);
+        buffertools::create_buffer_D(ctx, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, maxGroups * partialsPerGroup * sizeof(uint32_t), &slotFrame.partials);
+
+        const size_t resultSize = sizeof(ReductionResultHeader) + slot.info.bins * sizeof(uint32_t);
+        buffertools::create_buffer_H2D(ctx, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, resultSize, &slotFrame.result);
+        vkCheck(vmaMapMemory(ctx.vmaAllocator, slotFrame.result.memory, &slotFrame.result.data));
+        memset(slotFrame.result.data, 0, resultSize);
+
+        // The shaders pick up the buffers through the selectors
+        slot.firstPass->embellishFrameContext(frame);
+        slot.finalPass->embellishFrameContext(frame);
+    }
+}
+
+void Reduction::cleanupFrameContext(FrameContext& frame) {
+    for(auto& pair : slots) {
+        auto& slot = pair.second;
+        slot.firstPass->cleanupFrameContext(frame);
+        slot.finalPass->cleanupFrameContext(frame);
+
+        auto& slotFrame = getSlotFrame(frame, pair.first);
+        vmaUnmapMemory(ctx.vmaAllocator, slotFrame.result.memory);
+        buffertools::destroyBuffer(ctx, slotFrame.result);
+        buffertools::destroyBuffer(ctx, slotFrame.partials);
+    }
+}
+
+void Reduction::record(FrameContext& frame, uint32_t slotIdx) {
+    auto& slot = slots.at(slotIdx);
+    auto& slotFrame = getSlotFrame(frame, slotIdx);
+    const auto& slotInfo = slot.info;
+
+    ReductionConstants constants {
+        .op = static_cast<uint32_t>(slotInfo.op),
+        .value = static_cast<uint32_t>(slotInfo.value),
+        .divideByAlpha = slotInfo.divideByAlpha ? 1u : 0u,
+        .bins = slotInfo.bins,
+        .logarithmic = slotInfo.logarithmic ? 1u : 0u,
+        .minValue = slotInfo.minValue,
+        .maxValue = slotInfo.maxValue,
+    };
+
+    if (slotInfo.source == ReductionSource::Image) {
+        const VkExtent2D extent = slotInfo.extent(frame);
+        constants.count = extent.width * extent.height;
+        constants.width = extent.width;
+    } else {
+        constants.count = slotInfo.count(frame);
+        constants.width = 0;
+    }
+
+    // Sized from the actual input, a grid stride loop covers whatever does not fit in maxGroups
+    const uint32_t perGroup = groupSize * itemsPerInvocation;
+    constants.nrGroups = std::clamp((constants.count + perGroup - 1) / perGroup, 1u, maxGroups);
+
+    slot.firstPass->pushConstants(frame, constants);
+    slot.firstPass->dispatch(frame, constants.nrGroups);
+
+    auto partialsBarrier = vks::initializers::bufferMemoryBarrier();
+    partialsBarrier.buffer = slotFrame.partials.buffer;
+    partialsBarrier.size = VK_WHOLE_SIZE;
+    partialsBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    partialsBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    vkCmdPipelineBarrier(frame.cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+        0, 0, nullptr, 1, &partialsBarrier, 0, nullptr);
+
+    slot.finalPass->pushConstants(frame, constants);
+    slot.finalPass->dispatch(frame, 1);
+
+    auto resultBarrier = vks::initializers::bufferMemoryBarrier();
+    resultBarrier.buffer = slotFrame.result.buffer;
+    resultBarrier.size = VK_WHOLE_SIZE;
+    resultBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    resultBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    vkCmdPipelineBarrier(frame.cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_HOST_BIT,
+        0, 0, nullptr, 1, &resultBarrier, 0, nullptr);
+}
+
+float Reduction::getValue(FrameContext& frame, uint32_t slot) {
+    assert(slots.at(slot).info.op != ReductionOp::Histogram && "Histogram slots have no single value");
+    auto& result = getSlotFrame(frame, slot).result;
+    vmaInvalidateAllocation(ctx.vmaAllocator, result.memory, 0, sizeof(ReductionResultHeader));
+    return result.getData<ReductionResultHeader>()->value;
+}
+
+std::span<const uint32_t> Reduction::getHistogram(FrameContext& frame, uint32_t slot) {
+    const uint32_t bins = slots.at(slot).info.bins;
+    assert(bins > 0 && "Slot is not a histogram");
+    auto& result = getSlotFrame(frame, slot).result;
+    vmaInvalidateAllocation(ctx.vmaAllocator, result.memory, 0, VK_WHOLE_SIZE);
+    auto* data = reinterpret_cast<const uint32_t*>(result.getData<ReductionResultHeader>() + 1);
+    return { data, bins };
+}
+
+}
@@ -0,0 +1,61 @@
+#include "RenderBudget.h"
+
+namespace lv {
+
+RenderBudget::RenderBudget(RenderBudgetInfo info) : info(info) {
+    assert(info.minSamples > 0 && info.minSamples <= info.maxSamples && "Sample range is empty");
+    samples = info.minSamples;
+}
+
+void RenderBudget::addMeasurement(double rayTracerMilliseconds, double restMilliseconds, uint32_t samples, uint32_t tiles) {
+    if (samples == 0 || tiles == 0) return;
+
+    // Fixed costs like the TLAS refit get spread over the work, which errs on the cheap side of the budget
+    const double cost = rayTracerMilliseconds / (static_cast<double>(samples) * tiles);
+    sampleTileMilliseconds = sampleTileMilliseconds < 0.0 ? cost : sampleTileMilliseconds + info.smoothing * (cost - sampleTileMilliseconds);
+    addRestMeasurement(restMilliseconds);
+}
+
+void RenderBudget::addPreviewMeasurement(double rayTracerMilliseconds, double restMilliseconds, uint32_t tiles) {
+    if (tiles == 0) return;
+
+    const double cost = rayTracerMilliseconds / tiles;
+    previewTileMilliseconds = previewTileMilliseconds < 0.0 ? cost : previewTileMilliseconds + info.smoothing * (cost - previewTileMilliseconds);
+    addRestMeasurement(restMilliseconds);
+}
+
+void RenderBudget::addRestMeasurement(double restMilliseconds) {
+    if (this->restMilliseconds < 0.0) {
+        this->restMilliseconds = restMilliseconds;
+        return;
+    }
+    // Spikes in the rest of the frame are taken at once, only recovering is smoothed
+    this->restMilliseconds = std::max(restMilliseconds, this->restMilliseconds + info.smoothing * (restMilliseconds - this->restMilliseconds));
+}
+
+void RenderBudget::plan(uint32_t nrTiles) {
+    if (nrTiles == 0) return;
+    const double available = std::max(info.targetMilliseconds - info.headroomMilliseconds - std::max(restMilliseconds, 0.0), 0.0);
+
+    // A preview is one sample, so only its tiles shrink. At least one keeps it progressing.
+    previewTiles = previewTileMilliseconds <= 0.0 ? nrTiles : std::clamp(static_cast<uint32_t>(available / previewTileMilliseconds), 1u, nrTiles);
+
+    // Nothing measured yet, start small over the full image
+    if (sampleTileMilliseconds <= 0.0) {
+        samples = info.minSamples;
+        tiles = nrTiles;
+        return;
+    }
+
+    const double units = available / sampleTileMilliseconds;
+    if (units >= static_cast<double>(nrTiles) * info.minSamples) {
+        tiles = nrTiles;
+        samples = std::clamp(static_cast<uint32_t>(units / nrTiles), info.minSamples, info.maxSamples);
+    } else {
+        // At least one tile so long renders keep progressing, however tight the budget
+        samples = info.minSamples;
+        tiles = std::clamp(static_cast<uint32_t>(units / info.minSamples), 1u, nrTiles);
+    }
+}
+
+}
@@ -0,0 +1,219 @@
+#include "RenderGraph.h"
+
+namespace lv {
+
+struct UsageSync {
+    VkPipelineStageFlags2 stages;
+    VkAccessFlags2 access;
+    // The part of access later uses have to wait on
+    VkAccessFlags2 writeAccess;
+    VkImageLayout layout;
+};
+
+static UsageSync usage_sync(GraphUsage usage, VkPipelineStageFlags2 passStages) {
+    switch(usage) {
+        case GraphUsage::StorageRead:
+            return { passStages, VK_ACCESS_2_SHADER_STORAGE_READ_BIT, VK_ACCESS_2_NONE, VK_IMAGE_LAYOUT_GENERAL };
+        case GraphUsage::StorageWrite:
+            return { passStages, VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT, VK_IMAGE_LAYOUT_GENERAL };
+        case GraphUsage::Sampled:
+            return { passStages, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT, VK_ACCESS_2_NONE, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
+        case GraphUsage::ColorAttachment:
+            return { VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_2_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT,
+                VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL };
+        case GraphUsage::TransferSrc:
+            return { VK_PIPELINE_STAGE_2_ALL_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_READ_BIT, VK_ACCESS_2_NONE, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL };
+        case GraphUsage::TransferDst:
+            return { VK_PIPELINE_STAGE_2_ALL_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL };
+    }
+    assert(false && "Unknown graph usage");
+    return {};
+}
+
+RenderGraph::RenderGraph(AppContext& ctx, RenderGraphInfo info) : AppExt(ctx), info(std::move(info)) {
+    assert(this->info.resourceStore != nullptr && "Render graph needs the resource store its passes use");
+    vkCmdPipelineBarrier2KHR = reinterpret_cast<PFN_vkCmdPipelineBarrier2KHR>(vkGetDeviceProcAddr(ctx.vkDevice, "vkCmdPipelineBarrier2KHR"));
+    cullPasses();
+}
+
+void RenderGraph::cullPasses() {
+    live.assign(info.passes.size(), false);
+
+    // Static images and host visible buffers outlive the frame, so writing them is always live.
+    // Only the per frame images and the transients can end up with nobody reading them.
+    std::set<std::pair<GraphResource, uint32_t>> needed;
+    for(uint32_t i=info.passes.size(); i-- > 0;) {
+        const auto& pass = info.passes[i];
+        bool isLive = pass.sideEffects;
+        for(const auto& use : pass.uses) {
+            const TransientLifetime* lifetime = getLifetime(use);
+            assert((lifetime == nullptr || (lifetime->firstPass <= i && i <= lifetime->lastPass)) && "Transient used outside its lifetime");
+            if (usage_sync(use.usage, pass.stages).writeAccess == VK_ACCESS_2_NONE) continue;
+            const bool persistent = use.resource == GraphResource::StaticImage || use.resource == GraphResource::Buffer;
+            isLive |= persistent || needed.contains({ use.resource, use.slot });
+        }
+        if (!isLive) {
+            logger::debug("Render graph culls pass {}, nothing reads what it writes", pass.name);
+            continue;
+        }
+
+        live[i] = true;
+        // Everything but a transfer destination reads what came before
+        for(const auto& use : pass.uses) {
+            if (use.usage != GraphUsage::TransferDst) needed.insert({ use.resource, use.slot });
+        }
+    }
+}
+
+RenderGraph::ResourceState& RenderGraph::getState(FrameContext& frame, const RenderGraphUse& use, VkImage& image) {
+    auto& rFrame = frame.getExtFrame<ResourceFrame>();
+    const auto& storeInfo = info.resourceStore->getInfo();
+
+    VkImageLayout initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    switch(use.resource) {
+        case GraphResource::Buffer:
+            image = VK_NULL_HANDLE;
+            return bufferStates[rFrame.getBuffer(use.slot).buffer];
+        case GraphResource::Image:
+            image = rFrame.get(use.slot).image;
+            initialLayout = storeInfo.m_imageInfos.at(use.slot).initialLayout;
+            break;
+        case GraphResource::StaticImage:
+            image = rFrame.getStatic(use.slot)->image;
+            initialLayout = storeInfo.m_staticImageInfos.at(use.slot).initialLayout;
+            break;
+        case GraphResource::TransientImage:
+            image = rFrame.getTransient(use.slot).image;
+            break;
+        case GraphResource::TransientBuffer:
+            image = VK_NULL_HANDLE;
+            return bufferStates[rFrame.getTransientBuffer(use.slot).buffer];
+    }
+
+    // The store waited for its initial transition, so a first use only has the layout to go by
+    auto [it, inserted] = imageStates.try_emplace(image);
+    if (inserted) it->second.layout = initialLayout;
+    return it->second;
+}
+
+const TransientLifetime* RenderGraph::getLifetime(const RenderGraphUse& use) const {
+    const auto& storeInfo = info.resourceStore->getInfo();
+    if (use.resource == GraphResource::TransientImage) return &storeInfo.m_transientImageInfos.at(use.slot).lifetime;
+    if (use.resource == GraphResource::TransientBuffer) return &storeInfo.m_transientBufferInfos.at(use.slot).lifetime;
+    return nullptr;
+}
+
+void RenderGraph::beginTransient(FrameContext& frame, const RenderGraphUse& use, ResourceState& state) {
+    const auto& rFrame = frame.getExtFrame<ResourceFrame>();
+    const auto& storeInfo = info.resourceStore->getInfo();
+    const bool isImage = use.resource == GraphResource::TransientImage;
+    const TransientLifetime& lifetime = *getLifetime(use);
+    const TransientPlacement& placement = isImage ? rFrame.transientImagePlacements.at(use.slot) : rFrame.transientBufferPlacements.at(use.slot);
+
+    // Whatever shares the memory and ended before this lifetime started has to be done with it
+    ResourceState aliased { .layout = VK_IMAGE_LAYOUT_UNDEFINED };
+    const auto waitOn = [&](const TransientPlacement& other, const TransientLifetime& otherLifetime, const ResourceState* otherState) {
+        if (otherState == nullptr || otherLifetime.lastPass >= lifetime.firstPass) return;
+        if (other.offset + other.size <= placement.offset || placement.offset + placement.size <= other.offset) return;
+        aliased.writeStages |= otherState->writeStages | otherState->readStages;
+        aliased.writeAccess |= otherState->writeAccess;
+    };
+    for(const auto& [slot, other] : rFrame.transientImagePlacements) {
+        const auto it = imageStates.find(rFrame.getTransient(slot).image);
+        waitOn(other, storeInfo.m_transientImageInfos.at(slot).lifetime, it != imageStates.end() ? &it->second : nullptr);
+    }
+    for(const auto& [slot, other] : rFrame.transientBufferPlacements) {
+        const auto it = bufferStates.find(rFrame.getTransientBuffer(slot).buffer);
+        waitOn(other, storeInfo.m_transientBufferInfos.at(slot).lifetime, it != bufferStates.end() ? &it->second : nullptr);
+    }
+
+    // Last frame's contents are gone, an image starts over from undefined
+    state = aliased;
+}
+
+void RenderGraph::execute(FrameContext& frame) {
+    std::vector<VkImageMemoryBarrier2> imageBarriers;
+    // Transients start over at their first use, which need not be the first pass of their lifetime
+    std::set<std::pair<GraphResource, uint32_t>> begun;
+    for(uint32_t i=0; i<info.passes.size(); i++) {
+        if (!live[i]) continue;
+        const auto& pass = info.passes[i];
+
+        VkMemoryBarrier2 memoryBarrier { .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2 };
+        imageBarriers.clear();
+        for(const auto& use : pass.uses) {
+            const auto sync = usage_sync(use.usage, pass.stages);
+            VkImage image;
+            auto& state = getState(frame, use, image);
+            const TransientLifetime* lifetime = getLifetime(use);
+            if (lifetime != nullptr && begun.insert({ use.resource, use.slot }).second) beginTransient(frame, use, state);
+            const VkImageLayout layout = image != VK_NULL_HANDLE ? sync.layout : VK_IMAGE_LAYOUT_UNDEFINED;
+
+            if (layout != state.layout) {
+                // Transitions write the image, so they wait on the readers too and everything after waits on them
+                imageBarriers.push_back(VkImageMemoryBarrier2 {
+                    .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+                    .srcStageMask = state.writeStages | state.readStages,
+                    .srcAccessMask = state.writeAccess,
+                    .dstStageMask = sync.stages,
+                    .dstAccessMask = sync.access,
+                    .oldLayout = state.layout,
+                    .newLayout = layout,
+                    .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                    .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                    .image = image,
+                    .subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, VK_REMAINING_MIP_LEVELS, 0, VK_REMAINING_ARRAY_LAYERS },
+                });
+                const bool writes = sync.writeAccess != VK_ACCESS_2_NONE;
+                state = ResourceState {
+                    .layout = layout,
+                    .writeStages = sync.stages,
+                    .writeAccess = sync.writeAccess,
+                    .readStages = writes ? VK_PIPELINE_STAGE_2_NONE : sync.stages,
+                    .readAccess = writes ? VK_ACCESS_2_NONE : sync.access,
+                };
+            } else if (sync.writeAccess != VK_ACCESS_2_NONE) {
+                // After a write and after reads alike, only the write has anything to make available
+                const VkPipelineStageFlags2 srcStages = state.writeStages | state.readStages;
+                if (srcStages != VK_PIPELINE_STAGE_2_NONE) {
+                    memoryBarrier.srcStageMask |= srcStages;
+                    memoryBarrier.srcAccessMask |= state.writeAccess;
+                    memoryBarrier.dstStageMask |= sync.stages;
+                    memoryBarrier.dstAccessMask |= sync.access;
+                }
+                state.writeStages = sync.stages;
+                state.writeAccess = sync.writeAccess;
+                state.readStages = VK_PIPELINE_STAGE_2_NONE;
+                state.readAccess = VK_ACCESS_2_NONE;
+            } else {
+                // Reads after reads are free, after a write once per stage and access
+                const bool covered = (sync.stages & ~state.readStages) == 0 && (sync.access & ~state.readAccess) == 0;
+                if (state.writeStages != VK_PIPELINE_STAGE_2_NONE && !covered) {
+                    memoryBarrier.srcStageMask |= state.writeStages;
+                    memoryBarrier.srcAccessMask |= state.writeAccess;
+                    memoryBarrier.dstStageMask |= sync.stages;
+                    memoryBarrier.dstAccessMask |= sync.access;
+                }
+                state.readStages |= sync.stages;
+                state.readAccess |= sync.access;
+            }
+        }
+
+        // Everything the pass waits on goes out as a single barrier
+        const bool hasMemoryBarrier = memoryBarrier.srcStageMask != VK_PIPELINE_STAGE_2_NONE;
+        if (hasMemoryBarrier || !imageBarriers.empty()) {
+            VkDependencyInfo dependencyInfo {
+                .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+                .memoryBarrierCount = hasMemoryBarrier ? 1u : 0u,
+                .pMemoryBarriers = &memoryBarrier,
+                .imageMemoryBarrierCount = static_cast<uint32_t>(imageBarriers.size()),
+                .pImageMemoryBarriers = imageBarriers.data(),
+            };
+            vkCmdPipelineBarrier2KHR(frame.cmdBuffer, &dependencyInfo);
+        }
+
+        pass.record(frame);
+    }
+}
+
+}
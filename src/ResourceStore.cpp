@@ -4,14 +4,6 @@ namespace lv {
 
 ResourceStore::ResourceStore(AppContext& ctx, ResourceStoreInfo info) 
    : AppExt(ctx), info(info) {
-    for(auto& pair : info.m_staticImageInfos) {
-        auto& imageIdx = pair.first;
-        auto& imageInfo = pair.second;
-
-        // TODO: no hardcoding of resolution
-        Image img = createImage(ctx, 1280, 768, imageInfo);
-        staticImages.insert({imageIdx, img});
-    }
 }
 
 ResourceStore::~ResourceStore() {
@@ -23,12 +15,25 @@ ResourceStore::~ResourceStore() {
 
 void ResourceStore::embellishFrameContext(FrameContext& frame) {
     auto& rFrame = frame.registerExtFrame<ResourceFrame>();
+    std::vector<VkImageMemoryBarrier> transitions;
+
+    // Static images wait for the first frame, only it knows the extent
+    if (!staticImagesCreated) {
+        for(auto& pair : info.m_staticImageInfos) {
+            auto& imageIdx = pair.first;
+            auto& imageInfo = pair.second;
+
+            Image img = createImage(imageInfo.width(frame), imageInfo.height(frame), imageInfo, transitions);
+            staticImages.insert({imageIdx, img});
+        }
+        staticImagesCreated = true;
+    }
 
     for(auto& pair : info.m_imageInfos) {
         auto& imageIdx = pair.first;
         auto& imageInfo = pair.second;
 
-        Image img = createImage(ctx, imageInfo.width(frame), imageInfo.height(frame), imageInfo);
+        Image img = createImage(imageInfo.width(frame), imageInfo.height(frame), imageInfo, transitions);
         rFrame.images.insert({imageIdx, img});
     }
 
@@ -37,6 +42,8 @@ void ResourceStore::embellishFrameContext(FrameContext& frame) {
         rFrame.staticImages.insert({imageIdx, &staticImages[imageIdx]});
     }
 
+    submitTransitions(transitions);
+
     for(auto& pair : info.m_bufferInfos) {
         auto& bufferIdx = pair.first;
         auto& bufferInfo = pair.second;
@@ -45,6 +52,103 @@ void ResourceStore::embellishFrameContext(FrameContext& frame) {
         vkCheck(vmaMapMemory(ctx.vmaAllocator, buf.memory, &buf.data));
         rFrame.buffers.insert({bufferIdx, buf});
     }
+
+    createTransients(frame, rFrame);
+}
+
+void ResourceStore::createTransients(FrameContext& frame, ResourceFrame& rFrame) {
+    struct Transient {
+        bool isImage;
+        uint32_t slot;
+        TransientLifetime lifetime;
+        VkMemoryRequirements requirements;
+        VkDeviceSize offset = 0;
+        VkDeviceSize size = 0;
+    };
+    std::vector<Transient> transients;
+
+    for(auto& [slot, transientInfo] : info.m_transientImageInfos) {
+        auto& imageInfo = transientInfo.image;
+        Image img{};
+        img.format = imageInfo.format;
+        auto imageCreateInfo = vks::initializers::imageCreateInfo(imageInfo.width(frame), imageInfo.height(frame), imageInfo.format, imageInfo.usage);
+        vkCheck(vkCreateImage(ctx.vkDevice, &imageCreateInfo, nullptr, &img.image));
+        Transient transient { .isImage = true, .slot = slot, .lifetime = transientInfo.lifetime };
+        vkGetImageMemoryRequirements(ctx.vkDevice, img.image, &transient.requirements);
+        rFrame.transientImages.insert({slot, img});
+        transients.push_back(transient);
+    }
+
+    for(auto& [slot, transientInfo] : info.m_transientBufferInfos) {
+        Buffer buf{};
+        auto bufferCreateInfo = vks::initializers::bufferCreateInfo(transientInfo.buffer.usage, transientInfo.buffer.size);
+        vkCheck(vkCreateBuffer(ctx.vkDevice, &bufferCreateInfo, nullptr, &buf.buffer));
+        Transient transient { .isImage = false, .slot = slot, .lifetime = transientInfo.lifetime };
+        vkGetBufferMemoryRequirements(ctx.vkDevice, buf.buffer, &transient.requirements);
+        rFrame.transientBuffers.insert({slot, buf});
+        transients.push_back(transient);
+    }
+
+    if (transients.empty()) return;
+
+    // Linear buffers and optimal images sharing memory have to stay a granularity apart
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(ctx.vkPhysicalDevice, &properties);
+    const bool mixed = !rFrame.transientImages.empty() && !rFrame.transientBuffers.empty();
+    const VkDeviceSize granularity = mixed ? properties.limits.bufferImageGranularity : 1;
+    const auto alignUp = [](VkDeviceSize value, VkDeviceSize alignment) { return (value + alignment - 1) / alignment * alignment; };
+    const auto overlap = [](const TransientLifetime& a, const TransientLifetime& b) { return a.firstPass <= b.lastPass && b.firstPass <= a.lastPass; };
+
+    // Largest first, each goes to the lowest offset that nothing alive at the same time occupies
+    std::sort(transients.begin(), transients.end(), [](const Transient& a, const Transient& b) { return a.requirements.size > b.requirements.size; });
+    VkMemoryRequirements shared { .size = 0, .alignment = 1, .memoryTypeBits = ~0u };
+    VkDeviceSize separateSize = 0;
+    for(size_t i=0; i<transients.size(); i++) {
+        auto& transient = transients[i];
+        const VkDeviceSize alignment = std::max(transient.requirements.alignment, granularity);
+        transient.size = alignUp(transient.requirements.size, granularity);
+
+        std::vector<VkDeviceSize> candidates { 0 };
+        for(size_t j=0; j<i; j++) {
+            if (overlap(transient.lifetime, transients[j].lifetime)) candidates.push_back(transients[j].offset + transients[j].size);
+        }
+        transient.offset = std::numeric_limits<VkDeviceSize>::max();
+        for(const VkDeviceSize candidate : candidates) {
+            const VkDeviceSize offset = alignUp(candidate, alignment);
+            bool fits = true;
+            for(size_t j=0; j<i && fits; j++) {
+                const auto& other = transients[j];
+                fits = !overlap(transient.lifetime, other.lifetime) || offset + transient.size <= other.offset || other.offset + other.size <= offset;
+            }
+            if (fits) transient.offset = std::min(transient.offset, offset);
+        }
+
+        shared.size = std::max(shared.size, transient.offset + transient.size);
+        shared.alignment = std::max(shared.alignment, alignment);
+        shared.memoryTypeBits &= transient.requirements.memoryTypeBits;
+        separateSize += transient.size;
+    }
+    assert(shared.memoryTypeBits != 0 && "Transients have no memory type in common");
+
+    VmaAllocationCreateInfo allocInfo { .usage = VMA_MEMORY_USAGE_GPU_ONLY };
+    vkCheck(vmaAllocateMemory(ctx.vmaAllocator, &shared, &allocInfo, &rFrame.transientMemory, nullptr));
+
+    for(const auto& transient : transients) {
+        const TransientPlacement placement { transient.offset, transient.size };
+        if (transient.isImage) {
+            auto& img = rFrame.transientImages[transient.slot];
+            vkCheck(vmaBindImageMemory2(ctx.vmaAllocator, rFrame.transientMemory, transient.offset, img.image, nullptr));
+            auto viewInfo = vks::initializers::imageViewCreateInfo(img.image, img.format, VK_IMAGE_ASPECT_COLOR_BIT);
+            vkCheck(vkCreateImageView(ctx.vkDevice, &viewInfo, nullptr, &img.view));
+            rFrame.transientImagePlacements.insert({transient.slot, placement});
+        } else {
+            vkCheck(vmaBindBufferMemory2(ctx.vmaAllocator, rFrame.transientMemory, transient.offset, rFrame.transientBuffers[transient.slot].buffer, nullptr));
+            rFrame.transientBufferPlacements.insert({transient.slot, placement});
+        }
+    }
+
+    logger::debug("Frame {} places {} transients in {:.1f} MB instead of {:.1f} MB", frame.idx, transients.size(),
+        shared.size / (1024.0 * 1024.0), separateSize / (1024.0 * 1024.0));
 }
 
 void ResourceStore::cleanupFrameContext(FrameContext& frame) {
@@ -61,9 +165,20 @@ void ResourceStore::cleanupFrameContext(FrameContext& frame) {
         vkDestroyImageView(ctx.vkDevice, image.view, nullptr);
         vmaDestroyImage(ctx.vmaAllocator, image.image, image.allocation);
     }
+
+    for(auto& pair : rFrame.transientImages) {
+        vkDestroyImageView(ctx.vkDevice, pair.second.view, nullptr);
+        vkDestroyImage(ctx.vkDevice, pair.second.image, nullptr);
+    }
+    for(auto& pair : rFrame.transientBuffers) {
+        vkDestroyBuffer(ctx.vkDevice, pair.second.buffer, nullptr);
+    }
+    if (rFrame.transientMemory != VK_NULL_HANDLE) {
+        vmaFreeMemory(ctx.vmaAllocator, rFrame.transientMemory);
+    }
 }
 
-Image ResourceStore::createImage(AppContext& ctx, uint32_t width, uint32_t height, ImageInfo& info) {
+Image ResourceStore::createImage(uint32_t width, uint32_t height, const ImageInfo& info, std::vector<VkImageMemoryBarrier>& transitions) {
     Image ret{};
     ret.format = info.format;
     auto imageCreateInfo = vks::initializers::imageCreateInfo(width, height, info.format, info.usage);
@@ -73,22 +188,26 @@ Image ResourceStore::createImage(AppContext& ctx, uint32_t width, uint32_t heigh
     auto viewInfo = vks::initializers::imageViewCreateInfo(ret.image, info.format, VK_IMAGE_ASPECT_COLOR_BIT);
     vkCheck(vkCreateImageView(ctx.vkDevice, &viewInfo, nullptr, &ret.view));
 
+    if (info.initialLayout != VK_IMAGE_LAYOUT_UNDEFINED) {
+        transitions.push_back(vks::initializers::imageMemoryBarrier(ret.image, VK_IMAGE_LAYOUT_UNDEFINED, info.initialLayout));
+    }
+    return ret;
+}
 
+void ResourceStore::submitTransitions(const std::vector<VkImageMemoryBarrier>& transitions) {
+    if (transitions.empty()) return;
+
+    // One submission for all of them, waited on before any frame can use the images
     auto cmdBuffer = ctx.singleTimeCommandBuffer();
-    auto barrier = vks::initializers::imageMemoryBarrier(
-            ret.image,
-            VK_IMAGE_LAYOUT_UNDEFINED, info.initialLayout);
     vkCmdPipelineBarrier(
             cmdBuffer,
-            VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
             VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
-            VK_DEPENDENCY_BY_REGION_BIT,
+            VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+            0,
             0, nullptr,
             0, nullptr,
-            1, &barrier);
-
+            static_cast<uint32_t>(transitions.size()), transitions.data());
     ctx.endSingleTimeCommands(cmdBuffer);
-    return ret;
 }
  
 }
@@ -0,0 +1,95 @@
+#include "ThreadPool.h"
+
+namespace lv {
+
+ThreadPool::ThreadPool(uint32_t nrThreads) {
+    // The thread calling parallelFor is the last worker
+    for(uint32_t i=1; i<nrThreads; i++) {
+        workers.emplace_back(&ThreadPool::workerLoop, this);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    cv.notify_all();
+    for(auto& worker : workers) {
+        worker.join();
+    }
+}
+
+ThreadPool& ThreadPool::shared() {
+    static ThreadPool pool;
+    return pool;
+}
+
+void ThreadPool::workerLoop() {
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this]() { return stopping || !tasks.empty(); });
+            if (stopping && tasks.empty()) return;
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+        task();
+    }
+}
+
+void ThreadPool::submit(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        tasks.push_back(std::move(task));
+    }
+    cv.notify_one();
+}
+
+void ThreadPool::parallelFor(size_t count, size_t grain, const std::function<void(size_t, size_t)>& fn) {
+    if (count == 0) return;
+    grain = std::max<size_t>(grain, 1);
+
+    const size_t nrChunks = std::min<size_t>((count + grain - 1) / grain, getNrThreads() * 4);
+    if (nrChunks <= 1 || workers.empty()) {
+        fn(0, count);
+        return;
+    }
+
+    // Helpers may only get scheduled after the loop finished, so they share ownership of the state
+    struct State {
+        std::atomic<size_t> nextChunk = 0;
+        std::atomic<size_t> doneChunks = 0;
+        std::mutex mutex;
+        std::condition_variable done;
+    };
+    auto state = std::make_shared<State>();
+    const size_t chunkSize = (count + nrChunks - 1) / nrChunks;
+
+    auto work = [state, chunkSize, count, nrChunks, &fn]() {
+        size_t chunk;
+        while ((chunk = state->nextChunk.fetch_add(1)) < nrChunks) {
+            const size_t begin = chunk * chunkSize;
+            const size_t end = std::min(begin + chunkSize, count);
+            if (begin < end) fn(begin, end);
+
+            if (state->doneChunks.fetch_add(1) + 1 == nrChunks) {
+                std::lock_guard<std::mutex> lock(state->mutex);
+                state->done.notify_all();
+            }
+        }
+    };
+
+    const size_t nrHelpers = std::min<size_t>(workers.size(), nrChunks - 1);
+    for(size_t i=0; i<nrHelpers; i++) {
+        // Late helpers find no chunk left and never touch fn
+        submit(work);
+    }
+    work();
+
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->done.wait(lock, [&]() { return state->doneChunks.load() == nrChunks; });
+}
+
+}
@@ -0,0 +1,350 @@
+#include "UploadManager.h"
+#include "ImageTools.h"
+
+namespace lv {
+
+// Satisfies bufferOffset requirements of every copy we record
+static constexpr VkDeviceSize stagingAlignment = 16;
+
+UploadManager::UploadManager(AppContext& ctx, UploadManagerInfo info)
+    : ctx(ctx), info(info) {
+    assert(info.maxRingUpload <= info.ringSize && "Ring uploads must fit the ring");
+
+    // Copies on the copy engines overlap with rendering instead of competing for the graphics queue
+    useTransferQueue = ctx.hasDedicatedTransfer();
+    VkCommandPoolCreateInfo poolInfo {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+        .flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+        .queueFamilyIndex = useTransferQueue ? ctx.queueFamilies.transfer.value() : ctx.queueFamilies.graphics.value(),
+    };
+    vkCheck(vkCreateCommandPool(ctx.vkDevice, &poolInfo, nullptr, &commandPool));
+
+    if (useTransferQueue) {
+        poolInfo.queueFamilyIndex = ctx.queueFamilies.graphics.value();
+        vkCheck(vkCreateCommandPool(ctx.vkDevice, &poolInfo, nullptr, &acquirePool));
+    }
+
+    buffertools::create_buffer_H(ctx, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, info.ringSize, &ring);
+    vkCheck(vmaMapMemory(ctx.vmaAllocator, ring.memory, &ring.data));
+}
+
+UploadManager::~UploadManager() {
+    waitIdle();
+    for(auto fence : freeFences) {
+        vkDestroyFence(ctx.vkDevice, fence, nullptr);
+    }
+    for(auto semaphore : freeSemaphores) {
+        vkDestroySemaphore(ctx.vkDevice, semaphore, nullptr);
+    }
+    vmaUnmapMemory(ctx.vmaAllocator, ring.memory);
+    buffertools::destroyBuffer(ctx, ring);
+    vkDestroyCommandPool(ctx.vkDevice, commandPool, nullptr);
+    if (acquirePool != VK_NULL_HANDLE) {
+        vkDestroyCommandPool(ctx.vkDevice, acquirePool, nullptr);
+    }
+}
+
+UploadToken UploadManager::uploadBuffer(VkBuffer dst, VkDeviceSize dstOffset, VkDeviceSize size, const void* data) {
+    return uploadBuffer(dst, dstOffset, size, [&](void* staging) { memcpy(staging, data, size); });
+}
+
+UploadToken UploadManager::uploadBuffer(VkBuffer dst, VkDeviceSize dstOffset, VkDeviceSize size, const std::function<void(void*)>& fill) {
+    return record(size, fill, [&](VkCommandBuffer cmdBuffer, const StagingRegion& region) {
+        VkBufferCopy copyRegion {
+            .srcOffset = region.offset,
+            .dstOffset = dstOffset,
+            .size = size,
+        };
+        vkCmdCopyBuffer(cmdBuffer, region.buffer, dst, 1, &copyRegion);
+        if (useTransferQueue) {
+            recording.buffers.push_back(dst);
+        }
+    });
+}
+
+UploadToken UploadManager::uploadImage(VkImage dst, uint32_t width, uint32_t height, VkDeviceSize size, const void* data, VkImageLayout finalLayout) {
+    auto fill = [&](void* staging) { memcpy(staging, data, size); };
+    return record(size, fill, [&](VkCommandBuffer cmdBuffer, const StagingRegion& region) {
+        auto toTransfer = vks::initializers::imageMemoryBarrier(dst, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+        toTransfer.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        vkCmdPipelineBarrier(
+                cmdBuffer,
+                VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                VK_PIPELINE_STAGE_TRANSFER_BIT,
+                0,
+                0, nullptr,
+                0, nullptr,
+                1, &toTransfer);
+
+        VkBufferImageCopy copyRegion = vks::initializers::imageCopy(width, height);
+        copyRegion.bufferOffset = region.offset;
+        vkCmdCopyBufferToImage(cmdBuffer, region.buffer, dst, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copyRegion);
+
+        // The ownership transfer does the final transition
+        if (useTransferQueue) {
+            recording.images.push_back({ dst, finalLayout });
+            return;
+        }
+
+        auto toFinal = vks::initializers::imageMemoryBarrier(dst, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, finalLayout);
+        toFinal.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        toFinal.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+        vkCmdPipelineBarrier(
+                cmdBuffer,
+                VK_PIPELINE_STAGE_TRANSFER_BIT,
+                VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+                0,
+                0, nullptr,
+                0, nullptr,
+                1, &toFinal);
+    });
+}
+
+UploadToken UploadManager::record(VkDeviceSize size, const std::function<void(void*)>& fill, const std::function<void(VkCommandBuffer, const StagingRegion&)>& copy) {
+    std::unique_lock<std::mutex> lock(mutex);
+    const StagingRegion region = reserve(lock, size);
+    beginBatch();
+    recording.pendingWrites++;
+
+    // The batch cannot be submitted while we write, other threads keep reserving meanwhile
+    lock.unlock();
+    fill(region.data);
+    lock.lock();
+
+    vmaFlushAllocation(ctx.vmaAllocator, region.memory, region.offset, size);
+    copy(recording.cmdBuffer, region);
+    recording.nrCopies++;
+
+    const UploadToken token = recording.token;
+    if (--recording.pendingWrites == 0) {
+        writesDone.notify_all();
+    }
+    return token;
+}
+
+UploadManager::StagingRegion UploadManager::reserve(std::unique_lock<std::mutex>& lock, VkDeviceSize size) {
+    // Would monopolize the ring, these get staging of their own that is freed with the batch
+    if (size > info.maxRingUpload) {
+        MappedBuffer staging;
+        buffertools::create_buffer_H(ctx, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, size, &staging);
+        vkCheck(vmaMapMemory(ctx.vmaAllocator, staging.memory, &staging.data));
+        recording.dedicatedStaging.push_back(staging);
+        return { staging.buffer, staging.memory, 0, staging.data };
+    }
+
+    VkDeviceSize offset;
+    while (!tryReserveRing(size, offset)) {
+        if (!inFlight.empty()) {
+            retireBatches(true);
+        } else {
+            // Only our own batch holds the ring
+            submitBatch(lock);
+        }
+    }
+    return { ring.buffer, ring.memory, offset, ring.getData<uchar>() + offset };
+}
+
+bool UploadManager::tryReserveRing(VkDeviceSize size, VkDeviceSize& offset) {
+    // Nothing is reserved or in flight, start over instead of skipping the remainder of the ring
+    if (ringHead == ringTail && inFlight.empty()) {
+        ringHead = ringTail = 0;
+    }
+
+    // Head and tail only grow, the physical offset wraps. Allocations never straddle the end
+    VkDeviceSize head = (ringHead + stagingAlignment - 1) & ~(stagingAlignment - 1);
+    VkDeviceSize physical = head % info.ringSize;
+    if (physical + size > info.ringSize) {
+        head += info.ringSize - physical;
+        physical = 0;
+    }
+    if (head + size - ringTail > info.ringSize) {
+        return false;
+    }
+    ringHead = head + size;
+    offset = physical;
+    return true;
+}
+
+void UploadManager::beginBatch() {
+    if (recording.cmdBuffer != VK_NULL_HANDLE) return;
+
+    auto allocInfo = vks::initializers::commandBufferAllocateInfo(commandPool, VK_COMMAND_BUFFER_LEVEL_PRIMARY, 1);
+    vkCheck(vkAllocateCommandBuffers(ctx.vkDevice, &allocInfo, &recording.cmdBuffer));
+    auto beginInfo = vks::initializers::commandBufferBeginInfo();
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    vkCheck(vkBeginCommandBuffer(recording.cmdBuffer, &beginInfo));
+
+    if (freeFences.empty()) {
+        auto fenceInfo = vks::initializers::fenceCreateInfo();
+        vkCheck(vkCreateFence(ctx.vkDevice, &fenceInfo, nullptr, &recording.fence));
+    } else {
+        recording.fence = freeFences.back();
+        freeFences.pop_back();
+    }
+    recording.token = nextToken++;
+}
+
+void UploadManager::submitBatch(std::unique_lock<std::mutex>& lock) {
+    writesDone.wait(lock, [this]() { return recording.pendingWrites == 0; });
+    if (recording.cmdBuffer == VK_NULL_HANDLE) return;
+
+    if (useTransferQueue) {
+        submitTransferBatch();
+    } else {
+        submitGraphicsBatch();
+    }
+
+    recording.ringEnd = ringHead;
+    inFlight.push_back(std::move(recording));
+    recording = Batch{};
+}
+
+void UploadManager::submitGraphicsBatch() {
+    // Everything submitted after this batch sees the uploaded data
+    auto barrier = vks::initializers::memoryBarrier();
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT;
+    vkCmdPipelineBarrier(
+            recording.cmdBuffer,
+            VK_PIPELINE_STAGE_TRANSFER_BIT,
+            VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+            0,
+            1, &barrier,
+            0, nullptr,
+            0, nullptr);
+    vkCheck(vkEndCommandBuffer(recording.cmdBuffer));
+
+    auto submitInfo = vks::initializers::submitInfo(&recording.cmdBuffer);
+    std::lock_guard<std::mutex> queueLock(ctx.graphicsQueueMutex);
+    vkCheck(vkQueueSubmit(ctx.queues.graphics, 1, &submitInfo, recording.fence));
+}
+
+void UploadManager::submitTransferBatch() {
+    const uint32_t transferFamily = ctx.queueFamilies.transfer.value();
+    const uint32_t graphicsFamily = ctx.queueFamilies.graphics.value();
+
+    // A buffer filled by several copies is transferred once
+    std::sort(recording.buffers.begin(), recording.buffers.end());
+    recording.buffers.erase(std::unique(recording.buffers.begin(), recording.buffers.end()), recording.buffers.end());
+
+    // Release on the transfer queue and acquire the same barriers on the graphics queue
+    std::vector<VkBufferMemoryBarrier> releaseBuffers, acquireBuffers;
+    for(auto buffer : recording.buffers) {
+        releaseBuffers.push_back(buffertools::ownership_barrier(buffer, transferFamily, graphicsFamily, VK_ACCESS_TRANSFER_WRITE_BIT, 0));
+        acquireBuffers.push_back(buffertools::ownership_barrier(buffer, transferFamily, graphicsFamily, 0, VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT));
+    }
+    std::vector<VkImageMemoryBarrier> releaseImages, acquireImages;
+    for(const auto& [image, layout] : recording.images) {
+        releaseImages.push_back(imagetools::ownership_barrier(image, transferFamily, graphicsFamily, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, layout, VK_ACCESS_TRANSFER_WRITE_BIT, 0));
+        acquireImages.push_back(imagetools::ownership_barrier(image, transferFamily, graphicsFamily, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, layout, 0, VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT));
+    }
+
+    vkCmdPipelineBarrier(
+            recording.cmdBuffer,
+            VK_PIPELINE_STAGE_TRANSFER_BIT,
+            VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+            0,
+            0, nullptr,
+            static_cast<uint32_t>(releaseBuffers.size()), releaseBuffers.data(),
+            static_cast<uint32_t>(releaseImages.size()), releaseImages.data());
+    vkCheck(vkEndCommandBuffer(recording.cmdBuffer));
+
+    auto allocInfo = vks::initializers::commandBufferAllocateInfo(acquirePool, VK_COMMAND_BUFFER_LEVEL_PRIMARY, 1);
+    vkCheck(vkAllocateCommandBuffers(ctx.vkDevice, &allocInfo, &recording.acquireCmdBuffer));
+    auto beginInfo = vks::initializers::commandBufferBeginInfo();
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    vkCheck(vkBeginCommandBuffer(recording.acquireCmdBuffer, &beginInfo));
+    vkCmdPipelineBarrier(
+            recording.acquireCmdBuffer,
+            VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+            VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+            0,
+            0, nullptr,
+            static_cast<uint32_t>(acquireBuffers.size()), acquireBuffers.data(),
+            static_cast<uint32_t>(acquireImages.size()), acquireImages.data());
+    vkCheck(vkEndCommandBuffer(recording.acquireCmdBuffer));
+
+    if (freeSemaphores.empty()) {
+        auto semaphoreInfo = vks::initializers::semaphoreCreateInfo();
+        vkCheck(vkCreateSemaphore(ctx.vkDevice, &semaphoreInfo, nullptr, &recording.released));
+    } else {
+        recording.released = freeSemaphores.back();
+        freeSemaphores.pop_back();
+    }
+
+    auto releaseSubmit = vks::initializers::submitInfo(&recording.cmdBuffer);
+    releaseSubmit.signalSemaphoreCount = 1;
+    releaseSubmit.pSignalSemaphores = &recording.released;
+    {
+        std::lock_guard<std::mutex> queueLock(ctx.transferQueueMutex);
+        vkCheck(vkQueueSubmit(ctx.queues.transfer, 1, &releaseSubmit, VK_NULL_HANDLE));
+    }
+
+    const VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+    auto acquireSubmit = vks::initializers::submitInfo(&recording.acquireCmdBuffer);
+    acquireSubmit.waitSemaphoreCount = 1;
+    acquireSubmit.pWaitSemaphores = &recording.released;
+    acquireSubmit.pWaitDstStageMask = &waitStage;
+    std::lock_guard<std::mutex> queueLock(ctx.graphicsQueueMutex);
+    vkCheck(vkQueueSubmit(ctx.queues.graphics, 1, &acquireSubmit, recording.fence));
+}
+
+void UploadManager::retireBatches(bool waitOldest) {
+    if (waitOldest && !inFlight.empty()) {
+        vkCheck(vkWaitForFences(ctx.vkDevice, 1, &inFlight.front().fence, VK_TRUE, UINT64_MAX));
+    }
+
+    while (!inFlight.empty() && vkGetFenceStatus(ctx.vkDevice, inFlight.front().fence) == VK_SUCCESS) {
+        auto& batch = inFlight.front();
+        ringTail = batch.ringEnd;
+        completedToken = batch.token;
+
+        vkFreeCommandBuffers(ctx.vkDevice, commandPool, 1, &batch.cmdBuffer);
+        if (batch.acquireCmdBuffer != VK_NULL_HANDLE) {
+            vkFreeCommandBuffers(ctx.vkDevice, acquirePool, 1, &batch.acquireCmdBuffer);
+            // The fence signalled after the wait, so the semaphore is unsignalled again
+            freeSemaphores.push_back(batch.released);
+        }
+        vkCheck(vkResetFences(ctx.vkDevice, 1, &batch.fence));
+        freeFences.push_back(batch.fence);
+        for(auto& staging : batch.dedicatedStaging) {
+            vmaUnmapMemory(ctx.vmaAllocator, staging.memory);
+            buffertools::destroyBuffer(ctx, staging);
+        }
+        inFlight.pop_front();
+    }
+}
+
+UploadToken UploadManager::flush() {
+    std::unique_lock<std::mutex> lock(mutex);
+    // Nothing recorded, the last submitted batch is the latest one
+    if (recording.cmdBuffer == VK_NULL_HANDLE) {
+        return nextToken - 1;
+    }
+    const UploadToken token = recording.token;
+    submitBatch(lock);
+    return token;
+}
+
+void UploadManager::wait(UploadToken token) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (recording.cmdBuffer != VK_NULL_HANDLE && token >= recording.token) {
+        submitBatch(lock);
+    }
+    // Batches share a queue and finish in order
+    while (completedToken < token && !inFlight.empty()) {
+        retireBatches(true);
+    }
+}
+
+bool UploadManager::isComplete(UploadToken token) {
+    std::unique_lock<std::mutex> lock(mutex);
+    retireBatches(false);
+    return token <= completedToken;
+}
+
+void UploadManager::waitIdle() {
+    wait(flush());
+}
+
+}
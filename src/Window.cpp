@@ -4,7 +4,7 @@
 namespace lv {
 
 Window::Window(AppContext& ctx, WindowInfo info)
-    : FrameManager(ctx), info(info) {
+    : FrameManager(ctx, info.framesInFlight), info(info) {
     createWindow(info.windowName.c_str(), info.width, info.height);
     createSwapchain();
     createSyncObjects();
@@ -85,13 +85,15 @@ void Window::createSwapchain() {
 
 void Window::createSyncObjects() {
     swapchain.imageAvailableSemaphores.resize(nrFramesInFlight);
-    swapchain.renderFinishedSemaphores.resize(nrFramesInFlight);
+    swapchain.renderFinishedSemaphores.resize(swapchain.images.size());
 
     // Create the semaphores
-    for(uint32_t i=0; i<nrFramesInFlight; i++) {
-        auto semInfo = vks::initializers::semaphoreCreateInfo();
-        vkCheck(vkCreateSemaphore(ctx.vkDevice, &semInfo, nullptr, &swapchain.imageAvailableSemaphores[i]));
-        vkCheck(vkCreateSemaphore(ctx.vkDevice, &semInfo, nullptr, &swapchain.renderFinishedSemaphores[i]));
+    auto semInfo = vks::initializers::semaphoreCreateInfo();
+    for(auto& sem : swapchain.imageAvailableSemaphores) {
+        vkCheck(vkCreateSemaphore(ctx.vkDevice, &semInfo, nullptr, &sem));
+    }
+    for(auto& sem : swapchain.renderFinishedSemaphores) {
+        vkCheck(vkCreateSemaphore(ctx.vkDevice, &semInfo, nullptr, &sem));
     }
 }
 
@@ -209,21 +211,31 @@ uint32_t Window::acquireNextFrameIdx() {
 }
 
 void Window::submitFrame(FrameContext& frame) {
-    auto& wFrame = frame.getExtFrame<WindowFrame>();
+    // Presentation only understands binary semaphores, the frame timeline is signalled alongside
+    const std::array<VkSemaphore, 2> signalSemaphores { swapchain.renderFinishedSemaphores[swapchain.imageIdx], timeline };
+    const std::array<uint64_t, 2> signalValues { 0, frame.frameValue };
+    VkTimelineSemaphoreSubmitInfo timelineInfo {
+        .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+        .signalSemaphoreValueCount = static_cast<uint32_t>(signalValues.size()),
+        .pSignalSemaphoreValues = signalValues.data(),
+    };
     auto submitInfo = vks::initializers::submitInfo(&frame.cmdBuffer);
+    submitInfo.pNext = &timelineInfo;
     submitInfo.waitSemaphoreCount = 1;
     submitInfo.pWaitSemaphores = &swapchain.imageAvailableSemaphores[currentInFlight];
     VkShaderStageFlags waitStage = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
     submitInfo.pWaitDstStageMask = &waitStage;
-    submitInfo.signalSemaphoreCount = 1;
-    submitInfo.pSignalSemaphores = &swapchain.renderFinishedSemaphores[currentInFlight];
+    submitInfo.signalSemaphoreCount = static_cast<uint32_t>(signalSemaphores.size());
+    submitInfo.pSignalSemaphores = signalSemaphores.data();
 
-    vkCheck(vkQueueSubmit(ctx.queues.graphics, 1, &submitInfo, frame.frameFinished));
+    // The present queue is usually the graphics queue
+    std::lock_guard<std::mutex> lock(ctx.graphicsQueueMutex);
+    vkCheck(vkQueueSubmit(ctx.queues.graphics, 1, &submitInfo, VK_NULL_HANDLE));
 
     VkPresentInfoKHR presentInfo {
             .sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
             .waitSemaphoreCount = 1,
-            .pWaitSemaphores = &swapchain.renderFinishedSemaphores[currentInFlight],
+            .pWaitSemaphores = &swapchain.renderFinishedSemaphores[swapchain.imageIdx],
             .swapchainCount = 1,
             .pSwapchains = &swapchain.vkSwapchain,
             .pImageIndices = &swapchain.imageIdx,
@@ -0,0 +1,58 @@
+#include <liftedvulkan.h>
+
+// Prebakes the .lvmesh cache of every OBJ below the given directories
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        logger::error("Usage: {} [--force] <directory|file.obj>...", argv[0]);
+        return 1;
+    }
+
+    bool force = false;
+    std::vector<std::filesystem::path> objs;
+    for(int i=1; i<argc; i++) {
+        const std::string arg = argv[i];
+        if (arg == "--force") {
+            force = true;
+            continue;
+        }
+
+        const std::filesystem::path path(arg);
+        if (std::filesystem::is_directory(path)) {
+            for(const auto& entry : std::filesystem::recursive_directory_iterator(path)) {
+                if (entry.is_regular_file() && entry.path().extension() == ".obj") {
+                    objs.push_back(entry.path());
+                }
+            }
+        } else if (std::filesystem::is_regular_file(path)) {
+            objs.push_back(path);
+        } else {
+            logger::error("{} does not exist", arg);
+            return 1;
+        }
+    }
+
+    uint32_t baked = 0;
+    uint32_t failed = 0;
+    for(const auto& obj : objs) {
+        const auto start = std::chrono::steady_clock::now();
+        switch (lv::Mesh::bake(obj.c_str(), force)) {
+            case lv::MeshBakeResult::Baked: {
+                const auto ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+                logger::info("Baked {} in {:.1f}ms", obj.string(), ms);
+                baked++;
+                break;
+            }
+            case lv::MeshBakeResult::UpToDate:
+                logger::info("{} is up to date", obj.string());
+                break;
+            case lv::MeshBakeResult::Failed:
+                logger::error("Could not bake {}", obj.string());
+                failed++;
+                break;
+        }
+    }
+
+    logger::info("Baked {} of {} meshes", baked, objs.size());
+    // Keeps build scripts from shipping stale or missing caches
+    return failed > 0 ? 1 : 0;
+}
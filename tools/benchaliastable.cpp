@@ -0,0 +1,92 @@
+#include <liftedvulkan.h>
+#include <random>
+
+// Classic single threaded Vose with work lists, the baseline the parallel build has to beat
+static std::vector<lv::AliasEntry> build_vose(std::span<const float> weights) {
+    const size_t n = weights.size();
+    const double total = std::accumulate(weights.begin(), weights.end(), 0.0);
+    std::vector<double> scaled(n);
+    std::vector<uint32_t> small, large;
+    for(size_t k=0; k<n; k++) {
+        scaled[k] = weights[k] * n / total;
+        (scaled[k] < 1.0 ? small : large).push_back(static_cast<uint32_t>(k));
+    }
+
+    std::vector<lv::AliasEntry> ret(n);
+    while (!small.empty() && !large.empty()) {
+        const uint32_t s = small.back(); small.pop_back();
+        const uint32_t l = large.back();
+        ret[s] = { static_cast<float>(scaled[s]), l, 0.0f };
+        scaled[l] -= 1.0 - scaled[s];
+        if (scaled[l] < 1.0) {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+    for(uint32_t k : small) ret[k] = { 1.0f, k, 0.0f };
+    for(uint32_t k : large) ret[k] = { 1.0f, k, 0.0f };
+    for(size_t k=0; k<n; k++) ret[k].pdf = static_cast<float>(weights[k] / total);
+    return ret;
+}
+
+// Largest difference between the probability the table gives an item and its normalized weight
+static double max_error(std::span<const float> weights, const std::vector<lv::AliasEntry>& table) {
+    const size_t n = weights.size();
+    const double total = std::accumulate(weights.begin(), weights.end(), 0.0);
+    std::vector<double> mass(n, 0.0);
+    for(size_t k=0; k<n; k++) {
+        mass[k] += table[k].probability;
+        mass[table[k].alias] += 1.0 - table[k].probability;
+    }
+    double ret = 0.0;
+    for(size_t k=0; k<n; k++) ret = std::max(ret, std::abs(mass[k] / n - weights[k] / total));
+    return ret;
+}
+
+template<typename F>
+static float time_ms(uint32_t repetitions, F&& fn) {
+    float best = std::numeric_limits<float>::max();
+    for(uint32_t i=0; i<repetitions; i++) {
+        const auto start = std::chrono::steady_clock::now();
+        fn();
+        best = std::min(best, std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count());
+    }
+    return best;
+}
+
+// Times alias table builds over lognormal light powers, the shape of a scene with a few big lights and many tiny ones
+int main(int argc, char** argv) {
+    std::vector<size_t> counts;
+    for(int i=1; i<argc; i++) {
+        size_t count = 0;
+        const std::string arg = argv[i];
+        if (std::from_chars(arg.data(), arg.data() + arg.size(), count).ec != std::errc() || count == 0) {
+            logger::error("Usage: {} [light count]...", argv[0]);
+            return 1;
+        }
+        counts.push_back(count);
+    }
+    if (counts.empty()) counts = { 10'000, 1'000'000, 4'000'000 };
+
+    const uint32_t repetitions = 5;
+    lv::ThreadPool serial(1);
+    auto& pool = lv::ThreadPool::shared();
+
+    for(size_t count : counts) {
+        std::mt19937 rng(1234);
+        std::lognormal_distribution<float> power(0.0f, 2.5f);
+        std::vector<float> weights(count);
+        for(auto& w : weights) w = power(rng);
+
+        std::vector<lv::AliasEntry> table;
+        const float vose = time_ms(repetitions, [&]() { table = build_vose(weights); });
+        const double voseError = max_error(weights, table);
+        const float single = time_ms(repetitions, [&]() { table = lv::aliastable::build(weights, serial); });
+        const float parallel = time_ms(repetitions, [&]() { table = lv::aliastable::build(weights, pool); });
+        const double parallelError = max_error(weights, table);
+
+        logger::info("{:>9} lights: vose {:8.2f}ms, sweep 1 thread {:8.2f}ms, sweep {} threads {:8.2f}ms ({:.1f}x), max error {:.2e} / {:.2e}",
+            count, vose, single, pool.getNrThreads(), parallel, vose / parallel, voseError, parallelError);
+    }
+    return 0;
+}
@@ -0,0 +1,108 @@
+#include <liftedvulkan.h>
+
+struct Mode {
+    const char* name;
+    lv::RayTracerBackend backend;
+    lv::RayReordering reordering;
+};
+
+// Effective rays per second on Sibenik with and without reordering bounce rays. Only the
+// wavefront counts its rays, the megakernel modes report their frame time alone. Run from the
+// repository root so the scene and the shaders are found.
+int main(int argc, char** argv) {
+    uint32_t nrFrames = 64;
+    if (argc > 1) {
+        const std::string arg = argv[1];
+        if (std::from_chars(arg.data(), arg.data() + arg.size(), nrFrames).ec != std::errc() || nrFrames == 0) {
+            logger::error("Usage: {} [frames per mode]", argv[0]);
+            return 1;
+        }
+    }
+    const uint32_t warmupFrames = 8;
+
+    lv::AppContextInfo info;
+    info.registerExtension<lv::OffscreenFrameManager>();
+    info.registerExtension<lv::ResourceStore>();
+    info.registerExtension<lv::RayTracer>();
+    info.registerExtension<lv::GpuProfiler>();
+    lv::AppContext ctx(info);
+
+    lv::RayTracerInfo rayInfo{};
+    rayInfo.accumulationMode = lv::AccumulationMode::Sum32;
+    rayInfo.adaptiveSampling = false;
+    rayInfo.allowWavefront = true;
+
+    lv::ResourceStoreInfo resourceStoreInfo;
+    resourceStoreInfo.defineStaticImage(1, rayInfo.getAccumulationFormat(), VK_IMAGE_USAGE_STORAGE_BIT, VK_IMAGE_LAYOUT_GENERAL,
+        [](lv::FrameContext& frame) { return frame.getExtFrame<lv::WindowFrame>().width; },
+        [](lv::FrameContext& frame) { return frame.getExtFrame<lv::WindowFrame>().height; });
+    ctx.addExtension<lv::ResourceStore>(ctx, resourceStoreInfo);
+
+    lv::Mesh sibenik, cube;
+    cube.load("./app/cube.obj");
+    sibenik.load("./app/sibenik/sibenik.obj");
+    rayInfo.addMesh(&sibenik);
+    rayInfo.addMesh(&cube);
+    auto& raytracer = ctx.addExtension<lv::RayTracer>(ctx, rayInfo);
+    if (!raytracer.supportsWavefront()) {
+        logger::error("No indirect ray tracing on this device, there is no wavefront backend to compare against");
+        return 1;
+    }
+    auto& profiler = ctx.addExtension<lv::GpuProfiler>(ctx);
+    if (!profiler.isSupported()) {
+        logger::error("Timestamp queries are not supported, nothing to time with");
+        return 1;
+    }
+
+    // One frame at a time, so every profiler scope times its own frame and nothing overlapping it
+    lv::OffscreenInfo offscreenInfo { .width = 1280, .height = 768, .framesInFlight = 1 };
+    auto& frames = ctx.addFrameManager<lv::OffscreenFrameManager>(ctx, offscreenInfo);
+
+    // Never updated, so no window is needed
+    lv::Camera camera{nullptr};
+    camera.eye = glm::vec3(0, -5, 0);
+
+    std::vector<Mode> modes {
+        { "wavefront", lv::RayTracerBackend::Wavefront, lv::RayReordering::None },
+        { "wavefront sorted", lv::RayTracerBackend::Wavefront, lv::RayReordering::Sort },
+        { "megakernel", lv::RayTracerBackend::Megakernel, lv::RayReordering::None },
+    };
+    if (raytracer.supportsExecutionReorder()) {
+        modes.push_back({ "megakernel reordered", lv::RayTracerBackend::Megakernel, lv::RayReordering::ExecutionReorder });
+    } else {
+        logger::info("No shader execution reorder on this device, skipping the reordered megakernel");
+    }
+
+    for(const auto& mode : modes) {
+        raytracer.setBackend(mode.backend);
+        raytracer.setRayReordering(mode.reordering);
+
+        double milliseconds = 0.0;
+        uint64_t rays = 0;
+        for(uint32_t i=0; i<warmupFrames + nrFrames; i++) {
+            frames.nextFrame([&](lv::FrameContext& frame) {
+                lv::GpuProfiler::Scope scope(profiler, frame, "RayTracer");
+                raytracer.render(frame, camera, true);
+            });
+            // Timings lag a few frames behind, in steady state that does not matter
+            if (i >= warmupFrames) {
+                for(const auto& timing : profiler.getTimings()) {
+                    if (timing.name == "RayTracer") milliseconds += timing.getMilliseconds();
+                }
+            }
+            // Taken every frame, the GPU counters are only 32 bit
+            const uint64_t frameRays = raytracer.takeWavefrontRayCount();
+            if (i >= warmupFrames) rays += frameRays;
+        }
+
+        const double frameMs = milliseconds / nrFrames;
+        if (mode.backend != lv::RayTracerBackend::Wavefront) {
+            logger::info("{:<22} {:8.3f}ms per frame", mode.name, frameMs);
+            continue;
+        }
+        const double raysPerFrame = static_cast<double>(rays) / nrFrames;
+        logger::info("{:<22} {:8.3f}ms per frame, {:7.1f}M rays per frame, {:8.1f}M rays/s",
+            mode.name, frameMs, raysPerFrame * 1e-6, raysPerFrame / frameMs * 1e-3);
+    }
+    return 0;
+}